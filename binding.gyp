@@ -4,13 +4,26 @@
     "target_name": "btle",
       "sources": [
         "src/att.cc",
+        "src/attProxy.cc",
+        "src/attributeMirror.cc",
         "src/btio.c",
         "src/btleException.cc",
+        "src/bufferPool.cc",
+        "src/bufferSlab.cc",
         "src/central.cc",
         "src/connection.cc",
         "src/debug.cc",
+        "src/gattCache.cc",
+        "src/gattDiscovery.cc",
         "src/hci.cc",
+        "src/ioThread.cc",
+        "src/notificationBatch.cc",
+        "src/notificationFilter.cc",
+        "src/notificationRing.cc",
         "src/peripheral.cc",
+        "src/sigDecoder.cc",
+        "src/timerWheel.cc",
+        "src/transport.cc",
         "src/util.cc"
       ],
       "link_settings": {
@@ -22,6 +22,39 @@ module.exports.debug = function() {
   return debug;
 }
 
+// Cache discovered GATT databases in the given file, so reconnecting
+// devices don't need discovering again. Pass null to turn caching off.
+module.exports.setGattCache = function(path) {
+  if (path !== null && typeof path != 'string') {
+    throw new TypeError('setGattCache takes a file path, or null');
+  }
+  btle.setGattCache(path);
+}
+
+// Spread new connections across this many native I/O threads, each with its
+// own event loop, so socket I/O and ATT parsing happen off the main thread.
+// 0 (the default) keeps everything on the main thread.
+module.exports.setIOThreads = function(count) {
+  if (typeof count != 'number' || count < 0 || count % 1 != 0) {
+    throw new TypeError('setIOThreads takes a number of threads');
+  }
+  btle.setIOThreads(count);
+}
+
+// Deliver notifications for listeners added without a callback in batches,
+// once per event loop iteration. The callback gets (values, index, count) -
+// see the README for the layout. Pass null to turn batching off.
+module.exports.setNotificationBatchCallback = function(callback) {
+  if (callback !== null && typeof callback != 'function') {
+    throw new TypeError('setNotificationBatchCallback takes a callback, or null');
+  }
+  btle.setNotificationBatchCallback(callback);
+}
+
+// Ring buffer for notifications, which JS reads at its own pace - pass one
+// to addNotificationListener() instead of a callback
+module.exports.NotificationRing = require('./notificationRing');
+
 // javascript shim that lets our object inherit from EventEmitter
 inherits(PeripheralInterface, events.EventEmitter);
 inherits(CentralInterface, events.EventEmitter);
@@ -44,6 +77,14 @@ module.exports.listen = function(opts, callback) {
   central.listen(opts, callback);
 }
 
+// Transports, given as the 'transport' option to connect() and listen().
+// With the unix transport, connect() takes the socket path as its destination,
+// and listen() takes it as the 'path' option.
+module.exports.Transports = {
+  L2CAP : 'l2cap',
+  UNIX  : 'unix'
+}
+
 // Bluetooth I/O types
 module.exports.IOTypes = {
   L2CAP  : 0,
@@ -0,0 +1,59 @@
+// Ring buffer of notifications, written natively as they come in, without
+// calling into JS, and read here whenever it suits. See
+// src/notificationRing.h for the layout.
+
+var HEADER_SIZE = 16;
+var RECORD_HEADER_SIZE = 16;
+var WRAP = 0xFFFF;
+
+// Create a ring with room for at least size bytes of records (each of which
+// is 16 bytes plus the value, rounded up to a multiple of 4)
+var NotificationRing = module.exports = function(size) {
+  if (typeof size != 'number' || size <= 0) {
+    throw new TypeError('NotificationRing takes a size in bytes');
+  }
+  var capacity = RECORD_HEADER_SIZE;
+  while (capacity < size) capacity *= 2;
+
+  this.capacity = capacity;
+  this.buffer = new Buffer(HEADER_SIZE + capacity);
+  this.buffer.fill(0);
+  this.buffer.writeUInt32LE(capacity, 12);
+}
+
+// Number of notifications dropped because the ring was full
+NotificationRing.prototype.getDrops = function() {
+  return this.buffer.readUInt32LE(8);
+}
+
+// Call fn(connectionId, handle, value, timestamp) for each notification in
+// the ring, oldest first, and return how many there were. The value is a
+// slice of the ring, which may be overwritten once read() returns, so copy
+// it to keep it.
+NotificationRing.prototype.read = function(fn) {
+  var buffer = this.buffer;
+  var mask = this.capacity - 1;
+  var write = buffer.readUInt32LE(0);
+  var read = buffer.readUInt32LE(4);
+  var count = 0;
+
+  while (read != write) {
+    var position = read & mask;
+    var offset = HEADER_SIZE + position;
+    var length = buffer.readUInt16LE(offset);
+    if (length == WRAP) {
+      // Rest of the ring's unused - the next record's at the start
+      read = (read + this.capacity - position) >>> 0;
+      continue;
+    }
+
+    var start = offset + RECORD_HEADER_SIZE;
+    fn(buffer.readUInt32LE(offset + 4), buffer.readUInt16LE(offset + 2),
+      buffer.slice(start, start + length), buffer.readDoubleLE(offset + 8));
+    read = (read + ((RECORD_HEADER_SIZE + length + 3) & ~3)) >>> 0;
+    count++;
+  }
+
+  buffer.writeUInt32LE(read, 4);
+  return count;
+}
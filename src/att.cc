@@ -1,31 +1,31 @@
 #include <errno.h>
+#include <string>
 
 #include "att.h"
 #include "btio.h"
 #include "util.h"
 
-// Guard class for mutexes
-class LockGuard
-{
-public:
-  LockGuard(pthread_mutex_t m) : lock(m) {
-    pthread_mutex_lock(&lock);
-  }
-
-  ~LockGuard() {
-    pthread_mutex_unlock(&lock);
-  }
+// Prepare Write requests for a long/reliable write, encoded up front
+struct Att::prepareQueue {
+  prepareQueue() : next(0), failed(false) {}
 
-private:
-  pthread_mutex_t lock;
+  std::vector<uint8_t> pdus; // All the PDUs, back to back
+  std::vector<size_t> ends;  // Where each PDU ends in pdus
+  size_t next;               // Index of the next PDU to send
+  bool failed;               // Whether we're cancelling rather than executing
+  std::string error;         // Why we're cancelling
 };
 
 // Struct for read callbacks
 struct Att::readData {
   readData()
     : request(0), expectedResponse(0), att(NULL), data(NULL),
-      handle(0), value(NULL), vlen(0), callback(NULL), readAttrCb(NULL), attrListCb(NULL)
-  {}
+      handle(0), value(NULL), vlen(0), callback(NULL), readAttrCb(NULL), attrListCb(NULL),
+      writeCb(NULL), mtuCb(NULL), readLongCb(NULL), offset(0), stream(false), expectedLength(0),
+      prepared(NULL), cancelled(false), epoch(0), timeout(0), nextListener(NULL), filter(NULL)
+  {
+    pdu = uv_buf_init(NULL, 0);
+  }
 
   opcode_t request;
   opcode_t expectedResponse;
@@ -38,6 +38,22 @@ struct Att::readData {
   ReadCallback callback;
   ReadAttributeCallback readAttrCb;
   AttributeListCallback attrListCb;
+  Connection::WriteCallback writeCb;
+  MTUCallback mtuCb;
+  ReadLongCallback readLongCb;
+  size_t offset;              // Offset of the next chunk of a long read
+  bool stream;                // Whether to hand back a long read chunk by chunk
+  std::vector<uint8_t> blob;  // Long read value, when not streaming
+  size_t expectedLength;      // Fixed length of the value being read, if known
+  std::vector<struct readData*> subRequests; // Reads combined into a Read Multiple
+  struct prepareQueue* prepared;              // Prepared writes
+  uv_buf_t pdu; // Encoded request, sent when this reaches the head of the queue
+  bool cancelled; // Whether the callbacks have been taken away by cancel()
+  uint32_t epoch; // Write epoch the read was made in - see findRead()
+  uint64_t timeout; // Transaction timeout, if not the connection's
+  std::vector<struct readData*> joined; // Reads of the same handle sharing this one's response
+  struct readData* nextListener; // Next notification listener for the same handle
+  NotificationFilter* filter;    // Notification listener's filter, if any
 };
 
 // Encode a Bluetooth LE packet
@@ -136,25 +152,70 @@ Att::encode(uint8_t opcode, uint16_t startHandle, uint16_t endHandle, const bt_u
 }
 
 // Constructor
-Att::Att()
-  : connection(new Connection()), errorHandler(NULL), errorData(NULL), currentRequest(NULL),
+Att::Att(uv_loop_t* loop)
+  : loop(loop), connection(new Connection(loop)), mtu(ATT_DEFAULT_LE_MTU), errorHandler(NULL), errorData(NULL), currentRequest(NULL),
+    timerWheel(TimerWheel::get(loop)), requestTimeout(DEFAULT_TIMEOUT), closedError(NULL), writeEpoch(0),
     attributeList(NULL), groupAttributeList(NULL), handlesInfoList(NULL)
 {
   connection->registerReadCallback(onRead, static_cast<void*>(this));
-  pthread_mutex_init(&notificationMapLock, NULL);
+
+  flushHandle = new uv_prepare_t;
+  flushHandle->data = this;
+  uv_prepare_init(loop, flushHandle);
 }
 
 // Destructor
 Att::~Att()
 {
-  pthread_mutex_destroy(&notificationMapLock);
+  notificationTable.forEach(deleteListeners);
+  timerWheel->stop(requestTimer);
+
+  uv_close((uv_handle_t*) flushHandle, onFlushHandleClose);
+  for (ReadList::iterator it = pendingReads.begin(); it != pendingReads.end(); ++it) {
+    deleteRequest(*it);
+  }
+  for (ReadList::iterator it = failedRequests.begin(); it != failedRequests.end(); ++it) {
+    deleteRequest(*it);
+  }
+  for (ReadList::iterator it = cachedReads.begin(); it != cachedReads.end(); ++it) {
+    deleteRequest(*it);
+  }
+
+  // Drop any requests which never made it out
+  while (!requestQueue.empty()) {
+    struct readData* rd = requestQueue.front();
+    requestQueue.pop_front();
+    Connection::releaseBuffer(rd->pdu);
+    deleteRequest(rd);
+  }
+  if (currentRequest != NULL) deleteRequest(currentRequest);
+
   delete connection;
 }
 
 void
-Att::connect(struct set_opts& opts, Connection::ConnectCallback connect, void* data)
+Att::onFlushHandleClose(uv_handle_t* handle)
+{
+  delete (uv_prepare_t*) handle;
+}
+
+void
+Att::deleteRequest(struct readData* rd)
+{
+  for (ReadList::iterator it = rd->subRequests.begin(); it != rd->subRequests.end(); ++it) {
+    deleteRequest(*it);
+  }
+  for (ReadList::iterator it = rd->joined.begin(); it != rd->joined.end(); ++it) {
+    delete *it;
+  }
+  delete rd->prepared;
+  delete rd;
+}
+
+void
+Att::connect(Transport* transport, Connection::ConnectCallback connect, void* data)
 {
-  connection->connect(opts, connect, data);
+  connection->connect(transport, connect, data);
 }
 
 void
@@ -163,8 +224,8 @@ Att::close(Connection::CloseCallback cb, void* data)
   connection->close(cb, data);
 }
 
-bool
-Att::setCurrentRequest(opcode_t request, opcode_t response, void* data,
+struct Att::readData*
+Att::newRequest(opcode_t request, opcode_t response, void* data,
     handle_t handle, ReadCallback callback, ReadAttributeCallback readAttrCb)
 {
   // Set up the callback for the read
@@ -177,14 +238,11 @@ Att::setCurrentRequest(opcode_t request, opcode_t response, void* data,
   rd->callback = callback;
   rd->readAttrCb = readAttrCb;
 
-  bool ret =__sync_bool_compare_and_swap(&currentRequest, NULL, rd);
-  if (!ret) delete rd;
-
-  return ret;
+  return rd;
 }
 
-bool
-Att::setCurrentRequest(opcode_t request, opcode_t response, void* data, handle_t handle, const bt_uuid_t* type,
+struct Att::readData*
+Att::newRequest(opcode_t request, opcode_t response, void* data, handle_t handle, const bt_uuid_t* type,
     ReadCallback callback, AttributeListCallback attrCallback, const uint8_t* value, size_t vlen)
 {
   // Set up the callback for the read
@@ -202,10 +260,140 @@ Att::setCurrentRequest(opcode_t request, opcode_t response, void* data, handle_t
   rd->attrListCb = attrCallback;
   rd->callback = callback;
 
-  bool ret =__sync_bool_compare_and_swap(&currentRequest, NULL, rd);
-  if (!ret) delete rd;
+  return rd;
+}
 
-  return ret;
+//
+// Queue a request. ATT only allows one outstanding request per bearer, so if
+// there's already one in flight, this one waits its turn, and is sent as soon
+// as the response for the one before it comes in.
+// Arguments:
+//  rd  - The request
+//  pdu - The encoded request, which we take ownership of
+//
+void
+Att::queueRequest(struct readData* rd, const uv_buf_t& pdu)
+{
+  // Reads waiting to be combined were made first, so they go first
+  if (!pendingReads.empty()) flushPendingReads();
+
+  if (closedError != NULL) {
+    // The bearer's dead, so fail it - but not until the caller's returned
+    uv_buf_t buf = pdu;
+    Connection::releaseBuffer(buf);
+    if (failedRequests.empty()) uv_prepare_start(flushHandle, onFlushPendingReads);
+    failedRequests.push_back(rd);
+    return;
+  }
+
+  rd->pdu = pdu;
+  if (currentRequest == NULL) {
+    currentRequest = rd;
+    sendCurrentRequest();
+  } else {
+    requestQueue.push_back(rd);
+  }
+}
+
+// Write out the PDU for the current request
+void
+Att::sendCurrentRequest()
+{
+  uv_buf_t buf = currentRequest->pdu;
+  currentRequest->pdu = uv_buf_init(NULL, 0);
+  connection->write(buf);
+  startRequestTimer();
+}
+
+// (Re)start the transaction timer for the current request
+void
+Att::startRequestTimer()
+{
+  uint64_t timeout = getRequestTimeout(currentRequest);
+  if (timeout > 0 && closedError == NULL) {
+    timerWheel->start(requestTimer, timeout, onRequestTimeout, this);
+  }
+}
+
+// The transaction timeout for a request, zero meaning none
+uint64_t
+Att::getRequestTimeout(const struct readData* rd) const
+{
+  return rd != NULL && rd->timeout > 0 ? rd->timeout : requestTimeout;
+}
+
+void
+Att::onRequestTimeout(void* data)
+{
+  Att* att = (Att*) data;
+  att->handleRequestTimeout();
+}
+
+//
+// The device hasn't responded to the current request in time. The spec says
+// a timed out bearer can't be used for any more requests, so we fail this
+// one and everything waiting behind it, and from now on anything new fails
+// straight away.
+//
+void
+Att::handleRequestTimeout()
+{
+  char buffer[128];
+  sprintf(buffer, "%s timed out", currentRequest != NULL ? getOpcodeName(currentRequest->request) : "Request");
+  failAllRequests(buffer, "Request not sent - an earlier request timed out");
+  if (errorHandler != NULL) {
+    errorHandler(errorData, "ATT request timed out - no more requests can be made on this connection");
+  }
+}
+
+//
+// Exchange MTU with the device. The MTU we end up with is the smaller of
+// ours and the device's, and from then on all our PDUs are sized to it.
+// Arguments:
+//  mtu      - The MTU we'd like
+//  callback - The callback, called with the resulting MTU
+//  data     - Optional callback data
+//  timeout  - Transaction timeout in ms, if not the connection's
+//
+void
+Att::exchangeMTU(uint16_t mtu, MTUCallback callback, void* data, uint64_t timeout)
+{
+  // Can't ask for more than the socket can take in
+  uint16_t imtu = connection->getIncomingMTU();
+  if (imtu != 0 && mtu > imtu) mtu = imtu;
+  if (mtu > MAX_MTU) mtu = MAX_MTU;
+  if (mtu < ATT_DEFAULT_LE_MTU) mtu = ATT_DEFAULT_LE_MTU;
+
+  struct readData* rd = newRequest(ATT_OP_MTU_REQ, ATT_OP_MTU_RESP, data, mtu, onExchangeMTU, NULL);
+  rd->mtuCb = callback;
+  rd->timeout = timeout;
+
+  // Note: The MTU goes where the handle would
+  uv_buf_t buf = connection->getBuffer();
+  size_t len = encode(ATT_OP_MTU_REQ, mtu, (uint8_t*) buf.base, buf.len);
+  buf.len = len;
+  queueRequest(rd, buf);
+}
+
+void
+Att::onExchangeMTU(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  return rd->att->handleExchangeMTU(status, rd, buf, len, error);
+}
+
+void
+Att::handleExchangeMTU(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  if (status == 0 && error == NULL && len >= (int) sizeof(uint16_t)) {
+    uint16_t serverMTU = att_get_u16(buf);
+    mtu = serverMTU < rd->handle ? serverMTU : rd->handle;
+    if (mtu < ATT_DEFAULT_LE_MTU) mtu = ATT_DEFAULT_LE_MTU;
+    connection->setMTU(mtu);
+  }
+  removeCurrentRequest();
+  if (rd->mtuCb != NULL) {
+    rd->mtuCb(status, rd->data, mtu, error);
+  }
 }
 
 //
@@ -215,23 +403,17 @@ void
 Att::findInformation(uint16_t startHandle, uint16_t endHandle, AttributeListCallback callback, void* data)
 {
   // Note: We set the handle to the endHandle, so we can know whether we should make repeated calls to get more info
-  if (setCurrentRequest(ATT_OP_FIND_INFO_REQ, ATT_OP_FIND_INFO_RESP, data, endHandle, NULL, onFindInfo, callback)) {
-    doFindInformation(startHandle, endHandle);
-  } else {
-    char buffer[128];
-    sprintf(buffer, "Request already pending: %s", getOpcodeName(currentRequest->request));
-    callback(0, data, NULL, buffer);
-  }
+  struct readData* rd = newRequest(ATT_OP_FIND_INFO_REQ, ATT_OP_FIND_INFO_RESP, data, endHandle, NULL, onFindInfo, callback);
+  queueRequest(rd, doFindInformation(startHandle, endHandle));
 }
 
-void
+uv_buf_t
 Att::doFindInformation(handle_t startHandle, handle_t endHandle)
 {
-  // Write to the device
   uv_buf_t buf = connection->getBuffer();
   size_t len = encode(ATT_OP_FIND_INFO_REQ, startHandle, endHandle, NULL, (uint8_t*) buf.base, buf.len);
   buf.len = len;
-  connection->write(buf);
+  return buf;
 }
 
 void
@@ -245,11 +427,12 @@ Att::handleFindInfo(uint8_t status, struct readData* rd, uint8_t* buf, size_t le
 {
   AttributeInfoList* list = attributeList;
   void* data = rd->data;
-  if (status == 0) {
+  if (status == 0 && error == NULL) {
     if (attributeList == NULL) list = attributeList = new AttributeInfoList();
     parseAttributeList(*attributeList, buf, len);
-    if (attributeList->back()->handle < rd->handle) {
-      doFindInformation(attributeList->back()->handle+1, rd->handle);
+    if (!attributeList->empty() && attributeList->back().handle < rd->handle) {
+      uv_buf_t buf = doFindInformation(attributeList->back().handle+1, rd->handle);
+      connection->write(buf);
     } else {
       removeCurrentRequest();
       attributeList = NULL;
@@ -275,29 +458,21 @@ void
 Att::findByTypeValue(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& type,
   const uint8_t* value, size_t vlen, AttributeListCallback callback, void* data)
 {
-  char buffer[128];
-  bt_uuid_to_string(&type, buffer, sizeof(buffer));
   // Note: We set the handle to the endHandle, so we can know whether we should make repeated calls to get more info
-  if (setCurrentRequest(ATT_OP_FIND_BY_TYPE_REQ, ATT_OP_FIND_BY_TYPE_RESP, data, endHandle,
-        &type, onFindByType, callback, value, vlen)) {
-    doFindByType(startHandle, endHandle, type, value, vlen);
-  } else {
-    char buffer[128];
-    sprintf(buffer, "Request already pending: %s", getOpcodeName(currentRequest->request));
-    callback(0, data, NULL, buffer);
-  }
+  struct readData* rd = newRequest(ATT_OP_FIND_BY_TYPE_REQ, ATT_OP_FIND_BY_TYPE_RESP, data, endHandle,
+        &type, onFindByType, callback, value, vlen);
+  queueRequest(rd, doFindByType(startHandle, endHandle, type, value, vlen));
 }
 
-void
+uv_buf_t
 Att::doFindByType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& type,
   const uint8_t* value, size_t vlen)
 {
-  // Write to the device
   uv_buf_t buf = connection->getBuffer();
   size_t len = encode(ATT_OP_FIND_BY_TYPE_REQ, startHandle, endHandle, &type,
     (uint8_t*) buf.base, buf.len, value, vlen);
   buf.len = len;
-  connection->write(buf);
+  return buf;
 }
 
 void
@@ -311,11 +486,12 @@ Att::handleFindByType(uint8_t status, struct readData* rd, uint8_t* buf, int len
 {
   HandlesInfoList* list = handlesInfoList;
   void* data = rd->data;
-  if (status == 0) {
+  if (status == 0 && error == NULL) {
     if (handlesInfoList == NULL) list = handlesInfoList = new HandlesInfoList();
     parseHandlesInformationList(*handlesInfoList, rd->type, buf, len);
-    if (handlesInfoList->back()->handle < rd->handle) {
-      doFindByType(handlesInfoList->back()->handle+1, rd->handle, rd->type, rd->value, rd->vlen);
+    if (!handlesInfoList->empty() && handlesInfoList->back().handle < rd->handle) {
+      uv_buf_t buf = doFindByType(handlesInfoList->back().handle+1, rd->handle, rd->type, rd->value, rd->vlen);
+      connection->write(buf);
     } else {
       handlesInfoList = NULL;
       removeCurrentRequest();
@@ -346,24 +522,18 @@ void
 Att::readByType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& type,
     AttributeListCallback callback, void* data)
 {
-  if (setCurrentRequest(ATT_OP_READ_BY_TYPE_REQ, ATT_OP_READ_BY_TYPE_RESP, data, endHandle, &type, onReadByType, callback)) {
-    doReadByType(startHandle, endHandle, type);
-  } else {
-    char buffer[128];
-    sprintf(buffer, "Request already pending: %s", getOpcodeName(currentRequest->request));
-    callback(0, data, NULL, buffer);
-  }
+  struct readData* rd = newRequest(ATT_OP_READ_BY_TYPE_REQ, ATT_OP_READ_BY_TYPE_RESP, data, endHandle, &type, onReadByType, callback);
+  queueRequest(rd, doReadByType(startHandle, endHandle, type));
 }
 
-void
+uv_buf_t
 Att::doReadByType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& type)
 {
-  // Write to the device
   uv_buf_t buf = connection->getBuffer();
   size_t len = encode(ATT_OP_READ_BY_TYPE_REQ, startHandle, endHandle, &type,
     (uint8_t*) buf.base, buf.len);
   buf.len = len;
-  connection->write(buf);
+  return buf;
 }
 
 void
@@ -394,26 +564,18 @@ void
 Att::readByGroupType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& type,
     AttributeListCallback callback, void* data)
 {
-  char buffer[128];
-  bt_uuid_to_string(&type, buffer, sizeof(buffer));
-  if (setCurrentRequest(ATT_OP_READ_BY_GROUP_REQ, ATT_OP_READ_BY_GROUP_RESP, data, endHandle, &type, onReadByGroupType, callback)) {
-    doReadByGroupType(startHandle, endHandle, type);
-  } else {
-    char buffer[128];
-    sprintf(buffer, "Request already pending: %s", getOpcodeName(currentRequest->request));
-    callback(0, data, NULL, buffer);
-  }
+  struct readData* rd = newRequest(ATT_OP_READ_BY_GROUP_REQ, ATT_OP_READ_BY_GROUP_RESP, data, endHandle, &type, onReadByGroupType, callback);
+  queueRequest(rd, doReadByGroupType(startHandle, endHandle, type));
 }
 
-void
+uv_buf_t
 Att::doReadByGroupType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& type)
 {
-  // Write to the device
   uv_buf_t buf = connection->getBuffer();
   size_t len = encode(ATT_OP_READ_BY_GROUP_REQ, startHandle, endHandle, &type,
     (uint8_t*) buf.base, buf.len);
   buf.len = len;
-  connection->write(buf);
+  return buf;
 }
 
 void
@@ -427,11 +589,12 @@ Att::handleReadByGroupType(uint8_t status, struct readData* rd, uint8_t* buf, in
 {
   GroupAttributeDataList* list = groupAttributeList;
   void* data = rd->data;
-  if (status == 0) {
+  if (status == 0 && error == NULL) {
     if (groupAttributeList == NULL) list = groupAttributeList = new GroupAttributeDataList();
     parseGroupAttributeDataList(*groupAttributeList, rd->type, buf, len);
-    if (groupAttributeList->back()->handle < rd->handle) {
-      doReadByGroupType(groupAttributeList->back()->handle+1, rd->handle, rd->type);
+    if (!groupAttributeList->empty() && groupAttributeList->back().handle < rd->handle) {
+      uv_buf_t buf = doReadByGroupType(groupAttributeList->back().handle+1, rd->handle, rd->type);
+      connection->write(buf);
     } else {
       groupAttributeList = NULL;
       removeCurrentRequest();
@@ -456,29 +619,299 @@ Att::handleReadByGroupType(uint8_t status, struct readData* rd, uint8_t* buf, in
 //  handle   - The handle
 //  callback - The callback
 //  data     - Optional callback data
+//  length   - The length of the value, if it's fixed and known. Reads with a
+//             known length made in the same event loop tick get combined into
+//             Read Multiple requests.
+//  maxAge   - If non-zero, how old a value from the mirror can be, in ms
+//  timeout  - Transaction timeout in ms, if not the connection's
 //
 void
-Att::readAttribute(uint16_t handle, ReadAttributeCallback callback, void* data)
+Att::readAttribute(uint16_t handle, ReadAttributeCallback callback, void* data, size_t length, uint64_t maxAge,
+  uint64_t timeout)
+{
+  struct readData* rd = newRequest(ATT_OP_READ_REQ, ATT_OP_READ_RESP, data, handle, onReadAttribute, callback);
+  rd->epoch = writeEpoch;
+  rd->timeout = timeout;
+
+  // A recent enough value saves asking the device. It's still passed back
+  // asynchronously, so the caller can cancel it like any other read.
+  uint64_t age;
+  if (maxAge > 0 && mirror.get(handle, maxAge, rd->blob, age)) {
+    uv_prepare_start(flushHandle, onFlushPendingReads);
+    cachedReads.push_back(rd);
+    return;
+  }
+
+  // If the same value's already being read, share its response
+  struct readData* shared = findRead(handle);
+  if (shared != NULL) {
+    shared->joined.push_back(rd);
+    return;
+  }
+
+  if (length > 0 && length < (size_t) mtu - 1 && closedError == NULL) {
+    rd->expectedLength = length;
+    if (pendingReads.empty()) uv_prepare_start(flushHandle, onFlushPendingReads);
+    pendingReads.push_back(rd);
+  } else {
+    queueRequest(rd, doReadAttribute(handle));
+  }
+}
+
+//
+// Find a read of the handle which a new read can share the response of -
+// one which is in flight, queued or waiting to be combined. It mustn't have
+// been made before a write, since its value could be from before the write
+// too, while the caller expects to see the write's effect.
+// Arguments:
+//  handle - The handle
+//
+struct Att::readData*
+Att::findRead(handle_t handle)
+{
+  struct readData* rd = findRead(currentRequest, handle);
+  for (RequestQueue::iterator it = requestQueue.begin(); rd == NULL && it != requestQueue.end(); ++it) {
+    rd = findRead(*it, handle);
+  }
+  for (ReadList::iterator it = pendingReads.begin(); rd == NULL && it != pendingReads.end(); ++it) {
+    rd = findRead(*it, handle);
+  }
+  return rd;
+}
+
+// Check a request, or the reads combined into it, for a read of the handle
+struct Att::readData*
+Att::findRead(struct readData* rd, handle_t handle)
+{
+  if (rd == NULL) return NULL;
+  for (ReadList::iterator it = rd->subRequests.begin(); it != rd->subRequests.end(); ++it) {
+    if (!(*it)->cancelled && (*it)->handle == handle && (*it)->epoch == writeEpoch) return *it;
+  }
+  if (rd->cancelled || rd->callback != onReadAttribute || rd->handle != handle || rd->epoch != writeEpoch) {
+    return NULL;
+  }
+  return rd;
+}
+
+// Call back a read, and the reads sharing its response
+void
+Att::callbackRead(struct readData* rd, uint8_t status, uint8_t* buf, int len, const char* error)
+{
+  rd->readAttrCb(status, rd->data, buf, len, error);
+  for (ReadList::iterator it = rd->joined.begin(); it != rd->joined.end(); ++it) {
+    (*it)->readAttrCb(status, (*it)->data, buf, len, error);
+  }
+}
+
+uv_buf_t
+Att::doReadAttribute(handle_t handle)
+{
+  uv_buf_t buf = connection->getBuffer();
+  size_t len = encode(ATT_OP_READ_REQ, handle, (uint8_t*) buf.base, buf.len);
+  buf.len = len;
+  return buf;
+}
+
+//
+// Called at the end of the event loop tick, to send all the fixed length reads
+// made during it. We pack as many as we can into each Read Multiple request -
+// the response is the values concatenated, so they all have to fit in one PDU.
+//
+void
+Att::onFlushPendingReads(uv_prepare_t* handle, int status)
+{
+  Att* att = (Att*) handle->data;
+  uv_prepare_stop(handle);
+  att->flushPendingReads();
+  att->flushFailedRequests();
+  att->flushCachedReads();
+
+  // We're in the prepare phase, so the connection's own flush might not run
+  // until after the loop's polled
+  att->connection->flush();
+}
+
+void
+Att::flushPendingReads()
+{
+  ReadList reads;
+  reads.swap(pendingReads);
+
+  ReadList::iterator iter = reads.begin();
+  while (iter != reads.end()) {
+    // Figure out how many will fit
+    ReadList::iterator end = iter;
+    size_t requestLen = sizeof(opcode_t);
+    size_t responseLen = sizeof(opcode_t);
+    while (end != reads.end() &&
+        requestLen + sizeof(handle_t) <= mtu &&
+        responseLen + (*end)->expectedLength <= mtu) {
+      requestLen += sizeof(handle_t);
+      responseLen += (*end)->expectedLength;
+      ++end;
+    }
+
+    if (end - iter == 1) {
+      queueRequest(*iter, doReadAttribute((*iter)->handle));
+    } else {
+      struct readData* rd = newRequest(ATT_OP_READ_MULTI_REQ, ATT_OP_READ_MULTI_RESP, NULL, 0, onReadMultiple, NULL);
+      rd->subRequests.assign(iter, end);
+      uv_buf_t buf = connection->getBuffer();
+      uint8_t* ptr = (uint8_t*) buf.base;
+      *ptr++ = ATT_OP_READ_MULTI_REQ;
+      for (ReadList::iterator it = iter; it != end; ++it) {
+        att_put_u16((*it)->handle, ptr);
+        ptr += sizeof(handle_t);
+
+        // The combined read gets the shortest of their timeouts
+        uint64_t timeout = getRequestTimeout(*it);
+        if (timeout > 0 && (rd->timeout == 0 || timeout < rd->timeout)) rd->timeout = timeout;
+      }
+      buf.len = ptr - (uint8_t*) buf.base;
+      queueRequest(rd, buf);
+    }
+    iter = end;
+  }
+}
+
+void
+Att::onReadMultiple(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
 {
-  if (setCurrentRequest(ATT_OP_READ_REQ, ATT_OP_READ_RESP, data, handle, onReadAttribute, callback)) {
-    // Write to the device
-    uv_buf_t buf = connection->getBuffer();
-    size_t len = encode(ATT_OP_READ_REQ, handle, (uint8_t*) buf.base, buf.len);
-    buf.len = len;
-    connection->write(buf);
+  return rd->att->handleReadMultiple(status, rd, buf, len, error);
+}
+
+void
+Att::handleReadMultiple(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  size_t total = 0;
+  for (ReadList::iterator it = rd->subRequests.begin(); it != rd->subRequests.end(); ++it) {
+    total += (*it)->expectedLength;
+  }
+
+  if (error != NULL && status == 0) {
+    // Connection error - fail them all
+    removeCurrentRequest();
+    for (ReadList::iterator it = rd->subRequests.begin(); it != rd->subRequests.end(); ++it) {
+      if (!(*it)->cancelled) callbackRead(*it, status, NULL, 0, error);
+      deleteRequest(*it);
+    }
+  } else if (status != 0 || (size_t) len != total) {
+    // Either one of them failed, or the lengths weren't what we were told, so we
+    // can't split up the response. Retry them one at a time, ahead of anything
+    // else that's queued, so they each get their own value or error.
+    for (ReadList::reverse_iterator it = rd->subRequests.rbegin(); it != rd->subRequests.rend(); ++it) {
+      if ((*it)->cancelled) {
+        delete *it;
+        continue;
+      }
+      (*it)->expectedLength = 0;
+      (*it)->pdu = doReadAttribute((*it)->handle);
+      requestQueue.push_front(*it);
+    }
+    removeCurrentRequest();
   } else {
-    char buffer[128];
-    sprintf(buffer, "Request already pending: %s", getOpcodeName(currentRequest->request));
-    callback(0, data, NULL, 0, buffer);
+    removeCurrentRequest();
+    uint8_t* ptr = buf;
+    for (ReadList::iterator it = rd->subRequests.begin(); it != rd->subRequests.end(); ++it) {
+      if ((*it)->epoch == writeEpoch) mirror.update((*it)->handle, ptr, (*it)->expectedLength);
+      if (!(*it)->cancelled) callbackRead(*it, 0, ptr, (*it)->expectedLength, NULL);
+      ptr += (*it)->expectedLength;
+      deleteRequest(*it);
+    }
   }
+  rd->subRequests.clear();
 }
 
 void
 Att::onReadAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
 {
-  void* data = rd->data;
+  // A value read before a write that's since been made may be out of date
+  if (status == 0 && error == NULL && rd->epoch == rd->att->writeEpoch) {
+    rd->att->mirror.update(rd->handle, buf, len);
+  }
   rd->att->removeCurrentRequest();
-  rd->readAttrCb(status, data, buf, len, error);
+  callbackRead(rd, status, buf, len, error);
+}
+
+//
+// Read a long attribute. We start with a plain read, since that works whatever
+// the length, and as long as the responses come back full we carry on with
+// Read Blob requests at increasing offsets.
+// Arguments:
+//  handle   - The handle
+//  callback - The callback
+//  data     - Optional callback data
+//  stream   - Whether to call back with each chunk, rather than the whole value
+//  timeout  - Transaction timeout in ms for each request, if not the connection's
+//
+void
+Att::readLongAttribute(uint16_t handle, ReadLongCallback callback, void* data, bool stream, uint64_t timeout)
+{
+  struct readData* rd = newRequest(ATT_OP_READ_REQ, ATT_OP_READ_RESP, data, handle, onReadLongAttribute, NULL);
+  rd->readLongCb = callback;
+  rd->stream = stream;
+  rd->timeout = timeout;
+  rd->epoch = writeEpoch;
+  uv_buf_t buf = connection->getBuffer();
+  size_t len = encode(ATT_OP_READ_REQ, handle, (uint8_t*) buf.base, buf.len);
+  buf.len = len;
+  queueRequest(rd, buf);
+}
+
+void
+Att::onReadLongAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  return rd->att->handleReadLongAttribute(status, rd, buf, len, error);
+}
+
+void
+Att::handleReadLongAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  if (status == 0 && error == NULL) {
+    size_t offset = rd->offset;
+    rd->offset += len;
+
+    // A full response means there may be more to come
+    bool more = len == mtu - 1 && rd->offset < ATT_MAX_VALUE_LEN;
+    if (more) {
+      // Send the next Read Blob before handing back what we have
+      rd->request = ATT_OP_READ_BLOB_REQ;
+      rd->expectedResponse = ATT_OP_READ_BLOB_RESP;
+      uint8_t value[sizeof(uint16_t)];
+      att_put_u16(rd->offset, value);
+      uv_buf_t pdu = connection->getBuffer();
+      pdu.len = encode(ATT_OP_READ_BLOB_REQ, rd->handle, (uint8_t*) pdu.base, pdu.len, value, sizeof(value));
+      connection->write(pdu);
+    }
+
+    if (rd->stream) {
+      if (!more) removeCurrentRequest();
+      rd->readLongCb(status, rd->data, buf, len, offset, !more, error);
+    } else {
+      rd->blob.insert(rd->blob.end(), buf, buf + len);
+      if (!more) finishReadLongAttribute(rd);
+    }
+  } else if (rd->request == ATT_OP_READ_BLOB_REQ &&
+      (status == ATT_ECODE_ATTR_NOT_LONG || status == ATT_ECODE_INVALID_OFFSET)) {
+    // The value ended exactly at the end of the last response
+    finishReadLongAttribute(rd);
+  } else {
+    removeCurrentRequest();
+    rd->readLongCb(status, rd->data, NULL, 0, rd->offset, true, error);
+  }
+}
+
+void
+Att::finishReadLongAttribute(struct readData* rd)
+{
+  removeCurrentRequest();
+  if (rd->stream) {
+    rd->readLongCb(0, rd->data, NULL, 0, rd->offset, true, NULL);
+  } else {
+    uint8_t* value = rd->blob.empty() ? NULL : &rd->blob[0];
+    if (rd->epoch == writeEpoch) mirror.update(rd->handle, value, rd->blob.size());
+    rd->readLongCb(0, rd->data, value, rd->blob.size(), 0, true, NULL);
+  }
 }
 
 //
@@ -487,9 +920,11 @@ Att::onReadAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len,
 //  handle   - The handle for the attribute
 //  callback - Callback for the notifications
 //  data     - Optional callback data
+//  filter   - Optional filter, to drop notifications before the callback
 //
 void
-Att::listenForNotifications(uint16_t handle, ReadAttributeCallback callback, void* data)
+Att::listenForNotifications(uint16_t handle, ReadAttributeCallback callback, void* data,
+    const NotificationFilter::Options* filter)
 {
   // Set up the read callback
   struct readData* rd = new struct readData();
@@ -498,17 +933,46 @@ Att::listenForNotifications(uint16_t handle, ReadAttributeCallback callback, voi
   rd->handle = handle;
   rd->callback = onNotification;
   rd->readAttrCb = callback;
-  {
-    LockGuard(this->notificationMapLock);
-    notificationMap.insert(std::pair<handle_t, struct readData*>(handle, rd));
+  if (filter != NULL && !filter->empty()) {
+    rd->filter = new NotificationFilter(loop, *filter, onFilteredNotification, rd);
+  }
+
+  // Add it to the end of the listeners for the handle, so they're called in
+  // the order they were added
+  struct readData** listener = &notificationTable[handle];
+  while (*listener != NULL) {
+    listener = &(*listener)->nextListener;
+  }
+  *listener = rd;
+}
+
+void
+Att::deleteListeners(struct readData*& listeners)
+{
+  while (listeners != NULL) {
+    struct readData* rd = listeners;
+    listeners = rd->nextListener;
+    if (rd->filter != NULL) rd->filter->destroy();
+    delete rd;
   }
 }
 
 void
 Att::onNotification(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
 {
-  void* data = rd->data;
-  rd->readAttrCb(status, data, buf, len, error);
+  if (rd->filter != NULL) {
+    rd->filter->filter(buf, len);
+  } else {
+    rd->readAttrCb(status, rd->data, buf, len, error);
+  }
+}
+
+// A notification's got through the listener's filter
+void
+Att::onFilteredNotification(void* data, uint8_t* value, size_t length)
+{
+  struct readData* rd = (struct readData*) data;
+  rd->readAttrCb(0, rd->data, value, length, NULL);
 }
 
 //
@@ -520,14 +984,20 @@ Att::onNotification(uint8_t status, struct readData* rd, uint8_t* buf, int len,
 //  callback - The callback called when the write completes
 //  cbData   - Optional callback data
 //
-void
+bool
 Att::writeCommand(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback, void* cbData)
 {
-  // Do the write
+  // Do the write, after any reads made before it
+  if (!pendingReads.empty()) flushPendingReads();
+  ++writeEpoch;
+  mirror.invalidate(handle);
   uv_buf_t buf = connection->getBuffer();
   size_t len = encode(ATT_OP_WRITE_CMD, handle, (uint8_t*) buf.base, buf.len, data, length);
   buf.len = len;
-  connection->write(buf, callback, cbData);
+  // Only commands tell the caller to back off, so only they wait for a drain
+  bool ok = connection->write(buf, callback, cbData);
+  if (!ok) connection->requestDrain();
+  return ok;
 }
 
 //
@@ -538,15 +1008,200 @@ Att::writeCommand(uint16_t handle, const uint8_t* data, size_t length, Connectio
 //  length   - The size of the data
 //  callback - The callback called when the write completes
 //  cbData   - Optional callback data
+//  timeout  - Transaction timeout in ms, if not the connection's
 //
 void
-Att::writeRequest(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback, void* cbData)
+Att::writeRequest(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback, void* cbData,
+  uint64_t timeout)
 {
-  // Perform the write
+  // Rather than truncate a value that's too long, write it in pieces
+  if (length > (size_t) mtu - 3) {
+    writeLongAttribute(handle, data, length, callback, cbData, timeout);
+    return;
+  }
+
+  // This is a request, so it has to wait its turn behind any outstanding one.
+  // The callback is called once the device responds.
+  ++writeEpoch;
+  mirror.invalidate(handle);
+  struct readData* rd = newRequest(ATT_OP_WRITE_REQ, ATT_OP_WRITE_RESP, cbData, handle, onWriteResponse, NULL);
+  rd->writeCb = callback;
+  rd->timeout = timeout;
   uv_buf_t buf = connection->getBuffer();
   size_t len = encode(ATT_OP_WRITE_REQ, handle, (uint8_t*) buf.base, buf.len, data, length);
   buf.len = len;
-  connection->write(buf, callback, cbData);
+  queueRequest(rd, buf);
+}
+
+void
+Att::onWriteResponse(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  rd->att->removeCurrentRequest();
+  if (rd->writeCb != NULL) {
+    rd->writeCb(rd->data, error);
+  }
+}
+
+//
+// Write a long attribute value, using Prepare Write and Execute Write requests
+// Arguments:
+//  handle   - The handle for the attribute
+//  data     - The data to write into the attribute
+//  length   - The size of the data
+//  callback - The callback called when the write completes
+//  cbData   - Optional callback data
+//  timeout  - Transaction timeout in ms for each request, if not the connection's
+//
+void
+Att::writeLongAttribute(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback, void* cbData,
+  uint64_t timeout)
+{
+  WriteList values;
+  WriteValue value = { handle, data, length };
+  values.push_back(value);
+  reliableWrite(values, callback, cbData, timeout);
+}
+
+//
+// Write one or more attribute values atomically. The values are split into
+// Prepare Write requests, each of which the device echoes back, and which we
+// check. If they all match, we send an Execute Write, and the device writes
+// them all - otherwise we cancel, and it writes none of them.
+//
+// Note: ATT only allows one outstanding request, so the prepares can't be sent
+// all at once. Instead they're all encoded up front, and each one is sent as
+// soon as the response to the last one has been checked, without going back to
+// the caller in between.
+// Arguments:
+//  values   - The handles and values to write
+//  callback - The callback called when the write completes
+//  cbData   - Optional callback data
+//  timeout  - Transaction timeout in ms for each request, if not the connection's
+//
+void
+Att::reliableWrite(const WriteList& values, Connection::WriteCallback callback, void* cbData, uint64_t timeout)
+{
+  // Nothing to prepare, and an Execute Write on its own would do nothing
+  if (values.empty()) {
+    if (callback != NULL) callback(cbData, "Reliable write needs at least one value");
+    return;
+  }
+
+  ++writeEpoch;
+  struct readData* rd = newRequest(ATT_OP_PREP_WRITE_REQ, ATT_OP_PREP_WRITE_RESP, cbData, 0, onPrepareWrite, NULL);
+  rd->writeCb = callback;
+  rd->timeout = timeout;
+  struct prepareQueue* queue = rd->prepared = new struct prepareQueue();
+
+  // Each PDU has an opcode, handle and offset, leaving the rest for the value
+  const size_t header = sizeof(opcode_t) + sizeof(handle_t) + sizeof(uint16_t);
+  const size_t chunkSize = mtu - header;
+
+  size_t total = 0;
+  for (WriteList::const_iterator it = values.begin(); it != values.end(); ++it) {
+    total += it->length + header * (it->length / chunkSize + 1);
+    mirror.invalidate(it->handle);
+  }
+  queue->pdus.reserve(total);
+
+  for (WriteList::const_iterator it = values.begin(); it != values.end(); ++it) {
+    size_t offset = 0;
+    do {
+      size_t chunk = it->length - offset < chunkSize ? it->length - offset : chunkSize;
+      size_t start = queue->pdus.size();
+      queue->pdus.resize(start + header + chunk);
+      uint8_t* ptr = &queue->pdus[start];
+      ptr[0] = ATT_OP_PREP_WRITE_REQ;
+      att_put_u16(it->handle, &ptr[1]);
+      att_put_u16(offset, &ptr[3]);
+      if (chunk > 0) memcpy(&ptr[header], it->value + offset, chunk);
+      queue->ends.push_back(queue->pdus.size());
+      offset += chunk;
+    } while (offset < it->length);
+  }
+
+  queueRequest(rd, doPrepareWrite(*queue));
+}
+
+// Get the next Prepare Write PDU from the queue
+uv_buf_t
+Att::doPrepareWrite(struct prepareQueue& queue)
+{
+  size_t start = queue.next == 0 ? 0 : queue.ends[queue.next - 1];
+  size_t len = queue.ends[queue.next] - start;
+  uv_buf_t buf = connection->getBuffer();
+  memcpy(buf.base, &queue.pdus[start], len);
+  buf.len = len;
+  return buf;
+}
+
+// Send an Execute Write, to either write or cancel the prepared values
+void
+Att::doExecuteWrite(struct readData* rd, uint8_t flags)
+{
+  rd->request = ATT_OP_EXEC_WRITE_REQ;
+  rd->expectedResponse = ATT_OP_EXEC_WRITE_RESP;
+  uv_buf_t buf = connection->getBuffer();
+  buf.base[0] = ATT_OP_EXEC_WRITE_REQ;
+  buf.base[1] = flags;
+  buf.len = 2;
+  connection->write(buf);
+}
+
+void
+Att::onPrepareWrite(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  return rd->att->handlePrepareWrite(status, rd, buf, len, error);
+}
+
+void
+Att::handlePrepareWrite(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error)
+{
+  struct prepareQueue* queue = rd->prepared;
+
+  if (error != NULL && status == 0) {
+    // Connection error, nothing more we can do
+    removeCurrentRequest();
+    if (rd->writeCb != NULL) rd->writeCb(rd->data, error);
+  } else if (rd->request == ATT_OP_PREP_WRITE_REQ) {
+    if (status != 0) {
+      // The device may have queued some of them, so clear them out
+      queue->failed = true;
+      if (error != NULL) queue->error = error;
+      doExecuteWrite(rd, ATT_CANCEL_ALL_PREP_WRITES);
+      return;
+    }
+
+    // The response should echo back exactly what we sent, minus the opcode
+    size_t start = queue->next == 0 ? 0 : queue->ends[queue->next - 1];
+    size_t expected = queue->ends[queue->next] - start - sizeof(opcode_t);
+    if ((size_t) len != expected || memcmp(buf, &queue->pdus[start + 1], expected) != 0) {
+      char buffer[128];
+      sprintf(buffer, "Prepare write response for handle 0x%04X didn't match the request",
+          att_get_u16(&queue->pdus[start + 1]));
+      queue->failed = true;
+      queue->error = buffer;
+      doExecuteWrite(rd, ATT_CANCEL_ALL_PREP_WRITES);
+      return;
+    }
+
+    if (++queue->next < queue->ends.size()) {
+      uv_buf_t pdu = doPrepareWrite(*queue);
+      connection->write(pdu);
+    } else {
+      doExecuteWrite(rd, ATT_WRITE_ALL_PREP_WRITES);
+    }
+  } else {
+    // Execute Write response
+    removeCurrentRequest();
+    if (rd->writeCb != NULL) {
+      if (queue->failed) {
+        rd->writeCb(rd->data, queue->error.c_str());
+      } else {
+        rd->writeCb(rd->data, status == 0 ? NULL : error);
+      }
+    }
+  }
 }
 
 //
@@ -567,7 +1222,8 @@ void
 Att::handleRead(void* data, uint8_t* buf, int nread, const char* error)
 {
   if (error) {
-    callbackCurrentRequest(0, NULL, 0, error);
+    // The connection is gone, so nothing queued is going to get a response
+    failAllRequests(error, "Request not sent - the connection is closed");
   } else {
     char buffer[1024];
     uint8_t opcode = buf[0];
@@ -596,19 +1252,24 @@ Att::handleRead(void* data, uint8_t* buf, int nread, const char* error)
         }
         break;
 
+      case ATT_OP_HANDLE_IND:
+        // Confirm straight away - the device won't send another indication
+        // until it gets this, so there's no point waiting for the listener
+        sendConfirmation();
+        // Fall through - otherwise handled just like a notification
+
       case ATT_OP_HANDLE_NOTIFY:
+        // Too short to even have a handle
+        if (nread < 3) break;
         handle = *(handle_t*)(&buf[1]);
-        {
-          LockGuard(this->notificationMapLock);
-          NotificationMap::iterator it = notificationMap.find(handle);
-          if (it != notificationMap.end()) {
-            rd = it->second;
-          }
-        }
+        mirror.update(handle, (uint8_t*)(&buf[3]), nread-3);
+        rd = notificationTable.get(handle);
         if (rd != NULL) {
-          if (rd->callback != NULL) {
-            // Note: Remove the opcode and handle before calling the callback
-            rd->callback(0, rd, (uint8_t*)(&buf[3]), nread-3, error);
+          for (; rd != NULL; rd = rd->nextListener) {
+            if (rd->callback != NULL) {
+              // Note: Remove the opcode and handle before calling the callback
+              rd->callback(0, rd, (uint8_t*)(&buf[3]), nread-3, error);
+            }
           }
         } else {
           if (errorHandler != NULL) {
@@ -619,7 +1280,7 @@ Att::handleRead(void* data, uint8_t* buf, int nread, const char* error)
         break;
 
       default:
-        if (currentRequest != NULL) {
+        if (currentRequest != NULL && currentRequest->expectedResponse == opcode) {
           // Note: Remove the opcode before calling the callback
           callbackCurrentRequest(0, (uint8_t*)(&buf[1]), nread-1, NULL);
         } else {
@@ -632,24 +1293,32 @@ Att::handleRead(void* data, uint8_t* buf, int nread, const char* error)
   }
 }
 
+// Send a Handle Value Confirmation in response to an indication
+void
+Att::sendConfirmation()
+{
+  uv_buf_t buf = connection->getBuffer();
+  buf.base[0] = ATT_OP_HANDLE_CNF;
+  buf.len = sizeof(opcode_t);
+  connection->write(buf);
+}
+
 void
 Att::parseAttributeList(AttributeInfoList& list, uint8_t* buf, int len)
 {
   uint8_t format = buf[0];
   uint8_t* ptr = &buf[1];
-  AttributeInfo* attribute;
   while (ptr - buf < len) {
-    attribute = new AttributeInfo();
-    attribute->handle = att_get_u16(ptr);
+    AttributeInfo& attribute = list.append();
+    attribute.handle = att_get_u16(ptr);
     ptr += sizeof(handle_t);
     if (format == ATT_FIND_INFO_RESP_FMT_16BIT) {
-      attribute->type = att_get_uuid16(ptr);
+      attribute.type = att_get_uuid16(ptr);
       ptr += sizeof(uint16_t);
     } else {
-      attribute->type = att_get_uuid128(ptr);
+      attribute.type = att_get_uuid128(ptr);
       ptr += sizeof(uint128_t);
     }
-    list.push_back(attribute);
   }
 }
 
@@ -657,14 +1326,12 @@ void
 Att::parseHandlesInformationList(HandlesInfoList& list, const bt_uuid_t& type, uint8_t* buf, int len)
 {
   uint8_t* ptr = &buf[0];
-  struct HandlesInfo* handlesInfo;
   while (ptr - buf < len) {
-    handlesInfo = new struct HandlesInfo();
-    handlesInfo->handle = att_get_u16(ptr);
+    HandlesInfo& handlesInfo = list.append();
+    handlesInfo.handle = att_get_u16(ptr);
     ptr += sizeof(handle_t);
-    handlesInfo->groupEndHandle = att_get_u16(ptr);
+    handlesInfo.groupEndHandle = att_get_u16(ptr);
     ptr += sizeof(handle_t);
-    list.push_back(handlesInfo);
   }
 }
 
@@ -673,15 +1340,15 @@ Att::parseAttributeDataList(AttributeDataList& list, const bt_uuid_t& type, uint
 {
   uint8_t* ptr = &buf[0];
   uint8_t length = *ptr++;
-  struct AttributeData* attribute;
+  uint8_t* value;
   while (ptr - buf < len) {
-    attribute = new struct AttributeData();
-    attribute->handle = att_get_u16(ptr);
+    AttributeData& attribute = list.append(length-2, value);
+    attribute.handle = att_get_u16(ptr);
     ptr += sizeof(handle_t);
-    memcpy(attribute->data, ptr, length-2);
-    attribute->length = length-2;
+    memcpy(value, ptr, length-2);
+    attribute.data = value;
+    attribute.length = length-2;
     ptr += length-2;
-    list.push_back(attribute);
   }
 }
 
@@ -690,17 +1357,17 @@ Att::parseGroupAttributeDataList(GroupAttributeDataList& list, const bt_uuid_t&
 {
   uint8_t* ptr = &buf[0];
   uint8_t length = *ptr++;
-  struct GroupAttributeData* attrData;
+  uint8_t* value;
   while (ptr - buf < len) {
-    attrData = new struct GroupAttributeData();
-    attrData->handle = att_get_u16(ptr);
+    GroupAttributeData& attrData = list.append(length-4, value);
+    attrData.handle = att_get_u16(ptr);
     ptr += sizeof(handle_t);
-    attrData->groupEndHandle = att_get_u16(ptr);
+    attrData.groupEndHandle = att_get_u16(ptr);
     ptr += sizeof(handle_t);
-    memcpy(attrData->data, ptr, length-4);
-    attrData->length = length-4;
+    memcpy(value, ptr, length-4);
+    attrData.data = value;
+    attrData.length = length-4;
     ptr += length-4;
-    list.push_back(attrData);
   }
 }
 
@@ -711,16 +1378,319 @@ Att::parseGroupAttributeDataList(GroupAttributeDataList& list, const bt_uuid_t&
 void
 Att::callbackCurrentRequest(uint8_t status, uint8_t* buffer, size_t len, const char* error)
 {
-  if (currentRequest->callback != NULL) {
-    currentRequest->callback(status, currentRequest, buffer, len, error);
+  struct readData* rd = currentRequest;
+  if (rd == NULL) return;
+  timerWheel->stop(requestTimer);
+
+  if (rd->cancelled) {
+    // Nobody's waiting for the response. The exception is a reliable write
+    // part way through, where the device holds on to the prepared values
+    // until we tell it to drop them.
+    if (rd->request == ATT_OP_PREP_WRITE_REQ && !(status == 0 && error != NULL)) {
+      doExecuteWrite(rd, ATT_CANCEL_ALL_PREP_WRITES);
+      startRequestTimer();
+      return;
+    }
+
+    // Drop anything a multi-part request has built up
+    switch (rd->request) {
+      case ATT_OP_FIND_INFO_REQ:
+        delete attributeList;
+        attributeList = NULL;
+        break;
+      case ATT_OP_FIND_BY_TYPE_REQ:
+        delete handlesInfoList;
+        handlesInfoList = NULL;
+        break;
+      case ATT_OP_READ_BY_GROUP_REQ:
+        delete groupAttributeList;
+        groupAttributeList = NULL;
+        break;
+    }
+    removeCurrentRequest();
+    deleteRequest(rd);
+    return;
+  }
+
+  if (rd->callback != NULL) {
+    rd->callback(status, rd, buffer, len, error);
+  }
+
+  // If the handler is finished with the request, it will have removed it.
+  // Otherwise it's sent the next PDU of the transaction, which gets its own
+  // timeout.
+  if (currentRequest != rd) {
+    deleteRequest(rd);
+  } else {
+    startRequestTimer();
+  }
+}
+
+//
+// Fail the current request, and all the queued and pending ones, with the
+// given error. The bearer's marked unusable first, so any request made from
+// a callback fails too, rather than going to the dead bearer.
+// Arguments:
+//  error       - The error for the requests already made
+//  closedError - The error for any requests made from now on
+//
+void
+Att::failAllRequests(const char* error, const char* closedError)
+{
+  if (this->closedError != NULL) return;
+  this->closedError = closedError;
+  timerWheel->stop(requestTimer);
+
+  // Take everything out of the queues before making any callbacks
+  ReadList failed;
+  if (currentRequest != NULL) failed.push_back(currentRequest);
+  currentRequest = NULL;
+  failed.insert(failed.end(), pendingReads.begin(), pendingReads.end());
+  pendingReads.clear();
+  while (!requestQueue.empty()) {
+    struct readData* rd = requestQueue.front();
+    requestQueue.pop_front();
+    Connection::releaseBuffer(rd->pdu);
+    rd->pdu = uv_buf_init(NULL, 0);
+    failed.push_back(rd);
+  }
+
+  // Drop anything a multi-part request had built up
+  delete attributeList;
+  attributeList = NULL;
+  delete handlesInfoList;
+  handlesInfoList = NULL;
+  delete groupAttributeList;
+  groupAttributeList = NULL;
+
+  for (ReadList::iterator it = failed.begin(); it != failed.end(); ++it) {
+    if (!(*it)->cancelled) failRequest(*it, error);
+    deleteRequest(*it);
+  }
+}
+
+//
+// Cancel requests
+// Arguments:
+//  data - The callback data the requests were made with
+//
+void
+Att::cancel(void* data)
+{
+  if (data == NULL) return;
+  size_t count = failedRequests.size();
+
+  // Reads answered from the mirror, which haven't been called back yet
+  for (ReadList::iterator it = cachedReads.begin(); it != cachedReads.end();) {
+    if ((*it)->data == data) {
+      (*it)->cancelled = true;
+      failedRequests.push_back(*it);
+      it = cachedReads.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // Reads which haven't been combined yet
+  for (ReadList::iterator it = pendingReads.begin(); it != pendingReads.end();) {
+    cancelJoined(*it, data);
+    if ((*it)->data == data && !(*it)->joined.empty()) {
+      handOverRead(*it);
+      ++it;
+    } else if ((*it)->data == data) {
+      (*it)->cancelled = true;
+      failedRequests.push_back(*it);
+      it = pendingReads.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // Requests waiting their turn
+  for (RequestQueue::iterator it = requestQueue.begin(); it != requestQueue.end();) {
+    struct readData* rd = *it;
+    cancelJoined(rd, data);
+    if (rd->data == data && !rd->joined.empty()) {
+      handOverRead(rd);
+      ++it;
+    } else if (rd->data == data) {
+      Connection::releaseBuffer(rd->pdu);
+      rd->pdu = uv_buf_init(NULL, 0);
+      rd->cancelled = true;
+      failedRequests.push_back(rd);
+      it = requestQueue.erase(it);
+    } else {
+      cancelSubRequests(rd, data);
+      ++it;
+    }
+  }
+
+  // The request in flight has to stay in flight, but we can take its
+  // callback away
+  if (currentRequest != NULL) {
+    cancelJoined(currentRequest, data);
+    if (currentRequest->data == data && !currentRequest->joined.empty()) {
+      handOverRead(currentRequest);
+    } else if (currentRequest->data == data && !currentRequest->cancelled) {
+      failedRequests.push_back(takeCallbacks(currentRequest));
+    } else {
+      cancelSubRequests(currentRequest, data);
+    }
+  }
+
+  if (count == 0 && !failedRequests.empty()) {
+    uv_prepare_start(flushHandle, onFlushPendingReads);
+  }
+}
+
+// Cancel the reads with the given data which were combined into a Read Multiple
+void
+Att::cancelSubRequests(struct readData* rd, void* data)
+{
+  for (ReadList::iterator it = rd->subRequests.begin(); it != rd->subRequests.end(); ++it) {
+    cancelJoined(*it, data);
+    if ((*it)->data == data && !(*it)->joined.empty()) {
+      handOverRead(*it);
+    } else if ((*it)->data == data && !(*it)->cancelled) {
+      failedRequests.push_back(takeCallbacks(*it));
+    }
   }
 }
 
+// Cancel the reads with the given data which are sharing a read's response
+void
+Att::cancelJoined(struct readData* rd, void* data)
+{
+  for (ReadList::iterator it = rd->joined.begin(); it != rd->joined.end();) {
+    if ((*it)->data == data) {
+      (*it)->cancelled = true;
+      failedRequests.push_back(*it);
+      it = rd->joined.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// Cancel a read which others are sharing, by handing it over to the first of
+// them, so it still goes ahead for the rest
+void
+Att::handOverRead(struct readData* rd)
+{
+  struct readData* next = rd->joined.front();
+  rd->joined.erase(rd->joined.begin());
+  failedRequests.push_back(takeCallbacks(rd));
+  rd->cancelled = false;
+  rd->data = next->data;
+  rd->readAttrCb = next->readAttrCb;
+  delete next;
+}
+
+// Move a request's callbacks to a new request, for failRequest(), and mark
+// the original as cancelled
+struct Att::readData*
+Att::takeCallbacks(struct readData* rd)
+{
+  struct readData* copy = new struct readData();
+  copy->att = this;
+  copy->request = rd->request;
+  copy->data = rd->data;
+  copy->readAttrCb = rd->readAttrCb;
+  copy->attrListCb = rd->attrListCb;
+  copy->writeCb = rd->writeCb;
+  copy->mtuCb = rd->mtuCb;
+  copy->readLongCb = rd->readLongCb;
+  copy->offset = rd->offset;
+  copy->cancelled = true;
+  rd->cancelled = true;
+  return copy;
+}
+
+//
+// Call back for the requests which were cancelled, or couldn't be sent
+//
+void
+Att::flushFailedRequests()
+{
+  ReadList failed;
+  failed.swap(failedRequests);
+  for (ReadList::iterator it = failed.begin(); it != failed.end(); ++it) {
+    failRequest(*it, (*it)->cancelled ? "Request cancelled" : closedError);
+    deleteRequest(*it);
+  }
+}
+
+//
+// Call back the reads answered from the mirror
+//
+void
+Att::flushCachedReads()
+{
+  ReadList reads;
+  reads.swap(cachedReads);
+  for (ReadList::iterator it = reads.begin(); it != reads.end(); ++it) {
+    uint8_t* value = (*it)->blob.empty() ? NULL : &(*it)->blob[0];
+    callbackRead(*it, 0, value, (*it)->blob.size(), NULL);
+    deleteRequest(*it);
+  }
+}
+
+//
+// Make a request's callback with an error, whatever kind of request it is
+// Arguments:
+//  rd    - The request
+//  error - The error
+//
+void
+Att::failRequest(struct readData* rd, const char* error)
+{
+  if (!rd->subRequests.empty()) {
+    for (ReadList::iterator it = rd->subRequests.begin(); it != rd->subRequests.end(); ++it) {
+      if (!(*it)->cancelled) callbackRead(*it, 0, NULL, 0, error);
+    }
+  } else if (rd->readAttrCb != NULL) {
+    callbackRead(rd, 0, NULL, 0, error);
+  } else if (rd->attrListCb != NULL) {
+    // The list callbacks always get a list, to free
+    void* list = NULL;
+    switch (rd->request) {
+      case ATT_OP_FIND_INFO_REQ:
+        list = new AttributeInfoList();
+        break;
+      case ATT_OP_FIND_BY_TYPE_REQ:
+        list = new HandlesInfoList();
+        break;
+      case ATT_OP_READ_BY_TYPE_REQ:
+        list = new AttributeDataList();
+        break;
+      case ATT_OP_READ_BY_GROUP_REQ:
+        list = new GroupAttributeDataList();
+        break;
+    }
+    rd->attrListCb(0, rd->data, list, error);
+  } else if (rd->writeCb != NULL) {
+    rd->writeCb(rd->data, error);
+  } else if (rd->mtuCb != NULL) {
+    rd->mtuCb(0, rd->data, rd->att->mtu, error);
+  } else if (rd->readLongCb != NULL) {
+    rd->readLongCb(0, rd->data, NULL, 0, rd->offset, true, error);
+  }
+}
+
+//
+// Remove the current request, and send the next one in the queue, if any.
+// Note that this doesn't delete the request, since the handler still needs
+// it to make its callback - callbackCurrentRequest() takes care of that.
+//
 void
 Att::removeCurrentRequest()
 {
-  struct readData* rd = __sync_lock_test_and_set(&currentRequest, NULL);
-  delete rd;
+  currentRequest = NULL;
+  if (!requestQueue.empty()) {
+    currentRequest = requestQueue.front();
+    requestQueue.pop_front();
+    sendCurrentRequest();
+  }
 }
 
 const char*
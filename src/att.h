@@ -2,12 +2,17 @@
 #define ATT_H
 
 #include <node.h>
-#include <pthread.h>
-#include <map>
+#include <deque>
 #include <vector>
 #include "uuid.h"
 
+#include "attributeMirror.h"
+#include "btio.h"
 #include "connection.h"
+#include "handleTable.h"
+#include "notificationFilter.h"
+#include "resultList.h"
+#include "timerWheel.h"
 
 typedef uint16_t handle_t;
 
@@ -21,43 +26,62 @@ class Att {
 public:
   static const size_t MAX_ATTR_VALUE_LENGTH = 253;
 
+  // Largest MTU we'll ask for - enough for a maximum length attribute value
+  static const uint16_t MAX_MTU = ATT_MAX_VALUE_LEN + 5;
+
+  // How long the device has to respond to a request, in milliseconds - the
+  // ATT transaction timeout from the spec
+  static const uint64_t DEFAULT_TIMEOUT = 30000;
+
   // Some useful typedefs
   typedef uint8_t opcode_t;
 
+  // Discovery results are kept in ResultLists, which store the entries (and
+  // any values, which point into the list's own memory) back to back
   struct AttributeInfo {
     handle_t handle;
     bt_uuid_t type;
   };
 
-  typedef std::vector<struct AttributeInfo*> AttributeInfoList;
+  typedef ResultList<struct AttributeInfo> AttributeInfoList;
 
   struct HandlesInfo {
     handle_t handle;
     handle_t groupEndHandle;
   };
 
-  typedef std::vector<struct HandlesInfo*> HandlesInfoList;
+  typedef ResultList<struct HandlesInfo> HandlesInfoList;
 
   struct AttributeData {
     handle_t handle;
-    uint8_t data[255];
+    const uint8_t* data;
     size_t length;
   };
 
-  typedef std::vector<struct AttributeData*> AttributeDataList;
+  typedef ResultList<struct AttributeData> AttributeDataList;
 
   struct GroupAttributeData {
     handle_t handle;
     handle_t groupEndHandle;
-    uint8_t data[255];
+    const uint8_t* data;
+    size_t length;
+  };
+
+  typedef ResultList<struct GroupAttributeData> GroupAttributeDataList;
+
+  struct WriteValue {
+    handle_t handle;
+    const uint8_t* value;
     size_t length;
   };
 
-  typedef std::vector<struct GroupAttributeData*> GroupAttributeDataList;
+  typedef std::vector<struct WriteValue> WriteList;
 
   typedef void (*ErrorCallback)(void* data, const char* error);
   typedef void (*ReadAttributeCallback)(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
   typedef void (*AttributeListCallback)(uint8_t status, void* data, void* list, const char* error);
+  typedef void (*MTUCallback)(uint8_t status, void* data, uint16_t mtu, const char* error);
+  typedef void (*ReadLongCallback)(uint8_t status, void* data, uint8_t* buf, int len, size_t offset, bool complete, const char* error);
 
   // Convert a device error code to a human-readable message
   static const char* getErrorString(uint8_t errorCode);
@@ -65,16 +89,26 @@ public:
   // Convert an opcode to the name of the operation
   static const char* getOpcodeName(uint8_t opcode);
 
-  // Constructor/Destructor
-  Att();
+  // Constructor/Destructor. The connection runs on the given loop, and all
+  // callbacks are made from it
+  Att(uv_loop_t* loop = uv_default_loop());
   virtual ~Att();
 
   // Connect to a device
-  void connect(struct set_opts& opts, Connection::ConnectCallback connect, void* data);
+  void connect(Transport* transport, Connection::ConnectCallback connect, void* data);
 
   // Close the connection
   void close(Connection::CloseCallback cb, void* data);
 
+  // Exchange MTU
+  void exchangeMTU(uint16_t mtu, MTUCallback callback, void* data, uint64_t timeout=0);
+
+  // The current ATT MTU
+  uint16_t getMTU() const { return mtu; }
+
+  // The loop we run on
+  uv_loop_t* getLoop() const { return loop; }
+
   // Find information
   void findInformation(uint16_t startHandle, uint16_t endHandle, AttributeListCallback callback, void* data);
 
@@ -86,21 +120,77 @@ public:
   void readByType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& uuid,
     AttributeListCallback callback, void* data);
 
-  // Read a bluetooth attribute
-  void readAttribute(uint16_t handle, ReadAttributeCallback callback, void* data);
+  // Read a bluetooth attribute. If the length of the value is known and fixed,
+  // the read may be combined with others into a Read Multiple request. If
+  // there's already a read of the handle outstanding, made since the last
+  // write, this one shares its response rather than sending another request.
+  // With a maxAge, in milliseconds, a value at most that old from the mirror
+  // is passed back instead, before the loop next polls for I/O. A read which
+  // shares another's response goes by that one's timeout.
+  void readAttribute(uint16_t handle, ReadAttributeCallback callback, void* data, size_t length=0,
+    uint64_t maxAge=0, uint64_t timeout=0);
+
+  // Read a long attribute, using Read Blob requests until we have the whole value.
+  // If stream is true, the callback is called for each chunk as it comes in,
+  // otherwise it's called once with the whole value.
+  void readLongAttribute(uint16_t handle, ReadLongCallback callback, void* data, bool stream=false,
+    uint64_t timeout=0);
 
   // Read by Group Type
   void readByGroupType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& uuid,
     AttributeListCallback callback, void* data);
 
-  // Write data to an attribute without expecting a response
-  void writeCommand(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL);
-
-  // Write data to an attribute, expecting a response
-  void writeRequest(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL);
-
-  // Listen for incoming notifications from the device
-  void listenForNotifications(uint16_t handle, ReadAttributeCallback callback, void* data);
+  // Write data to an attribute without expecting a response. Returns false if
+  // the write queue is over its high water mark - see onDrain()
+  bool writeCommand(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL);
+
+  // Write data to an attribute, expecting a response. The callback is called
+  // when the response comes back
+  void writeRequest(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL,
+    uint64_t timeout=0);
+
+  // Write a value too long to fit in a single write request
+  void writeLongAttribute(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL,
+    uint64_t timeout=0);
+
+  // Write several values atomically, checking each one as the device receives it
+  void reliableWrite(const WriteList& values, Connection::WriteCallback callback=NULL, void* cbData=NULL,
+    uint64_t timeout=0);
+
+  // Listen for incoming notifications and indications from the device. A handle
+  // can have any number of listeners, each with its own optional filter
+  void listenForNotifications(uint16_t handle, ReadAttributeCallback callback, void* data,
+    const NotificationFilter::Options* filter=NULL);
+
+  // Write queue limits, and the callback for when the queue drains after
+  // going over the high water mark
+  void setWaterMarks(size_t high, size_t low) { connection->setWaterMarks(high, low); }
+  size_t getWriteQueueSize() const { return connection->getWriteQueueSize(); }
+  void onDrain(Connection::DrainCallback handler, void* data) {
+    connection->registerDrainCallback(handler, data);
+  }
+  void requestDrain() { connection->requestDrain(); }
+
+  // Set the transaction timeout, in milliseconds, for requests sent from now
+  // on. Zero means wait forever. If a request times out, it and everything
+  // queued behind it fail, the error handler is called, and as the spec
+  // says, no more requests can be made on the connection. The request
+  // methods which take a timeout use that instead, unless it's zero.
+  void setRequestTimeout(uint64_t timeout) { requestTimeout = timeout; }
+
+  // Cancel the requests made with the given callback data. Their callbacks
+  // are called with an error before the loop next polls for I/O. If one is
+  // already in flight, the bearer still has to wait for its response (or
+  // timeout) before sending the next request, but the response is dropped.
+  void cancel(void* data);
+
+  // The last value seen for an attribute, in a read response, notification
+  // or indication, and its age in milliseconds. Returns false if there
+  // isn't one, or it's older than maxAge (unless that's zero). This can be
+  // called from any thread.
+  bool getCachedValue(uint16_t handle, uint64_t maxAge, std::vector<uint8_t>& value, uint64_t& age) {
+    return mirror.get(handle, maxAge, value, age);
+  }
 
   // Handle errors
   void onError(ErrorCallback handler, void* data) {
@@ -110,6 +200,7 @@ public:
 
 private:
   struct readData;
+  struct prepareQueue;
 
   typedef void (*ReadCallback)(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
 
@@ -117,44 +208,104 @@ private:
   void handleRead(void* data, uint8_t* buf, int read, const char* error);
 
   // Utilities
-  // Set the current request atomically
-  bool setCurrentRequest(opcode_t request, opcode_t response, void* data, handle_t handle, ReadCallback callback, ReadAttributeCallback readAttrCb);
-  bool setCurrentRequest(opcode_t request, opcode_t response, void* data, handle_t handle, const bt_uuid_t* type,
+  // Create a request
+  struct readData* newRequest(opcode_t request, opcode_t response, void* data, handle_t handle, ReadCallback callback, ReadAttributeCallback readAttrCb);
+  struct readData* newRequest(opcode_t request, opcode_t response, void* data, handle_t handle, const bt_uuid_t* type,
     ReadCallback callback, AttributeListCallback attrCallback, const uint8_t* value=NULL, size_t vlen=0);
 
+  // Send the request, or queue it if there's one outstanding. Any reads
+  // waiting to be combined are queued ahead of it.
+  void queueRequest(struct readData* rd, const uv_buf_t& pdu);
+  void sendCurrentRequest();
+
   // Make the callback for the current request
   void callbackCurrentRequest(uint8_t status, uint8_t* buffer, size_t len, const char* error);
 
-  // Remove the current request atomically
+  // Remove the current request, and send the next queued one
   void removeCurrentRequest();
 
+  // Delete a request, along with any requests combined into it
+  static void deleteRequest(struct readData* rd);
+
+  // Mark the bearer unusable, and fail the current request and everything
+  // waiting behind it
+  void failAllRequests(const char* error, const char* closedError);
+
+  // Call a request's callback with an error
+  static void failRequest(struct readData* rd, const char* error);
+
+  // Make the callbacks for cancelled and rejected requests
+  void flushFailedRequests();
+
+  // Make the callbacks for reads answered from the mirror
+  void flushCachedReads();
+
+  // Cancellation
+  void cancelSubRequests(struct readData* rd, void* data);
+  void cancelJoined(struct readData* rd, void* data);
+  void handOverRead(struct readData* rd);
+  struct readData* takeCallbacks(struct readData* rd);
+
+  // Transaction timeouts
+  void startRequestTimer();
+  uint64_t getRequestTimeout(const struct readData* rd) const;
+  static void onRequestTimeout(void* data);
+  void handleRequestTimeout();
+
   // Encode a bluetooth packet
   size_t encode(uint8_t opcode, uint16_t handle, uint8_t* buffer, size_t buflen,
     const uint8_t* value = NULL, size_t vlen = 0);
   size_t encode(uint8_t opcode, uint16_t startHandle, uint16_t endHandle, const bt_uuid_t* uuid,
     uint8_t* buffer, size_t buflen, const uint8_t* value = NULL, size_t vlen = 0);
 
-  void doFindInformation(handle_t startHandle, handle_t endHandle);
+  uv_buf_t doFindInformation(handle_t startHandle, handle_t endHandle);
   static void onFindInfo(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
   void handleFindInfo(uint8_t status, struct readData* rd, uint8_t* buf, size_t len, const char* error);
 
-  void doFindByType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& type,
+  uv_buf_t doFindByType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& type,
     const uint8_t* value, size_t vlen);
   static void onFindByType(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
   void handleFindByType(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
 
-  void doReadByType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& uuid);
+  uv_buf_t doReadByType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& uuid);
   static void onReadByType(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
   void handleReadByType(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
 
-  void doReadByGroupType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& uuid);
+  uv_buf_t doReadByGroupType(handle_t startHandle, handle_t endHandle, const bt_uuid_t& uuid);
   static void onReadByGroupType(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
   void handleReadByGroupType(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
 
+  uv_buf_t doReadAttribute(handle_t handle);
   static void onReadAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+  struct readData* findRead(handle_t handle);
+  struct readData* findRead(struct readData* rd, handle_t handle);
+  static void callbackRead(struct readData* rd, uint8_t status, uint8_t* buf, int len, const char* error);
+
+  static void onFlushPendingReads(uv_prepare_t* handle, int status);
+  static void onFlushHandleClose(uv_handle_t* handle);
+  void flushPendingReads();
+  static void onReadMultiple(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+  void handleReadMultiple(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
   void handleReadAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
 
+  static void onExchangeMTU(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+  void handleExchangeMTU(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+
+  uv_buf_t doPrepareWrite(struct prepareQueue& queue);
+  void doExecuteWrite(struct readData* rd, uint8_t flags);
+  static void onPrepareWrite(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+  void handlePrepareWrite(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+
+  static void onWriteResponse(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+
+  static void onReadLongAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+  void handleReadLongAttribute(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+  void finishReadLongAttribute(struct readData* rd);
+
+  void sendConfirmation();
   static void onNotification(uint8_t status, struct readData* rd, uint8_t* buf, int len, const char* error);
+  static void onFilteredNotification(void* data, uint8_t* value, size_t length);
+  static void deleteListeners(struct readData*& listeners);
 
   void parseAttributeList(AttributeInfoList& list, uint8_t* buf, int len);
   void parseHandlesInformationList(HandlesInfoList& list, const bt_uuid_t& type, uint8_t* buf, int len);
@@ -162,14 +313,40 @@ private:
   void parseGroupAttributeDataList(GroupAttributeDataList& list, const bt_uuid_t& type, uint8_t* buf, int len);
 
   // Internal data
+  uv_loop_t* loop;         // Loop the connection runs on
   Connection* connection;  // Bluetooth connection
+  uint16_t mtu;            // ATT MTU
 
   // Error handler
   ErrorCallback errorHandler;
   void* errorData;
 
-  // Current outstanding request
+  // Current outstanding request, and the ones waiting behind it
   struct readData* currentRequest;
+  typedef std::deque<struct readData*> RequestQueue;
+  RequestQueue requestQueue;
+
+  // Fixed length reads made this tick, waiting to be combined
+  typedef std::vector<struct readData*> ReadList;
+  ReadList pendingReads;
+  uv_prepare_t* flushHandle;
+
+  // Requests which were cancelled, or made after a timeout, waiting for their
+  // callbacks. These are made from flushHandle too.
+  ReadList failedRequests;
+
+  // Reads answered from the mirror, with the value in their blob, waiting
+  // for their callbacks. Also made from flushHandle.
+  ReadList cachedReads;
+
+  // Transaction timeout for the current request
+  TimerWheel* timerWheel;
+  TimerWheel::Timer requestTimer;
+  uint64_t requestTimeout;
+  const char* closedError; // Set once the bearer's unusable, as the error for any later requests
+
+  // Bumped by every write, so reads made either side of it aren't shared
+  uint32_t writeEpoch;
 
   // Cached attribute list, used for repeated findInformation(),
   // since it may have to make multiple calls to the device
@@ -177,10 +354,11 @@ private:
   GroupAttributeDataList* groupAttributeList;
   HandlesInfoList* handlesInfoList;
 
-  // Map of handle => callback
-  typedef std::map<handle_t, readData*> NotificationMap;
-  NotificationMap notificationMap;
-  pthread_mutex_t notificationMapLock; // Associated lock
+  // Notification listeners, by handle
+  HandleTable<struct readData*> notificationTable;
+
+  // Last known attribute values
+  AttributeMirror mirror;
 };
 
 #endif
@@ -0,0 +1,886 @@
+#include <errno.h>
+
+#include "attProxy.h"
+#include "btleException.h"
+
+// Any of the callbacks a request can have
+union AttProxy::callback {
+  Connection::ConnectCallback connect;
+  Connection::CloseCallback close;
+  Connection::WriteCallback write;
+  Connection::DrainCallback drain;
+  Att::ErrorCallback error;
+  Att::MTUCallback mtu;
+  Att::AttributeListCallback list;
+  Att::ReadAttributeCallback read;
+  Att::ReadLongCallback readLong;
+  GattDiscovery::DiscoveryCallback discovery;
+};
+
+// A request for the Att, with everything needed to make it
+struct AttProxy::request {
+  enum Op {
+    CREATE,
+    CONNECT,
+    CLOSE,
+    EXCHANGE_MTU,
+    FIND_INFORMATION,
+    FIND_BY_TYPE_VALUE,
+    READ_BY_TYPE,
+    READ_ATTRIBUTE,
+    READ_LONG_ATTRIBUTE,
+    READ_BY_GROUP_TYPE,
+    WRITE_COMMAND,
+    WRITE_REQUEST,
+    WRITE_LONG_ATTRIBUTE,
+    RELIABLE_WRITE,
+    LISTEN,
+    SET_WATER_MARKS,
+    ON_DRAIN,
+    ON_ERROR,
+    REQUEST_DRAIN,
+    SET_REQUEST_TIMEOUT,
+    CANCEL,
+    DISCOVER_ALL,
+    DESTROY
+  };
+
+  request(AttProxy* proxy, Op op)
+    : proxy(proxy), op(op), data(NULL), transport(NULL), handle(0), startHandle(0), endHandle(0), mtu(0),
+      value(NULL), length(0), stream(false), highWaterMark(0), lowWaterMark(0), timeout(0), maxAge(0)
+  {
+    cb.connect = NULL;
+  }
+
+  AttProxy* proxy;
+  Op op;
+  union callback cb;
+  void* data;
+  Transport* transport;
+  handle_t handle;
+  handle_t startHandle;
+  handle_t endHandle;
+  uint16_t mtu;
+  bt_uuid_t uuid;
+  const uint8_t* value;
+  size_t length;
+  bool stream;
+  size_t highWaterMark;
+  size_t lowWaterMark;
+  uint64_t timeout;         // Request timeout, or the new default for SET_REQUEST_TIMEOUT
+  uint64_t maxAge;
+  NotificationFilter::Options filter;
+  Att::WriteList values;
+  std::string cacheKey;
+  std::string storage;      // Copy of the values, when the request is posted to a thread
+};
+
+// The real callback for a request posted to a thread
+struct AttProxy::relay {
+  AttProxy* proxy;
+  request::Op op;
+  union callback cb;
+  void* data;
+  bool persistent;          // Whether it can be called more than once
+  bool cancelled;           // Set when the proxy is destroyed
+};
+
+// The arguments to a callback, to be passed to the real one on the JS thread
+struct AttProxy::reply {
+  reply(struct relay* r)
+    : r(r), status(0), events(0), err(0), hasBuf(false), hasError(false), list(NULL), mtu(0),
+      offset(0), complete(false), discovery(NULL) {}
+
+  struct relay* r;
+  int status;
+  int events;
+  int err;                  // errno, for a failed connect
+  std::string buf;
+  bool hasBuf;
+  std::string error;
+  bool hasError;
+  void* list;
+  uint16_t mtu;
+  size_t offset;
+  bool complete;
+  GattDiscovery* discovery;
+
+  void setBuffer(const uint8_t* data, int len) {
+    hasBuf = data != NULL;
+    if (hasBuf && len > 0) buf.assign((const char*) data, len);
+  }
+
+  void setError(const char* message) {
+    hasError = message != NULL;
+    if (hasError) error = message;
+  }
+};
+
+// Constructor. Without a thread, the Att is created here, otherwise it's
+// created on its thread, as that's where its loop is used.
+AttProxy::AttProxy(IOThread* thread)
+  : thread(thread), att(NULL), connected(false), referenced(false),
+    highWaterMark(Connection::DEFAULT_HIGH_WATER_MARK), mtu(ATT_DEFAULT_LE_MTU)
+{
+  if (thread == NULL) {
+    att = new Att();
+  } else {
+    struct request req(this, request::CREATE);
+    submit(req);
+  }
+}
+
+AttProxy::~AttProxy()
+{
+  for (RelaySet::iterator it = relays.begin(); it != relays.end(); ++it) {
+    delete *it;
+  }
+}
+
+void
+AttProxy::destroy()
+{
+  releaseLoop();
+
+  if (thread == NULL) {
+    delete att;
+    delete this;
+  } else {
+    for (RelaySet::iterator it = relays.begin(); it != relays.end(); ++it) {
+      (*it)->cancelled = true;
+    }
+    struct request req(this, request::DESTROY);
+    submit(req);
+  }
+}
+
+// Delete the proxy, once the Att's thread is done with it. Anything it
+// posted to us before then has been run, so nothing uses the relays now.
+void
+AttProxy::deleteProxy(void* data)
+{
+  delete static_cast<AttProxy*>(data);
+}
+
+// Stop keeping the main loop alive for this connection
+void
+AttProxy::releaseLoop()
+{
+  if (referenced) {
+    referenced = false;
+    IOThread::unref();
+  }
+}
+
+void
+AttProxy::connect(Transport* transport, Connection::ConnectCallback connect, void* data)
+{
+  if (thread != NULL && !referenced) {
+    referenced = true;
+    IOThread::ref();
+  }
+
+  struct request req(this, request::CONNECT);
+  req.transport = transport;
+  req.cb.connect = connect;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::close(Connection::CloseCallback cb, void* data)
+{
+  struct request req(this, request::CLOSE);
+  req.cb.close = cb;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::exchangeMTU(uint16_t mtu, Att::MTUCallback callback, void* data, uint64_t timeout)
+{
+  struct request req(this, request::EXCHANGE_MTU);
+  req.mtu = mtu;
+  req.timeout = timeout;
+  req.cb.mtu = callback;
+  req.data = data;
+  submit(req);
+}
+
+uint16_t
+AttProxy::getMTU() const
+{
+  return thread == NULL ? att->getMTU() : mtu;
+}
+
+void
+AttProxy::findInformation(uint16_t startHandle, uint16_t endHandle, Att::AttributeListCallback callback, void* data)
+{
+  struct request req(this, request::FIND_INFORMATION);
+  req.startHandle = startHandle;
+  req.endHandle = endHandle;
+  req.cb.list = callback;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::findByTypeValue(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& type,
+  const uint8_t* value, size_t vlen, Att::AttributeListCallback callback, void* data)
+{
+  struct request req(this, request::FIND_BY_TYPE_VALUE);
+  req.startHandle = startHandle;
+  req.endHandle = endHandle;
+  req.uuid = type;
+  req.value = value;
+  req.length = vlen;
+  req.cb.list = callback;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::readByType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& uuid,
+  Att::AttributeListCallback callback, void* data)
+{
+  struct request req(this, request::READ_BY_TYPE);
+  req.startHandle = startHandle;
+  req.endHandle = endHandle;
+  req.uuid = uuid;
+  req.cb.list = callback;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::readAttribute(uint16_t handle, Att::ReadAttributeCallback callback, void* data, size_t length,
+  uint64_t maxAge, uint64_t timeout)
+{
+  struct request req(this, request::READ_ATTRIBUTE);
+  req.handle = handle;
+  req.length = length;
+  req.maxAge = maxAge;
+  req.timeout = timeout;
+  req.cb.read = callback;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::readLongAttribute(uint16_t handle, Att::ReadLongCallback callback, void* data, bool stream,
+  uint64_t timeout)
+{
+  struct request req(this, request::READ_LONG_ATTRIBUTE);
+  req.handle = handle;
+  req.stream = stream;
+  req.timeout = timeout;
+  req.cb.readLong = callback;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::readByGroupType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& uuid,
+  Att::AttributeListCallback callback, void* data)
+{
+  struct request req(this, request::READ_BY_GROUP_TYPE);
+  req.startHandle = startHandle;
+  req.endHandle = endHandle;
+  req.uuid = uuid;
+  req.cb.list = callback;
+  req.data = data;
+  submit(req);
+}
+
+//
+// Write without response. On a thread, we can't wait to see whether the
+// write queue goes over the high water mark, so we go by the queue size the
+// connection last saw. If that says to stop, we ask for a drain callback, so
+// one always follows a false return.
+//
+bool
+AttProxy::writeCommand(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback, void* cbData)
+{
+  if (thread == NULL) {
+    return att->writeCommand(handle, data, length, callback, cbData);
+  }
+
+  struct request req(this, request::WRITE_COMMAND);
+  req.handle = handle;
+  req.value = data;
+  req.length = length;
+  req.cb.write = callback;
+  req.data = cbData;
+  submit(req);
+
+  if (getWriteQueueSize() + length >= highWaterMark) {
+    struct request drain(this, request::REQUEST_DRAIN);
+    submit(drain);
+    return false;
+  }
+  return true;
+}
+
+void
+AttProxy::writeRequest(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback, void* cbData,
+  uint64_t timeout)
+{
+  struct request req(this, request::WRITE_REQUEST);
+  req.handle = handle;
+  req.value = data;
+  req.length = length;
+  req.timeout = timeout;
+  req.cb.write = callback;
+  req.data = cbData;
+  submit(req);
+}
+
+void
+AttProxy::writeLongAttribute(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback, void* cbData,
+  uint64_t timeout)
+{
+  struct request req(this, request::WRITE_LONG_ATTRIBUTE);
+  req.handle = handle;
+  req.value = data;
+  req.length = length;
+  req.timeout = timeout;
+  req.cb.write = callback;
+  req.data = cbData;
+  submit(req);
+}
+
+void
+AttProxy::reliableWrite(const Att::WriteList& values, Connection::WriteCallback callback, void* cbData,
+  uint64_t timeout)
+{
+  struct request req(this, request::RELIABLE_WRITE);
+  req.values = values;
+  req.timeout = timeout;
+  req.cb.write = callback;
+  req.data = cbData;
+  submit(req);
+}
+
+void
+AttProxy::listenForNotifications(uint16_t handle, Att::ReadAttributeCallback callback, void* data,
+    const NotificationFilter::Options* filter)
+{
+  struct request req(this, request::LISTEN);
+  req.handle = handle;
+  req.cb.read = callback;
+  req.data = data;
+  if (filter != NULL) req.filter = *filter;
+  submit(req);
+}
+
+void
+AttProxy::setWaterMarks(size_t high, size_t low)
+{
+  highWaterMark = high;
+
+  struct request req(this, request::SET_WATER_MARKS);
+  req.highWaterMark = high;
+  req.lowWaterMark = low;
+  submit(req);
+}
+
+size_t
+AttProxy::getWriteQueueSize() const
+{
+  if (thread == NULL) return att->getWriteQueueSize();
+  return connected ? att->getWriteQueueSize() : 0;
+}
+
+// The attribute mirror has its own lock, so it's read directly
+bool
+AttProxy::getCachedValue(uint16_t handle, uint64_t maxAge, std::vector<uint8_t>& value, uint64_t& age)
+{
+  if (thread != NULL && !connected) return false;
+  return att->getCachedValue(handle, maxAge, value, age);
+}
+
+void
+AttProxy::onDrain(Connection::DrainCallback handler, void* data)
+{
+  struct request req(this, request::ON_DRAIN);
+  req.cb.drain = handler;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::onError(Att::ErrorCallback handler, void* data)
+{
+  struct request req(this, request::ON_ERROR);
+  req.cb.error = handler;
+  req.data = data;
+  submit(req);
+}
+
+void
+AttProxy::setRequestTimeout(uint64_t timeout)
+{
+  struct request req(this, request::SET_REQUEST_TIMEOUT);
+  req.timeout = timeout;
+  submit(req);
+}
+
+//
+// Cancel requests. On a thread, the Att only knows the relays, so we cancel
+// those. If a relay's reply is already on its way back, the cancel finds
+// nothing, and the callback is made as normal.
+//
+void
+AttProxy::cancel(void* data)
+{
+  if (thread == NULL) {
+    att->cancel(data);
+    return;
+  }
+
+  for (RelaySet::iterator it = relays.begin(); it != relays.end(); ++it) {
+    if ((*it)->data == data && !(*it)->persistent) {
+      struct request req(this, request::CANCEL);
+      req.data = *it;
+      submit(req);
+    }
+  }
+}
+
+void
+AttProxy::discoverAll(GattDiscovery::DiscoveryCallback callback, void* data, const std::string& cacheKey)
+{
+  struct request req(this, request::DISCOVER_ALL);
+  req.cb.discovery = callback;
+  req.data = data;
+  req.cacheKey = cacheKey;
+  submit(req);
+}
+
+//
+// Run a request, straight away if there's no thread. Otherwise post a copy
+// of it, along with the data it points at, since the caller's copy will be
+// long gone by the time the thread gets to it.
+//
+void
+AttProxy::submit(struct request& req)
+{
+  if (thread == NULL) {
+    handleRequest(req);
+    return;
+  }
+
+  struct request* copy = new struct request(req);
+  if (req.op == request::RELIABLE_WRITE) {
+    for (Att::WriteList::const_iterator it = req.values.begin(); it != req.values.end(); ++it) {
+      copy->storage.append((const char*) it->value, it->length);
+    }
+    size_t offset = 0;
+    for (Att::WriteList::iterator it = copy->values.begin(); it != copy->values.end(); ++it) {
+      it->value = (const uint8_t*) copy->storage.data() + offset;
+      offset += it->length;
+    }
+  } else if (req.value != NULL) {
+    copy->storage.assign((const char*) req.value, req.length);
+    copy->value = (const uint8_t*) copy->storage.data();
+  }
+
+  wrapCallback(*copy);
+  thread->post(runRequest, copy);
+}
+
+// Swap the request's callback for the relay which posts it back to us
+void
+AttProxy::wrapCallback(struct request& req)
+{
+  if (req.cb.connect == NULL) return;
+
+  struct relay* r = new struct relay();
+  r->proxy = this;
+  r->op = req.op;
+  r->cb = req.cb;
+  r->data = req.data;
+  r->persistent = req.op == request::LISTEN || req.op == request::ON_DRAIN || req.op == request::ON_ERROR;
+  r->cancelled = false;
+  relays.insert(r);
+
+  switch (req.op) {
+    case request::CONNECT:
+      req.cb.connect = relayConnect;
+      break;
+
+    case request::CLOSE:
+      req.cb.close = relayClose;
+      break;
+
+    case request::EXCHANGE_MTU:
+      req.cb.mtu = relayMTU;
+      break;
+
+    case request::FIND_INFORMATION:
+    case request::FIND_BY_TYPE_VALUE:
+    case request::READ_BY_TYPE:
+    case request::READ_BY_GROUP_TYPE:
+      req.cb.list = relayList;
+      break;
+
+    case request::READ_ATTRIBUTE:
+    case request::LISTEN:
+      req.cb.read = relayRead;
+      break;
+
+    case request::READ_LONG_ATTRIBUTE:
+      req.cb.readLong = relayReadLong;
+      break;
+
+    case request::WRITE_COMMAND:
+    case request::WRITE_REQUEST:
+    case request::WRITE_LONG_ATTRIBUTE:
+    case request::RELIABLE_WRITE:
+      req.cb.write = relayWrite;
+      break;
+
+    case request::ON_DRAIN:
+      req.cb.drain = relayDrain;
+      break;
+
+    case request::ON_ERROR:
+      req.cb.error = relayError;
+      break;
+
+    case request::DISCOVER_ALL:
+      req.cb.discovery = relayDiscovery;
+      break;
+
+    default:
+      break;
+  }
+  req.data = r;
+}
+
+void
+AttProxy::runRequest(void* data)
+{
+  struct request* req = static_cast<struct request*>(data);
+  req->proxy->handleRequest(*req);
+  delete req;
+}
+
+// Make the request. This is on the Att's thread.
+void
+AttProxy::handleRequest(struct request& req)
+{
+  switch (req.op) {
+    case request::CREATE:
+      att = new Att(thread->getLoop());
+      break;
+
+    case request::CONNECT:
+      if (thread == NULL) {
+        att->connect(req.transport, req.cb.connect, req.data);
+      } else {
+        // Nobody to throw to here, so fail the connect instead
+        try {
+          att->connect(req.transport, req.cb.connect, req.data);
+        } catch (BTLEException& e) {
+          req.cb.connect(req.data, -1, 0);
+        }
+      }
+      break;
+
+    case request::CLOSE:
+      att->close(req.cb.close, req.data);
+      break;
+
+    case request::EXCHANGE_MTU:
+      att->exchangeMTU(req.mtu, req.cb.mtu, req.data, req.timeout);
+      break;
+
+    case request::FIND_INFORMATION:
+      att->findInformation(req.startHandle, req.endHandle, req.cb.list, req.data);
+      break;
+
+    case request::FIND_BY_TYPE_VALUE:
+      att->findByTypeValue(req.startHandle, req.endHandle, req.uuid, req.value, req.length, req.cb.list, req.data);
+      break;
+
+    case request::READ_BY_TYPE:
+      att->readByType(req.startHandle, req.endHandle, req.uuid, req.cb.list, req.data);
+      break;
+
+    case request::READ_ATTRIBUTE:
+      att->readAttribute(req.handle, req.cb.read, req.data, req.length, req.maxAge, req.timeout);
+      break;
+
+    case request::READ_LONG_ATTRIBUTE:
+      att->readLongAttribute(req.handle, req.cb.readLong, req.data, req.stream, req.timeout);
+      break;
+
+    case request::READ_BY_GROUP_TYPE:
+      att->readByGroupType(req.startHandle, req.endHandle, req.uuid, req.cb.list, req.data);
+      break;
+
+    case request::WRITE_COMMAND:
+      att->writeCommand(req.handle, req.value, req.length, req.cb.write, req.data);
+      break;
+
+    case request::WRITE_REQUEST:
+      att->writeRequest(req.handle, req.value, req.length, req.cb.write, req.data, req.timeout);
+      break;
+
+    case request::WRITE_LONG_ATTRIBUTE:
+      att->writeLongAttribute(req.handle, req.value, req.length, req.cb.write, req.data, req.timeout);
+      break;
+
+    case request::RELIABLE_WRITE:
+      att->reliableWrite(req.values, req.cb.write, req.data, req.timeout);
+      break;
+
+    case request::LISTEN:
+      att->listenForNotifications(req.handle, req.cb.read, req.data, &req.filter);
+      break;
+
+    case request::SET_WATER_MARKS:
+      att->setWaterMarks(req.highWaterMark, req.lowWaterMark);
+      break;
+
+    case request::ON_DRAIN:
+      att->onDrain(req.cb.drain, req.data);
+      break;
+
+    case request::ON_ERROR:
+      att->onError(req.cb.error, req.data);
+      break;
+
+    case request::REQUEST_DRAIN:
+      att->requestDrain();
+      break;
+
+    case request::SET_REQUEST_TIMEOUT:
+      att->setRequestTimeout(req.timeout);
+      break;
+
+    case request::CANCEL:
+      att->cancel(req.data);
+      break;
+
+    case request::DISCOVER_ALL:
+      (new GattDiscovery(att, req.cb.discovery, req.data, req.cacheKey))->start();
+      break;
+
+    case request::DESTROY:
+      delete att;
+      att = NULL;
+      IOThread::postToMain(deleteProxy, this);
+      break;
+  }
+}
+
+//
+// Relays. These run on the Att's thread, and copy anything the Att owns, as
+// it may be gone by the time the JS thread runs the reply.
+//
+void
+AttProxy::postReply(struct reply* rp)
+{
+  IOThread::postToMain(runReply, rp);
+}
+
+void
+AttProxy::relayConnect(void* data, int status, int events)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->status = status;
+  rp->events = events;
+  rp->err = errno;
+  postReply(rp);
+}
+
+void
+AttProxy::relayClose(void* data)
+{
+  postReply(new struct reply(static_cast<struct relay*>(data)));
+}
+
+void
+AttProxy::relayError(void* data, const char* error)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->setError(error);
+  postReply(rp);
+}
+
+void
+AttProxy::relayDrain(void* data)
+{
+  postReply(new struct reply(static_cast<struct relay*>(data)));
+}
+
+void
+AttProxy::relayWrite(void* data, const char* error)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->setError(error);
+  postReply(rp);
+}
+
+void
+AttProxy::relayMTU(uint8_t status, void* data, uint16_t mtu, const char* error)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->status = status;
+  rp->mtu = mtu;
+  rp->setError(error);
+  postReply(rp);
+}
+
+// The list belongs to the callback, so it can just be passed on
+void
+AttProxy::relayList(uint8_t status, void* data, void* list, const char* error)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->status = status;
+  rp->list = list;
+  rp->setError(error);
+  postReply(rp);
+}
+
+void
+AttProxy::relayRead(uint8_t status, void* data, uint8_t* buf, int len, const char* error)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->status = status;
+  rp->setBuffer(buf, len);
+  rp->setError(error);
+  postReply(rp);
+}
+
+void
+AttProxy::relayReadLong(uint8_t status, void* data, uint8_t* buf, int len, size_t offset, bool complete, const char* error)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->status = status;
+  rp->setBuffer(buf, len);
+  rp->offset = offset;
+  rp->complete = complete;
+  rp->setError(error);
+  postReply(rp);
+}
+
+// As with lists, the discovery belongs to the callback
+void
+AttProxy::relayDiscovery(uint8_t status, void* data, GattDiscovery* discovery, const char* error)
+{
+  struct reply* rp = new struct reply(static_cast<struct relay*>(data));
+  rp->status = status;
+  rp->discovery = discovery;
+  rp->setError(error);
+  postReply(rp);
+}
+
+//
+// Make the real callback, on the JS thread. If the proxy has been destroyed,
+// just free what the reply owns.
+//
+void
+AttProxy::runReply(void* data)
+{
+  struct reply* rp = static_cast<struct reply*>(data);
+  struct relay* r = rp->r;
+
+  if (r->cancelled) {
+    switch (r->op) {
+      case request::FIND_INFORMATION:
+        delete static_cast<Att::AttributeInfoList*>(rp->list);
+        break;
+      case request::FIND_BY_TYPE_VALUE:
+        delete static_cast<Att::HandlesInfoList*>(rp->list);
+        break;
+      case request::READ_BY_TYPE:
+        delete static_cast<Att::AttributeDataList*>(rp->list);
+        break;
+      case request::READ_BY_GROUP_TYPE:
+        delete static_cast<Att::GroupAttributeDataList*>(rp->list);
+        break;
+      default:
+        break;
+    }
+    delete rp->discovery;
+    delete rp;
+    return;
+  }
+
+  AttProxy* proxy = r->proxy;
+  uint8_t* buf = NULL;
+  if (rp->hasBuf) buf = rp->buf.empty() ? (uint8_t*) "" : (uint8_t*) &rp->buf[0];
+  int len = rp->buf.size();
+  const char* error = rp->hasError ? rp->error.c_str() : NULL;
+  bool done = !r->persistent;
+
+  switch (r->op) {
+    case request::CONNECT:
+      if (rp->status == 0) {
+        proxy->connected = true;
+      } else {
+        proxy->releaseLoop();
+      }
+      errno = rp->err;
+      r->cb.connect(r->data, rp->status, rp->events);
+      break;
+
+    case request::CLOSE:
+      proxy->releaseLoop();
+      r->cb.close(r->data);
+      break;
+
+    case request::EXCHANGE_MTU:
+      if (rp->status == 0 && error == NULL) proxy->mtu = rp->mtu;
+      r->cb.mtu(rp->status, r->data, rp->mtu, error);
+      break;
+
+    case request::FIND_INFORMATION:
+    case request::FIND_BY_TYPE_VALUE:
+    case request::READ_BY_TYPE:
+    case request::READ_BY_GROUP_TYPE:
+      r->cb.list(rp->status, r->data, rp->list, error);
+      break;
+
+    case request::READ_ATTRIBUTE:
+    case request::LISTEN:
+      r->cb.read(rp->status, r->data, buf, len, error);
+      break;
+
+    case request::READ_LONG_ATTRIBUTE:
+      r->cb.readLong(rp->status, r->data, buf, len, rp->offset, rp->complete, error);
+      done = rp->complete;
+      break;
+
+    case request::WRITE_COMMAND:
+    case request::WRITE_REQUEST:
+    case request::WRITE_LONG_ATTRIBUTE:
+    case request::RELIABLE_WRITE:
+      r->cb.write(r->data, error);
+      break;
+
+    case request::ON_DRAIN:
+      r->cb.drain(r->data);
+      break;
+
+    case request::ON_ERROR:
+      r->cb.error(r->data, error);
+      break;
+
+    case request::DISCOVER_ALL:
+      r->cb.discovery(rp->status, r->data, rp->discovery, error);
+      break;
+
+    default:
+      break;
+  }
+
+  if (done) {
+    proxy->relays.erase(r);
+    delete r;
+  }
+  delete rp;
+}
@@ -0,0 +1,109 @@
+#ifndef ATT_PROXY_H
+#define ATT_PROXY_H
+
+#include <set>
+#include <string>
+
+#include "att.h"
+#include "gattDiscovery.h"
+#include "ioThread.h"
+
+/*
+ * Front end for an Att which may be running on an I/O thread. It has the
+ * same requests as Att, and is used from the JS thread. If there's no I/O
+ * thread, each request goes straight to the Att. Otherwise the request (with
+ * copies of any data it points at) is posted to the thread, and the callbacks
+ * are posted back, again with copies of their data, so they're always made on
+ * the JS thread.
+ *
+ * Any callback which hasn't been made by the time the proxy is destroyed is
+ * dropped.
+ */
+class AttProxy {
+public:
+  // Run the Att on the given thread, or the main loop if it's NULL
+  AttProxy(IOThread* thread);
+
+  // Close down the Att, and delete the proxy once the Att's thread is done
+  // with it
+  void destroy();
+
+  void connect(Transport* transport, Connection::ConnectCallback connect, void* data);
+  void close(Connection::CloseCallback cb, void* data);
+  void exchangeMTU(uint16_t mtu, Att::MTUCallback callback, void* data, uint64_t timeout=0);
+  uint16_t getMTU() const;
+  void findInformation(uint16_t startHandle, uint16_t endHandle, Att::AttributeListCallback callback, void* data);
+  void findByTypeValue(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& type,
+    const uint8_t* value, size_t vlen, Att::AttributeListCallback callback, void* data);
+  void readByType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& uuid,
+    Att::AttributeListCallback callback, void* data);
+  void readAttribute(uint16_t handle, Att::ReadAttributeCallback callback, void* data, size_t length=0,
+    uint64_t maxAge=0, uint64_t timeout=0);
+  void readLongAttribute(uint16_t handle, Att::ReadLongCallback callback, void* data, bool stream=false,
+    uint64_t timeout=0);
+  void readByGroupType(uint16_t startHandle, uint16_t endHandle, const bt_uuid_t& uuid,
+    Att::AttributeListCallback callback, void* data);
+  bool writeCommand(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL);
+  void writeRequest(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL,
+    uint64_t timeout=0);
+  void writeLongAttribute(uint16_t handle, const uint8_t* data, size_t length, Connection::WriteCallback callback=NULL, void* cbData=NULL,
+    uint64_t timeout=0);
+  void reliableWrite(const Att::WriteList& values, Connection::WriteCallback callback=NULL, void* cbData=NULL,
+    uint64_t timeout=0);
+  void listenForNotifications(uint16_t handle, Att::ReadAttributeCallback callback, void* data,
+    const NotificationFilter::Options* filter=NULL);
+  void setWaterMarks(size_t high, size_t low);
+  size_t getWriteQueueSize() const;
+  bool getCachedValue(uint16_t handle, uint64_t maxAge, std::vector<uint8_t>& value, uint64_t& age);
+  void onDrain(Connection::DrainCallback handler, void* data);
+  void onError(Att::ErrorCallback handler, void* data);
+  void setRequestTimeout(uint64_t timeout);
+  void cancel(void* data);
+
+  // Discover the whole GATT database, as GattDiscovery does. The discovery
+  // passed to the callback belongs to the callback.
+  void discoverAll(GattDiscovery::DiscoveryCallback callback, void* data, const std::string& cacheKey);
+
+private:
+  union callback;
+  struct request;
+  struct relay;
+  struct reply;
+
+  virtual ~AttProxy();
+
+  // Run a request on the Att's thread
+  void submit(struct request& req);
+  static void runRequest(void* data);
+  void handleRequest(struct request& req);
+
+  // Callbacks on the I/O thread, which post a reply to the JS thread
+  static void relayConnect(void* data, int status, int events);
+  static void relayClose(void* data);
+  static void relayError(void* data, const char* error);
+  static void relayDrain(void* data);
+  static void relayWrite(void* data, const char* error);
+  static void relayMTU(uint8_t status, void* data, uint16_t mtu, const char* error);
+  static void relayList(uint8_t status, void* data, void* list, const char* error);
+  static void relayRead(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
+  static void relayReadLong(uint8_t status, void* data, uint8_t* buf, int len, size_t offset, bool complete, const char* error);
+  static void relayDiscovery(uint8_t status, void* data, GattDiscovery* discovery, const char* error);
+  static void postReply(struct reply* rp);
+  static void runReply(void* data);
+  void wrapCallback(struct request& req);
+  static void deleteProxy(void* data);
+  void releaseLoop();
+
+  IOThread* thread;
+  Att* att;                 // Only used on the Att's thread, and once connected on the JS thread
+  bool connected;
+  bool referenced;          // Whether we're keeping the main loop alive
+  size_t highWaterMark;
+  uint16_t mtu;             // Copy of the Att's MTU, kept on the JS thread
+
+  // Callbacks we're waiting to make on the JS thread
+  typedef std::set<struct relay*> RelaySet;
+  RelaySet relays;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include <uv.h>
+
+#include "attributeMirror.h"
+
+static const uint64_t NS_PER_MS = 1000000;
+
+// Constructor
+AttributeMirror::AttributeMirror()
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+// Destructor
+AttributeMirror::~AttributeMirror()
+{
+  entries.forEach(deleteEntry);
+  pthread_mutex_destroy(&lock);
+}
+
+void
+AttributeMirror::deleteEntry(Entry*& entry)
+{
+  delete entry;
+  entry = NULL;
+}
+
+//
+// Store the latest value of an attribute
+// Arguments:
+//  handle - The attribute's handle
+//  value  - Its value
+//  length - The length of the value
+//
+void
+AttributeMirror::update(uint16_t handle, const uint8_t* value, size_t length)
+{
+  pthread_mutex_lock(&lock);
+  Entry*& entry = entries[handle];
+  if (entry == NULL) entry = new Entry();
+  entry->value.assign(value, value + length);
+  entry->updated = uv_hrtime();
+  pthread_mutex_unlock(&lock);
+}
+
+// Forget an attribute's value
+void
+AttributeMirror::invalidate(uint16_t handle)
+{
+  pthread_mutex_lock(&lock);
+  Entry* entry = entries.get(handle);
+  if (entry != NULL) {
+    delete entry;
+    entries[handle] = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+//
+// Get an attribute's value
+// Arguments:
+//  handle - The attribute's handle
+//  maxAge - Oldest value to return, in milliseconds, or zero for any
+//  value  - Where to put the value
+//  age    - Where to put its age, in milliseconds
+//
+bool
+AttributeMirror::get(uint16_t handle, uint64_t maxAge, std::vector<uint8_t>& value, uint64_t& age)
+{
+  bool found = false;
+  pthread_mutex_lock(&lock);
+  Entry* entry = entries.get(handle);
+  if (entry != NULL) {
+    age = (uv_hrtime() - entry->updated) / NS_PER_MS;
+    if (maxAge == 0 || age <= maxAge) {
+      value = entry->value;
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return found;
+}
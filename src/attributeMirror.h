@@ -0,0 +1,51 @@
+#ifndef ATTRIBUTE_MIRROR_H
+#define ATTRIBUTE_MIRROR_H
+
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "handleTable.h"
+
+/*
+ * Local copy of a device's attribute values, as last seen in read responses,
+ * notifications and indications, so they can be read back synchronously
+ * without a round trip to the device. Writes invalidate the handle they're
+ * to, since we don't know what the device makes of the value.
+ *
+ * The Att updates the mirror on its own loop, which may be an I/O thread,
+ * while JS reads it, so everything is done under a lock.
+ */
+class AttributeMirror {
+public:
+  AttributeMirror();
+  virtual ~AttributeMirror();
+
+  // Store the latest value of an attribute
+  void update(uint16_t handle, const uint8_t* value, size_t length);
+
+  // Forget an attribute's value
+  void invalidate(uint16_t handle);
+
+  // Copy out an attribute's value, and how long ago it was stored, in
+  // milliseconds. Returns false if there isn't one, or if it's older than
+  // maxAge (when that's not zero)
+  bool get(uint16_t handle, uint64_t maxAge, std::vector<uint8_t>& value, uint64_t& age);
+
+private:
+  struct Entry {
+    std::vector<uint8_t> value;
+    uint64_t updated;           // uv_hrtime() when it was stored
+  };
+
+  // Not copyable
+  AttributeMirror(const AttributeMirror&);
+  AttributeMirror& operator=(const AttributeMirror&);
+
+  static void deleteEntry(Entry*& entry);
+
+  HandleTable<Entry*> entries;
+  pthread_mutex_t lock;
+};
+
+#endif
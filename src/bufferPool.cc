@@ -0,0 +1,72 @@
+#include <map>
+#include <pthread.h>
+
+#include "bufferPool.h"
+
+// Pools by loop. Lookups are rare - users hang on to their pool - so a
+// lock around the map is fine.
+typedef std::map<uv_loop_t*, BufferPool*> PoolMap;
+static PoolMap pools;
+static pthread_mutex_t poolsLock = PTHREAD_MUTEX_INITIALIZER;
+
+BufferPool*
+BufferPool::get(uv_loop_t* loop)
+{
+  pthread_mutex_lock(&poolsLock);
+  BufferPool*& pool = pools[loop];
+  if (pool == NULL) {
+    pool = new BufferPool();
+  }
+  pthread_mutex_unlock(&poolsLock);
+  return pool;
+}
+
+BufferPool::BufferPool()
+{
+  freeSlabs.reserve(MAX_FREE_SLABS);
+}
+
+BufferPool::~BufferPool()
+{
+  for (std::vector<char*>::iterator it = freeSlabs.begin(); it != freeSlabs.end(); ++it) {
+    delete [] *it;
+  }
+}
+
+//
+// Get a buffer
+// Arguments:
+//  size - The size needed. The returned buffer's len is set to this, even if
+//         it's a slab with more room.
+//
+uv_buf_t
+BufferPool::allocate(size_t size)
+{
+  char* block;
+  if (size > SLAB_SIZE) {
+    block = new char[sizeof(Header) + size];
+    reinterpret_cast<Header*>(block)->pool = NULL;
+  } else if (freeSlabs.empty()) {
+    block = new char[sizeof(Header) + SLAB_SIZE];
+    reinterpret_cast<Header*>(block)->pool = this;
+  } else {
+    block = freeSlabs.back();
+    freeSlabs.pop_back();
+  }
+
+  return uv_buf_init(block + sizeof(Header), size);
+}
+
+void
+BufferPool::release(char* base)
+{
+  if (base == NULL) return;
+
+  char* block = base - sizeof(Header);
+  BufferPool* pool = reinterpret_cast<Header*>(block)->pool;
+  if (pool != NULL && pool->freeSlabs.size() < MAX_FREE_SLABS) {
+    pool->freeSlabs.push_back(block);
+  } else {
+    delete [] block;
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <vector>
+#include <uv.h>
+
+/*
+ * Pool of fixed size transmit buffers, shared by all the connections on a
+ * loop. The slabs are big enough for any ATT PDU, so encoding and writing a
+ * PDU just moves a slab on and off the free list. Anything bigger gets
+ * allocated (and freed) individually.
+ *
+ * Received data doesn't come from here: on the main loop it's read straight
+ * into a BufferSlab, so it can be handed to JS without a copy, and on an I/O
+ * thread into the connection's own read buffer.
+ *
+ * A pool must only be used from the thread running its loop.
+ */
+class BufferPool {
+public:
+  // Slab size - enough for the largest MTU we'll negotiate, with room to spare
+  static const size_t SLAB_SIZE = 1024;
+
+  // Most slabs we'll keep around on the free list
+  static const size_t MAX_FREE_SLABS = 256;
+
+  // Get the pool for a loop, creating it if needed
+  static BufferPool* get(uv_loop_t* loop);
+
+  // Get a buffer of at least the given size
+  uv_buf_t allocate(size_t size);
+
+  // Return a buffer allocated from any pool. NULL is ignored.
+  static void release(char* base);
+
+private:
+  BufferPool();
+  ~BufferPool();
+
+  // Not copyable
+  BufferPool(const BufferPool&);
+  BufferPool& operator=(const BufferPool&);
+
+  // Header in front of every buffer, saying where it came from
+  union Header {
+    BufferPool* pool; // NULL if the buffer wasn't a slab
+    double align;
+  };
+
+  std::vector<char*> freeSlabs;
+};
+
+#endif
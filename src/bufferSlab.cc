@@ -0,0 +1,81 @@
+#include <string.h>
+#include <node_buffer.h>
+
+#include "bufferSlab.h"
+
+using namespace v8;
+using namespace node;
+
+char* BufferSlab::base = NULL;
+size_t BufferSlab::size = 0;
+size_t BufferSlab::used = 0;
+Persistent<Object> BufferSlab::slab;
+Persistent<Function> BufferSlab::bufferConstructor;
+
+uv_buf_t
+BufferSlab::allocate(size_t size)
+{
+  if (base == NULL || BufferSlab::size - used < size) {
+    newSlab(size > SLAB_SIZE ? size : SLAB_SIZE);
+  }
+
+  char* ret = base + used;
+  used += size;
+  return uv_buf_init(ret, size);
+}
+
+void
+BufferSlab::trim(const char* buf, ssize_t nread)
+{
+  if (buf >= base && buf < base + size) {
+    used = (buf - base) + (nread > 0 ? nread : 0);
+  }
+}
+
+//
+// Start a new slab. We drop our reference to the old one, so it's freed
+// once there are no slices of it left.
+//
+void
+BufferSlab::newSlab(size_t size)
+{
+  HandleScope scope;
+
+  if (!slab.IsEmpty()) {
+    slab.Dispose();
+    slab.Clear();
+  }
+
+  base = new char[size];
+  BufferSlab::size = size;
+  used = 0;
+  slab = Persistent<Object>::New(Buffer::New(base, size, onFree, NULL)->handle_);
+}
+
+void
+BufferSlab::onFree(char* data, void* hint)
+{
+  delete [] data;
+}
+
+Local<Object>
+BufferSlab::slice(const uint8_t* data, size_t length)
+{
+  HandleScope scope;
+
+  const char* start = (const char*) data;
+  if (data == NULL || slab.IsEmpty() || start < base || start + length > base + used) {
+    Buffer* buffer = Buffer::New(length);
+    if (length > 0) memcpy(Buffer::Data(buffer), data, length);
+    return scope.Close(Local<Object>::New(buffer->handle_));
+  }
+
+  // new Buffer(slab, length, offset) makes a slice of the slab
+  if (bufferConstructor.IsEmpty()) {
+    Local<Value> constructor = Context::GetCurrent()->Global()->Get(String::NewSymbol("Buffer"));
+    bufferConstructor = Persistent<Function>::New(Local<Function>::Cast(constructor));
+  }
+  const int argc = 3;
+  Handle<Value> argv[argc] = { slab, Integer::NewFromUnsigned(length), Integer::NewFromUnsigned(start - base) };
+  return scope.Close(bufferConstructor->NewInstance(argc, argv));
+}
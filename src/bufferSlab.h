@@ -0,0 +1,43 @@
+#ifndef BUFFER_SLAB_H
+#define BUFFER_SLAB_H
+
+#include <node.h>
+#include <uv.h>
+
+/*
+ * Read buffers for connections on the main loop, carved out of large slabs
+ * which are themselves JS buffers. Anything read into a slab can then be
+ * handed to JS as a slice of it, with no allocation or copy, the same way
+ * Node's net module does it. A slab is freed by the garbage collector once
+ * we've moved on from it and there are no slices of it left.
+ *
+ * Only for use on the JS thread.
+ */
+class BufferSlab {
+public:
+  // Slab size. Reads bigger than this get a slab of their own.
+  static const size_t SLAB_SIZE = 32 * 1024;
+
+  // Get a read buffer, from the end of the current slab
+  static uv_buf_t allocate(size_t size);
+
+  // Give back the part of the last buffer allocated that the read didn't
+  // use. nread is as passed to the read callback.
+  static void trim(const char* base, ssize_t nread);
+
+  // A JS buffer holding the data. If the data is in the current slab, it's
+  // a slice of it, otherwise it's a copy.
+  static v8::Local<v8::Object> slice(const uint8_t* data, size_t length);
+
+private:
+  static void newSlab(size_t size);
+  static void onFree(char* data, void* hint);
+
+  static char* base;       // Current slab
+  static size_t size;
+  static size_t used;
+  static v8::Persistent<v8::Object> slab;
+  static v8::Persistent<v8::Function> bufferConstructor;
+};
+
+#endif
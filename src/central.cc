@@ -5,6 +5,8 @@
 #include "central.h"
 #include "debug.h"
 #include "btio.h"
+#include "bufferSlab.h"
+#include "connection.h"
 #include "util.h"
 
 using namespace v8;
@@ -15,7 +17,8 @@ Persistent<Function>
 Central::constructor;
 
 Central::Central()
-: sock(-1), cid(0), mtu(0), poll_handle(NULL), tcp(NULL)
+: transport(NULL), sock(-1), cid(0), mtu(0), poll_handle(NULL), tcp(NULL),
+  highWaterMark(Connection::DEFAULT_HIGH_WATER_MARK), lowWaterMark(Connection::DEFAULT_LOW_WATER_MARK), needDrain(false)
 {
   memset(&this->src, 0, sizeof(this->src));
   memset(&this->dst, 0, sizeof(this->dst));
@@ -23,6 +26,7 @@ Central::Central()
 
 Central::~Central()
 {
+  delete transport;
 }
 
 void
@@ -97,6 +101,8 @@ Central::SetMTU(const Arguments& args)
 //   'connect': emitted on connection if no callback is specified
 //   'error': emitted on an error if no callback is specified
 //   'data': emitted when data is read from the socket
+//   'drain': emitted when the write queue drops below the low water mark,
+//            after a write returned false
 //
 Handle<Value>
 Central::Listen(const Arguments& args)
@@ -134,8 +140,19 @@ Central::Listen(const Arguments& args)
     return scope.Close(Undefined());
   }
 
+  if (!getWaterMarks(options, central->highWaterMark, central->lowWaterMark)) {
+    return scope.Close(Undefined());
+  }
+
+  Transport* transport = getTransport(opts, options);
+  if (transport == NULL) {
+    return scope.Close(Undefined());
+  }
+  delete central->transport;
+  central->transport = transport;
+
   // Listen
-  central->sock = bt_io_listen(&opts);
+  central->sock = transport->listen();
   if (central->sock == -1) {
     // Throw exception
     throw BTLEException("Error creating socket", errno);
@@ -177,12 +194,12 @@ Central::onConnect(uv_poll_t* handle, int status, int events)
       central->sock = -1;
 
       // Get some of the connect parameters
-      bt_io_get(cli_sock,
-        BT_IO_OPT_SOURCE_BDADDR, &central->src,
-        BT_IO_OPT_DEST, &central->dst,
-        BT_IO_OPT_CID, &central->cid,
-        BT_IO_OPT_IMTU, &central->mtu,
-        BT_IO_OPT_INVALID);
+      Transport::Info info;
+      central->transport->getInfo(cli_sock, info);
+      bacpy(&central->src, &info.src);
+      memcpy(central->dst, info.dst, sizeof(central->dst));
+      central->cid = info.cid;
+      central->mtu = info.imtu;
       
       // Wrap the socket in uv's tcp
       if (debug) printf("dst = %s, cid = %d, mtu = %d\n", central->dst, central->cid, central->mtu);
@@ -267,7 +284,9 @@ uv_buf_t
 Central::onAlloc(uv_handle_t* handle, size_t suggested)
 {
   if (debug) printf("Central::onAlloc\n");
-  return uv_buf_init(new char[suggested], suggested);
+  Central* central = static_cast<Central*>(handle->data);
+  size_t size = central->mtu > BufferPool::SLAB_SIZE ? central->mtu : BufferPool::SLAB_SIZE;
+  return BufferSlab::allocate(size);
 }
 
 void
@@ -276,6 +295,7 @@ Central::onRead(uv_stream_t* stream, ssize_t nread, uv_buf_t buf)
   if (debug) printf("Central::onRead, nread=%d\n", nread);
   // Emit 'data' event with Buffer containing data
   Central* central = static_cast<Central*>(stream->data);
+  BufferSlab::trim(buf.base, nread);
   // nread < 0 signals an error
   if (nread < 0) {
     uv_read_stop(stream);
@@ -293,10 +313,8 @@ Central::onRead(uv_stream_t* stream, ssize_t nread, uv_buf_t buf)
       MakeCallback(central->self, "emit", argc, argv);
     }
   } else if (nread > 0) {
-    Buffer* buffer = Buffer::New(nread);
-    memcpy(Buffer::Data(buffer), buf.base, nread);
     const int argc = 2;
-    Local<Value> argv[argc] = { String::New("data"), Local<Value>::New(buffer->handle_) };
+    Local<Value> argv[argc] = { String::New("data"), BufferSlab::slice((const uint8_t*) buf.base, nread) };
     MakeCallback(central->self, "emit", argc, argv);
   }
   if (debug) printf("Central::onRead returning\n");
@@ -364,13 +382,13 @@ Central::Write(const Arguments& args)
     sprintf(buffer, "Data length of %d is greater than MTU value of %d", len, central->mtu);
     ThrowException(Exception::TypeError(String::New(buffer)));
   }
-  central->write(data, len, wd);
+  bool ok = central->write(data, len, wd);
 
   if (debug) printf("Central::Write returning\n");
-  return scope.Close(Undefined());
+  return scope.Close(Boolean::New(ok));
 }
 
-void
+bool
 Central::write(char* data, size_t len, void* wdData)
 {
   struct WriteData* wd = static_cast<struct WriteData*>(wdData);
@@ -388,6 +406,12 @@ Central::write(char* data, size_t len, void* wdData)
     printf("\n");
   }
   uv_write(req, getStream(), &buf, 1, onWrite);
+
+  if (getStream()->write_queue_size >= highWaterMark) {
+    needDrain = true;
+    return false;
+  }
+  return true;
 }
 
 void
@@ -416,7 +440,15 @@ Central::onWrite(uv_write_t* req, int status)
       }
     }
   }
+  Central* central = wd->central;
   delete req;
   delete wd;
+
+  if (central->needDrain && central->tcp != NULL && central->getStream()->write_queue_size <= central->lowWaterMark) {
+    central->needDrain = false;
+    const int argc = 1;
+    Local<Value> argv[argc] = { String::New("drain") };
+    MakeCallback(central->self, "emit", argc, argv);
+  }
   if (debug) printf("Central::onWrite returning\n");
 }
@@ -4,6 +4,9 @@
 #include <node.h>
 #include <bluetooth/bluetooth.h>
 
+#include "bufferPool.h"
+#include "transport.h"
+
 class Central: node::ObjectWrap {
 public:
   Central();
@@ -29,9 +32,10 @@ private:
 
   uv_stream_t* getStream() { return (uv_stream_t*) tcp; }
 
-  void write(char* data, size_t len, void* wd);
+  bool write(char* data, size_t len, void* wd);
   void close();
 
+  Transport* transport;
   int sock;
 	bdaddr_t src;
 	char dst[256];
@@ -39,6 +43,9 @@ private:
   size_t mtu;
   uv_poll_t* poll_handle;
   uv_tcp_t* tcp;
+  size_t highWaterMark;  // Write queue limits
+  size_t lowWaterMark;
+  bool needDrain;        // Whether a write has returned false
   v8::Handle<v8::Object> self;
   v8::Persistent<v8::Function> connectionCallback;
 };
@@ -1,54 +1,83 @@
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 #include "connection.h"
+#include "bufferSlab.h"
 #include "btio.h"
 #include "btleException.h"
 
-// Struct for write callbacks
-struct writeData
+// Struct for connection callbacks
+struct connectData
 {
-  writeData() : connection(NULL), data(NULL), callback(NULL), buffer(NULL) {}
-
-  Connection* connection;
+  connectData() : conn(NULL), callback(NULL), data(NULL) {}
+  Connection* conn;
+  Connection::ConnectCallback callback;
   void* data;
-  Connection::WriteCallback callback;
-  char* buffer;
 };
 
 // Constructor
-Connection::Connection()
-: sock(0), tcp(NULL), poll_handle(NULL), imtu(0), cid(0),
-  readCb(NULL), readData(NULL)
+Connection::Connection(uv_loop_t* loop)
+: loop(loop), transport(NULL), sock(-1), connected(false), reading(false), poll_handle(NULL), imtu(0),
+  mtu(ATT_DEFAULT_LE_MTU), cid(0), pool(BufferPool::get(loop)), readCb(NULL), readData(NULL), pendingBytes(0), queuedBytes(0),
+  highWaterMark(DEFAULT_HIGH_WATER_MARK), lowWaterMark(DEFAULT_LOW_WATER_MARK), needDrain(false),
+  queueSize(0), drainCb(NULL), drainData(NULL)
 {
+  flushHandle = new uv_prepare_t;
+  flushHandle->data = this;
+  uv_prepare_init(loop, flushHandle);
 }
 
 // Destructor
 Connection::~Connection()
 {
-  delete this->tcp;
-  delete this->poll_handle;
+  for (WriteList::iterator it = pendingWrites.begin(); it != pendingWrites.end(); ++it) {
+    BufferPool::release(it->buffer.base);
+  }
+  for (WriteList::iterator it = writeQueue.begin(); it != writeQueue.end(); ++it) {
+    BufferPool::release(it->buffer.base);
+  }
+  uv_close((uv_handle_t*) flushHandle, onFlushHandleClose);
+
+  if (this->poll_handle != NULL) {
+    // If we're still connecting, the handle has the connect callback's data
+    if (this->poll_handle->data != this) {
+      delete static_cast<struct connectData*>(this->poll_handle->data);
+    }
+    uv_close((uv_handle_t*) this->poll_handle, onPollHandleClose);
+  }
+  if (this->sock >= 0) {
+    ::close(this->sock);
+  }
+  delete this->transport;
 }
 
-// Struct for connection callbacks
-struct connectData
+void
+Connection::onFlushHandleClose(uv_handle_t* handle)
 {
-  connectData() : conn(NULL), callback(NULL), data(NULL) {}
-  Connection* conn;
-  Connection::ConnectCallback callback;
-  void* data;
-};
+  delete (uv_prepare_t*) handle;
+}
+
+void
+Connection::onPollHandleClose(uv_handle_t* handle)
+{
+  delete (uv_poll_t*) handle;
+}
 
 //
 // Connect to the Bluetooth device
 // Arguments:
-//  opts    - Connection options
-//  connect - Connect callback
-//  data    - Optional callback data
+//  transport - The transport to connect over
+//  connect   - Connect callback
+//  data      - Optional callback data
 //
 void
-Connection::connect(struct set_opts& opts, ConnectCallback connect, void* data)
+Connection::connect(Transport* transport, ConnectCallback connect, void* data)
 {
-  this->sock = bt_io_connect(&opts);
+  delete this->transport;
+  this->transport = transport;
+  this->sock = transport->connect();
   if (this->sock == -1)
   {
     // Throw exception
@@ -61,7 +90,7 @@ Connection::connect(struct set_opts& opts, ConnectCallback connect, void* data)
   cd->conn = this;
   this->poll_handle = new uv_poll_t;
   this->poll_handle->data = cd;
-  uv_poll_init_socket(uv_default_loop(), this->poll_handle, this->sock);
+  uv_poll_init_socket(loop, this->poll_handle, this->sock);
   uv_poll_start(this->poll_handle, UV_WRITABLE, onConnect);
 }
 
@@ -74,18 +103,154 @@ Connection::registerReadCallback(ReadCallback callback, void* cbData)
 }
 
 // Write to the device
-void
+bool
 Connection::write(uv_buf_t& buffer, WriteCallback callback, void* cbData)
 {
-  uv_write_t* req = new uv_write_t();
-  struct writeData* wd = new struct writeData();
-  wd->connection = this;
-  wd->data = cbData;
-  wd->callback = callback;
-  wd->buffer = buffer.base;
-  req->data = wd;
+  if (pendingWrites.empty()) {
+    uv_prepare_start(flushHandle, onFlushWrites);
+  }
+
+  struct pendingWrite pw;
+  pw.buffer = buffer;
+  pw.callback = callback;
+  pw.data = cbData;
+  pendingWrites.push_back(pw);
+  pendingBytes += buffer.len;
+  size_t size = currentQueueSize();
+  __atomic_store_n(&queueSize, size, __ATOMIC_RELAXED);
+  return size < highWaterMark;
+}
+
+size_t
+Connection::currentQueueSize() const
+{
+  return pendingBytes + queuedBytes;
+}
+
+void
+Connection::requestDrain()
+{
+  needDrain = true;
+  checkDrain();
+}
+
+void
+Connection::checkDrain()
+{
+  size_t size = currentQueueSize();
+  __atomic_store_n(&queueSize, size, __ATOMIC_RELAXED);
+  if (needDrain && size <= lowWaterMark) {
+    needDrain = false;
+    if (drainCb) drainCb(drainData);
+  }
+}
+
+void
+Connection::flush()
+{
+  if (!pendingWrites.empty()) flushWrites();
+}
+
+void
+Connection::onFlushWrites(uv_prepare_t* handle, int status)
+{
+  Connection* conn = static_cast<Connection*>(handle->data);
+  conn->flushWrites();
+}
+
+// Most PDUs we'll send in one system call
+static const size_t MAX_BATCH = 32;
+
+//
+// Send the writes made this iteration. They go on the end of the write queue,
+// so they stay in order behind anything the socket hasn't taken yet.
+//
+void
+Connection::flushWrites()
+{
+  uv_prepare_stop(flushHandle);
+
+  writeQueue.insert(writeQueue.end(), pendingWrites.begin(), pendingWrites.end());
+  queuedBytes += pendingBytes;
+  pendingWrites.clear();
+  pendingBytes = 0;
+
+  sendQueued();
+}
+
+//
+// Each PDU has to go in its own message to keep the boundaries, so we use
+// sendmmsg() to send a batch at a time. Whatever the socket won't take yet
+// stays queued, and we poll for it becoming writable.
+//
+void
+Connection::sendQueued()
+{
+  if (!connected || writeQueue.empty()) return;
+
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+  size_t sent = 0;
+  const char* error = NULL;
+  while (sent < writeQueue.size()) {
+    size_t batch = writeQueue.size() - sent < MAX_BATCH ? writeQueue.size() - sent : MAX_BATCH;
+    memset(msgs, 0, batch * sizeof(msgs[0]));
+    for (size_t i = 0; i < batch; i++) {
+      iovs[i].iov_base = writeQueue[sent + i].buffer.base;
+      iovs[i].iov_len = writeQueue[sent + i].buffer.len;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int count = sendmmsg(this->sock, msgs, batch, MSG_DONTWAIT);
+    if (count < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) error = strerror(errno);
+      break;
+    }
+    sent += count;
+    if ((size_t) count < batch) break;
+  }
+
+  // Take the finished writes off the queue before calling back, in case the
+  // callbacks write more. On an error, everything's finished.
+  WriteList sentWrites(writeQueue.begin(), writeQueue.begin() + sent);
+  WriteList failedWrites;
+  writeQueue.erase(writeQueue.begin(), writeQueue.begin() + sent);
+  if (error != NULL) {
+    failedWrites.swap(writeQueue);
+  }
+  queuedBytes = 0;
+  for (WriteList::iterator it = writeQueue.begin(); it != writeQueue.end(); ++it) {
+    queuedBytes += it->buffer.len;
+  }
+  updatePoll();
+
+  completeWrites(sentWrites, NULL);
+  completeWrites(failedWrites, error);
+  checkDrain();
+}
+
+void
+Connection::completeWrites(WriteList& writes, const char* error)
+{
+  for (WriteList::iterator it = writes.begin(); it != writes.end(); ++it) {
+    if (it->callback) it->callback(it->data, error);
+    BufferPool::release(it->buffer.base);
+  }
+}
+
+// Poll for reads, and for writes if there's anything queued
+void
+Connection::updatePoll()
+{
+  if (this->poll_handle == NULL || !connected) return;
 
-  uv_write(req, getStream(), &buffer, 1, onWrite);
+  int events = (reading ? UV_READABLE : 0) | (writeQueue.empty() ? 0 : UV_WRITABLE);
+  if (events == 0) {
+    uv_poll_stop(this->poll_handle);
+  } else {
+    uv_poll_start(this->poll_handle, events, onIO);
+  }
 }
 
 // Struct for close callbacks
@@ -105,13 +270,27 @@ struct closeData
 void
 Connection::close(CloseCallback cb, void* data)
 {
-  if (this->tcp)
+  if (connected)
   {
+    // Get any last writes out first
+    flushWrites();
+    connected = false;
+    reading = false;
+
     struct closeData* cd = new struct closeData();
     cd->callback = cb;
     cd->data = data;
-    this->tcp->data = cd;
-    uv_close((uv_handle_t*) this->tcp, onClose);
+    this->poll_handle->data = cd;
+    uv_close((uv_handle_t*) this->poll_handle, onClose);
+    this->poll_handle = NULL;
+    ::close(this->sock);
+    this->sock = -1;
+
+    // Anything still queued isn't going anywhere
+    WriteList cancelled;
+    cancelled.swap(writeQueue);
+    queuedBytes = 0;
+    completeWrites(cancelled, strerror(ECANCELED));
   }
 }
 
@@ -120,56 +299,111 @@ Connection::close(CloseCallback cb, void* data)
 //
 
 //
-// Write callback
+// Close callback
 //
 void
-Connection::onWrite(uv_write_t* req, int status)
+Connection::onClose(uv_handle_t* handle)
 {
-  struct writeData* wd = (struct writeData*) req->data;
-  if (wd->callback) {
-    if (status < 0) {
-      uv_err_t err = uv_last_error(uv_default_loop());
-      wd->callback(wd->data, uv_strerror(err));
-    } else {
-      wd->callback(wd->data, NULL);
-    }
-  }
-  delete [] wd->buffer;
-  delete req;
-  delete wd;
+  struct closeData* cd = static_cast<struct closeData*>(handle->data);
+  if (cd && cd->callback)
+    cd->callback(cd->data);
+  delete cd;
+  delete (uv_poll_t*) handle;
 }
 
 //
-// Close callback
+// The socket's readable and/or writable
 //
 void
-Connection::onClose(uv_handle_t* handle)
+Connection::onIO(uv_poll_t* handle, int status, int events)
 {
-  struct closeData* cd = static_cast<struct closeData*>(handle->data);
-  if (cd && cd->callback)
-    cd->callback(cd->data);
+  Connection* conn = static_cast<Connection*>(handle->data);
+
+  if (status < 0) {
+    uv_err_t err = uv_last_error(conn->loop);
+    conn->readError(uv_strerror(err));
+    return;
+  }
+
+  if (events & UV_WRITABLE) {
+    conn->sendQueued();
+  }
+  if ((events & UV_READABLE) && conn->reading) {
+    conn->readBatch();
+  }
 }
 
 //
-// Read callback
+// Read PDUs with recvmmsg(), a batch at a time, and pass each one to the
+// read callback. On the main loop they're read into a JS slab, and moved down
+// next to each other so the slab isn't left with gaps.
 //
 void
-Connection::onRead(uv_stream_t* stream, ssize_t nread, uv_buf_t buf)
+Connection::readBatch()
 {
-  Connection* conn = static_cast<Connection*>(stream->data);
+  size_t slotSize = imtu > mtu ? imtu : mtu;
+  bool useSlab = loop == uv_default_loop();
+  if (!useSlab) readBuffer.resize(READ_BATCH * slotSize);
+
+  struct mmsghdr msgs[READ_BATCH];
+  struct iovec iovs[READ_BATCH];
+  size_t offsets[READ_BATCH];
+  for (size_t batches = 0; batches < MAX_READ_BATCHES && reading; batches++) {
+    char* base = useSlab ? BufferSlab::allocate(READ_BATCH * slotSize).base : &readBuffer[0];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (size_t i = 0; i < READ_BATCH; i++) {
+      iovs[i].iov_base = base + i * slotSize;
+      iovs[i].iov_len = slotSize;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-  if (conn->readCb != NULL) {
-    // nread < 0 signals an error
-    if (nread < 0) {
-      uv_err_t err = uv_last_error(uv_default_loop());
-      conn->readCb(conn->readData, NULL, nread, uv_strerror(err));
-    } else {
-      conn->readCb(conn->readData, (uint8_t*) buf.base, nread, NULL);
+    int count = recvmmsg(this->sock, msgs, READ_BATCH, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+      int err = errno;
+      if (useSlab) BufferSlab::trim(base, 0);
+      if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR) readError(strerror(err));
+      return;
     }
+
+    // A zero length message means the other end has gone
+    bool eof = false;
+    size_t used = 0;
+    for (int i = 0; i < count; i++) {
+      size_t len = msgs[i].msg_len;
+      if (len == 0) {
+        eof = true;
+        count = i;
+        break;
+      }
+      if (useSlab && used != i * slotSize) {
+        memmove(base + used, base + i * slotSize, len);
+      }
+      offsets[i] = useSlab ? used : i * slotSize;
+      used += len;
+    }
+    if (useSlab) BufferSlab::trim(base, used);
+
+    for (int i = 0; i < count && reading; i++) {
+      if (readCb != NULL) readCb(readData, (uint8_t*) base + offsets[i], msgs[i].msg_len, NULL);
+    }
+
+    if (eof) {
+      readError("end of file");
+      return;
+    }
+    if ((size_t) count < READ_BATCH) return;
   }
+}
 
-  delete [] buf.base;
-  buf.base = NULL;
+void
+Connection::readError(const char* error)
+{
+  if (!reading) return;
+  reading = false;
+  updatePoll();
+  if (readCb != NULL) readCb(readData, NULL, -1, error);
 }
 
 //
@@ -181,25 +415,20 @@ Connection::onConnect(uv_poll_t* handle, int status, int events)
   // Stop polling
   uv_poll_stop(handle);
   struct connectData* cd = static_cast<struct connectData*>(handle->data);
-  // Need to do this, otherwise onClose will crash
-  handle->data = NULL;
-  uv_close((uv_handle_t*) handle, onClose);
   Connection* conn = cd->conn;
+  handle->data = conn;
   if (status == 0) {
-
-    // Get our socket
-    int fd = handle->io_watcher.fd;
-
     // Get the CID and MTU information
-    bt_io_get(fd, BT_IO_OPT_IMTU, &conn->imtu,
-        BT_IO_OPT_CID, &conn->cid, BT_IO_OPT_INVALID);
+    Transport::Info info;
+    conn->transport->getInfo(conn->sock, info);
+    conn->imtu = info.imtu;
+    conn->cid = info.cid;
 
-    // Convert the socket to a TCP handle, and start reading
-    conn->tcp = new uv_tcp_t();
-    uv_tcp_init(uv_default_loop(), conn->tcp);
-    uv_tcp_open(conn->tcp, fd);
-    conn->tcp->data = (void*) conn;
-    uv_read_start((uv_stream_t*) conn->tcp, onAlloc, onRead);
+    // Start reading, and send anything written while we were connecting
+    conn->connected = true;
+    conn->reading = true;
+    conn->updatePoll();
+    conn->sendQueued();
   }
   cd->callback(cd->data, status, events);
   delete cd;
@@ -211,15 +440,13 @@ Connection::onConnect(uv_poll_t* handle, int status, int events)
 uv_buf_t
 Connection::getBuffer()
 {
-  size_t bufSize = (this->cid == ATT_CID) ? ATT_DEFAULT_LE_MTU : this->imtu;
-  return uv_buf_init(new char[bufSize], bufSize);
+  size_t bufSize = (this->cid == ATT_CID) ? this->mtu : this->imtu;
+  return pool->allocate(bufSize);
 }
 
-//
-// libuv allocation callback
-//
-uv_buf_t
-Connection::onAlloc(uv_handle_t* handle, size_t suggested)
+void
+Connection::releaseBuffer(uv_buf_t& buffer)
 {
-  return uv_buf_init(new char[suggested], suggested);
+  BufferPool::release(buffer.base);
+  buffer = uv_buf_init(NULL, 0);
 }
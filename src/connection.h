@@ -2,10 +2,18 @@
 #define CONNECTION_H
 
 #include <uv.h>
+#include <vector>
+
+#include "bufferPool.h"
+#include "transport.h"
 
 /**
  * Bluetooth LE connection class. Wraps all the low-level functionality of
  * btio.{c,h} in an object.
+ *
+ * The socket is polled directly rather than wrapped in a libuv stream, so
+ * that each wakeup can move a batch of PDUs with recvmmsg()/sendmmsg(),
+ * keeping the message boundaries.
  */
 class Connection {
 public:
@@ -15,13 +23,19 @@ public:
   typedef void (*ErrorCallback)(void* data, const char* error);
   typedef void (*ReadCallback)(void* data, uint8_t* buf, int len, const char* error);
   typedef void (*WriteCallback)(void* data, const char* error);
+  typedef void (*DrainCallback)(void* data);
+
+  // Default write queue limits, in bytes
+  static const size_t DEFAULT_HIGH_WATER_MARK = 16 * 1024;
+  static const size_t DEFAULT_LOW_WATER_MARK = 4 * 1024;
 
-  // Constructor/Destructor
-  Connection();
+  // Constructor/Destructor. Everything runs on the given loop, so the
+  // connection must only be used from the loop's thread
+  Connection(uv_loop_t* loop = uv_default_loop());
   virtual ~Connection();
 
-  // Connect to a bluetooth device
-  void connect(struct set_opts& opts, ConnectCallback connect, void* data);
+  // Connect to a bluetooth device, over the given transport (which we take ownership of)
+  void connect(Transport* transport, ConnectCallback connect, void* data);
 
   // Register callbacks
   void registerReadCallback(ReadCallback callback, void* cbData);
@@ -29,31 +43,122 @@ public:
   // Construct a buffer of the correct size to talk to the device
   uv_buf_t getBuffer();
 
-  // Write to the device
-  void write(uv_buf_t& buffer, WriteCallback callback = NULL, void* cbData = NULL);
+  // Give back a buffer from getBuffer() which isn't going to be written
+  static void releaseBuffer(uv_buf_t& buffer);
+
+  // Set the ATT MTU, once it's been negotiated with the device
+  void setMTU(uint16_t mtu) { this->mtu = mtu; }
+
+  // Get the incoming L2CAP MTU for the socket
+  uint16_t getIncomingMTU() const { return imtu; }
+
+  // Write to the device. Writes made in the same loop iteration are sent
+  // together, just before the loop polls for I/O. Returns false if the write
+  // queue is now over the high water mark. Only a writer which backs off
+  // because of that should then call requestDrain(), so the drain callback
+  // isn't made for writers who were never told to wait.
+  bool write(uv_buf_t& buffer, WriteCallback callback = NULL, void* cbData = NULL);
+
+  // Send the writes made this iteration now, rather than waiting. Writes made
+  // from another prepare callback need this, since a prepare handle started
+  // during the prepare phase doesn't run until the next iteration, after the
+  // loop has blocked polling.
+  void flush();
+
+  // Bytes written but not yet handed to the socket. This is a snapshot taken
+  // on the connection's loop, so it can be read from any thread
+  size_t getWriteQueueSize() const { return __atomic_load_n(&queueSize, __ATOMIC_RELAXED); }
+
+  // Call the drain callback once the queue is under the low water mark, even
+  // if no write has gone over the high water mark
+  void requestDrain();
+
+  // Set the write queue limits
+  void setWaterMarks(size_t high, size_t low) { highWaterMark = high; lowWaterMark = low; }
+
+  // Register the drain callback
+  void registerDrainCallback(DrainCallback callback, void* cbData) {
+    drainCb = callback;
+    drainData = cbData;
+  }
 
   // Close the connection
   void close(CloseCallback cb, void* data);
 
 private:
+  // Most PDUs we'll receive in one system call, and batches we'll read in
+  // one wakeup, so one busy connection doesn't hold up the rest
+  static const size_t READ_BATCH = 16;
+  static const size_t MAX_READ_BATCHES = 4;
+
+  // Writes waiting to be sent
+  struct pendingWrite {
+    uv_buf_t buffer;
+    WriteCallback callback;
+    void* data;
+  };
+  typedef std::vector<struct pendingWrite> WriteList;
+
   // Internal callbacks
   static void onConnect(uv_poll_t* handle, int status, int events);
+  static void onIO(uv_poll_t* handle, int status, int events);
   static void onClose(uv_handle_t* handle);
-  static void onRead(uv_stream_t* stream, ssize_t nread, uv_buf_t buf);
-  static void onWrite(uv_write_t* req, int status);
-  static uv_buf_t onAlloc(uv_handle_t* handle, size_t suggested);
+  static void onPollHandleClose(uv_handle_t* handle);
+  static void onFlushWrites(uv_prepare_t* handle, int status);
+  static void onFlushHandleClose(uv_handle_t* handle);
 
-  uv_stream_t* getStream() { return (uv_stream_t*) tcp; }
+  // Send all the writes made this iteration
+  void flushWrites();
+  // Send as much of the write queue as the socket will take
+  void sendQueued();
+  // Read and dispatch PDUs until the socket's empty
+  void readBatch();
+  // Stop reading, and report the error
+  void readError(const char* error);
+  // Poll for whatever we're waiting on
+  void updatePoll();
+  // Call back for writes which were sent, or failed
+  static void completeWrites(WriteList& writes, const char* error);
+  // Call the drain callback if we've been over the high water mark, and the
+  // queue has emptied enough
+  void checkDrain();
+  size_t currentQueueSize() const;
 
   // Internal data
+  uv_loop_t* loop;         // Loop we run on
+  Transport* transport;    // What the socket is
   int sock;                // Socket
-  uv_tcp_t* tcp;           // libuv TCP structure
+  bool connected;
+  bool reading;            // Whether we're still reading - we stop on an error
   uv_poll_t* poll_handle;  // libuv poll handle
   uint16_t imtu;           // Incoming MTU size
+  uint16_t mtu;            // ATT MTU size
   uint16_t cid;            // CID value for this connection
+  BufferPool* pool;        // Where our transmit buffers come from
 
   ReadCallback readCb;
   void* readData;
+
+  // Writes waiting for the end of the loop iteration
+  WriteList pendingWrites;
+  size_t pendingBytes;     // Size of pendingWrites
+  uv_prepare_t* flushHandle;
+
+  // Writes waiting for room in the socket
+  WriteList writeQueue;
+  size_t queuedBytes;      // Size of writeQueue
+
+  // Receive buffer on an I/O thread. On the main loop we read into a
+  // BufferSlab instead, so JS gets the data without a copy.
+  std::vector<char> readBuffer;
+
+  // Backpressure
+  size_t highWaterMark;
+  size_t lowWaterMark;
+  bool needDrain;          // Whether we've told a writer to back off
+  size_t queueSize;        // Last value of currentQueueSize(), only accessed atomically
+  DrainCallback drainCb;
+  void* drainData;
 };
 
 #endif
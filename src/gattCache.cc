@@ -0,0 +1,526 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gattCache.h"
+#include "btio.h"
+#include "debug.h"
+#include "util.h"
+
+using namespace v8;
+
+static const char MAGIC[4] = { 'B', 'T', 'G', 'C' };
+static const size_t HEADER_SIZE = sizeof(MAGIC) + 2 * sizeof(uint32_t);
+
+GattCache*
+GattCache::instance = NULL;
+
+pthread_mutex_t
+GattCache::instanceLock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Helpers for building and reading the encoded layouts
+//
+static void
+putU16(std::string& out, uint16_t value)
+{
+  uint8_t buf[sizeof(uint16_t)];
+  att_put_u16(value, buf);
+  out.append((const char*) buf, sizeof(buf));
+}
+
+static void
+putU32(std::string& out, uint32_t value)
+{
+  uint8_t buf[sizeof(uint32_t)];
+  att_put_u32(value, buf);
+  out.append((const char*) buf, sizeof(buf));
+}
+
+// UUIDs are stored as a length byte followed by the UUID, little-endian
+static void
+putUUID(std::string& out, const bt_uuid_t& uuid)
+{
+  uint8_t buf[sizeof(uint128_t)];
+  size_t len = uuid.type == bt_uuid_t::BT_UUID16 ? sizeof(uint16_t) : sizeof(uint128_t);
+  att_put_uuid(uuid, buf);
+  out.push_back((char) len);
+  out.append((const char*) buf, len);
+}
+
+class Reader {
+public:
+  Reader(const uint8_t* buf, size_t len) : ptr(buf), end(buf + len), ok(true) {}
+
+  bool has(size_t n) {
+    if ((size_t)(end - ptr) < n) ok = false;
+    return ok;
+  }
+
+  uint8_t u8() {
+    if (!has(1)) return 0;
+    return *ptr++;
+  }
+
+  uint16_t u16() {
+    if (!has(sizeof(uint16_t))) return 0;
+    uint16_t value = att_get_u16(ptr);
+    ptr += sizeof(uint16_t);
+    return value;
+  }
+
+  uint32_t u32() {
+    if (!has(sizeof(uint32_t))) return 0;
+    uint32_t value = att_get_u32(ptr);
+    ptr += sizeof(uint32_t);
+    return value;
+  }
+
+  bt_uuid_t uuid() {
+    bt_uuid_t ret;
+    memset(&ret, 0, sizeof(ret));
+    uint8_t len = u8();
+    if (len == sizeof(uint16_t) && has(len)) {
+      ret = att_get_uuid16(ptr);
+    } else if (len == sizeof(uint128_t) && has(len)) {
+      ret = att_get_uuid128(ptr);
+    } else {
+      ok = false;
+      return ret;
+    }
+    ptr += len;
+    return ret;
+  }
+
+  const uint8_t* bytes(size_t n) {
+    if (!has(n)) return NULL;
+    const uint8_t* ret = ptr;
+    ptr += n;
+    return ret;
+  }
+
+  const uint8_t* ptr;
+  const uint8_t* end;
+  bool ok;
+};
+
+// Constructor - maps in the cache file, if there is one
+GattCache::GattCache(const char* path)
+  : path(path), map(NULL), mapLength(0), flushTimer(NULL), dirty(false), refs(0), retired(false)
+{
+  pthread_mutex_init(&lock, NULL);
+  flushAsync = new uv_async_t;
+  flushAsync->data = this;
+  uv_async_init(uv_default_loop(), flushAsync, onFlushAsync);
+  uv_unref((uv_handle_t*) flushAsync);
+  load();
+}
+
+// Destructor
+GattCache::~GattCache()
+{
+  flush();
+  if (flushTimer != NULL) {
+    uv_close((uv_handle_t*) flushTimer, onFlushTimerClose);
+  }
+  uv_close((uv_handle_t*) flushAsync, onFlushAsyncClose);
+  unmap();
+  pthread_mutex_destroy(&lock);
+}
+
+void
+GattCache::onFlushTimerClose(uv_handle_t* handle)
+{
+  delete (uv_timer_t*) handle;
+}
+
+void
+GattCache::onFlushAsyncClose(uv_handle_t* handle)
+{
+  delete (uv_async_t*) handle;
+}
+
+GattCache*
+GattCache::acquire()
+{
+  pthread_mutex_lock(&instanceLock);
+  GattCache* cache = instance;
+  if (cache != NULL) cache->refs++;
+  pthread_mutex_unlock(&instanceLock);
+  return cache;
+}
+
+//
+// Give back a reference. The last one to a replaced cache has it deleted,
+// which has to happen on the JS thread since it closes handles on the
+// default loop - so that's left to onFlushAsync.
+//
+void
+GattCache::release()
+{
+  pthread_mutex_lock(&instanceLock);
+  bool last = --refs == 0 && retired;
+  pthread_mutex_unlock(&instanceLock);
+  if (last) uv_async_send(flushAsync);
+}
+
+//
+// Stop handing out this cache, and delete it once nobody's using it. Called
+// on the JS thread, with the cache already swapped out of instance.
+//
+void
+GattCache::retire()
+{
+  pthread_mutex_lock(&instanceLock);
+  retired = true;
+  bool unused = refs == 0;
+  pthread_mutex_unlock(&instanceLock);
+  if (unused) {
+    delete this;
+  } else {
+    // Write out what we have now, so a new cache on the same file sees it
+    flush();
+  }
+}
+
+std::string
+GattCache::addressKey(const bdaddr_t& address)
+{
+  std::string key("A");
+  key.append((const char*) &address, sizeof(address));
+  return key;
+}
+
+//
+// Map the cache file and index its entries. A missing or unreadable
+// file just means we start with an empty cache.
+//
+void
+GattCache::load()
+{
+  entries.clear();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (debug && errno != ENOENT) printf("GattCache: can't open %s: %s\n", path.c_str(), strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t) st.st_size < HEADER_SIZE) {
+    ::close(fd);
+    return;
+  }
+
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    if (debug) printf("GattCache: can't map %s: %s\n", path.c_str(), strerror(errno));
+    return;
+  }
+  map = (uint8_t*) addr;
+  mapLength = st.st_size;
+
+  Reader reader(map, mapLength);
+  const uint8_t* magic = reader.bytes(sizeof(MAGIC));
+  uint32_t version = reader.u32();
+  uint32_t count = reader.u32();
+  if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION) {
+    if (debug) printf("GattCache: ignoring %s, wrong format\n", path.c_str());
+    unmap();
+    return;
+  }
+
+  for (uint32_t i = 0; i < count && reader.ok; i++) {
+    uint8_t keyLength = reader.u8();
+    const uint8_t* key = reader.bytes(keyLength);
+    uint32_t length = reader.u32();
+    const uint8_t* data = reader.bytes(length);
+    if (reader.ok) {
+      Entry& entry = entries[std::string((const char*) key, keyLength)];
+      entry.data = data;
+      entry.length = length;
+    }
+  }
+}
+
+void
+GattCache::unmap()
+{
+  if (map != NULL) {
+    munmap(map, mapLength);
+    map = NULL;
+    mapLength = 0;
+  }
+}
+
+bool
+GattCache::lookup(const std::string& key, GattDiscovery& discovery)
+{
+  pthread_mutex_lock(&lock);
+  bool found = false;
+  EntryMap::iterator it = entries.find(key);
+  if (it != entries.end()) {
+    found = decode(it->second.data, it->second.length, discovery);
+    if (!found) {
+      // Corrupt entry - drop it, so it gets rediscovered and replaced
+      entries.erase(it);
+      scheduleFlush();
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return found;
+}
+
+void
+GattCache::store(const std::string& key, const GattDiscovery& discovery)
+{
+  std::string encoded;
+  encode(discovery, encoded);
+
+  pthread_mutex_lock(&lock);
+  Entry& entry = entries[key];
+  entry.owned.swap(encoded);
+  entry.data = (const uint8_t*) entry.owned.data();
+  entry.length = entry.owned.size();
+  scheduleFlush();
+  pthread_mutex_unlock(&lock);
+}
+
+void
+GattCache::invalidate(const std::string& key)
+{
+  pthread_mutex_lock(&lock);
+  if (entries.erase(key) > 0) {
+    scheduleFlush();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Batch up changes, since a lot of devices tend to (re)connect at once.
+// Called with the lock held, from any thread.
+void
+GattCache::scheduleFlush()
+{
+  dirty = true;
+  uv_async_send(flushAsync);
+}
+
+// (Re)start the flush timer, on the JS thread. For a replaced cache, this is
+// also where it's deleted once the last reference is given back.
+void
+GattCache::onFlushAsync(uv_async_t* handle, int status)
+{
+  GattCache* cache = static_cast<GattCache*>(handle->data);
+  pthread_mutex_lock(&instanceLock);
+  bool unused = cache->retired && cache->refs == 0;
+  pthread_mutex_unlock(&instanceLock);
+  if (unused) {
+    delete cache;
+    return;
+  }
+
+  if (cache->flushTimer == NULL) {
+    cache->flushTimer = new uv_timer_t;
+    cache->flushTimer->data = cache;
+    uv_timer_init(uv_default_loop(), cache->flushTimer);
+  }
+  uv_timer_start(cache->flushTimer, onFlushTimer, FLUSH_DELAY, 0);
+}
+
+void
+GattCache::onFlushTimer(uv_timer_t* handle, int status)
+{
+  GattCache* cache = static_cast<GattCache*>(handle->data);
+  cache->flush();
+}
+
+//
+// Write all the entries to a temporary file, and rename it over the cache
+// file. The new file is then mapped in place of the old one.
+//
+void
+GattCache::flush()
+{
+  pthread_mutex_lock(&lock);
+  if (dirty) {
+    dirty = false;
+    writeFile();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void
+GattCache::writeFile()
+{
+  std::string tmpPath = path + ".tmp";
+  FILE* file = fopen(tmpPath.c_str(), "wb");
+  if (file == NULL) {
+    if (debug) printf("GattCache: can't write %s: %s\n", tmpPath.c_str(), strerror(errno));
+    return;
+  }
+
+  std::string header(MAGIC, sizeof(MAGIC));
+  putU32(header, VERSION);
+  putU32(header, entries.size());
+  bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+
+  for (EntryMap::iterator it = entries.begin(); ok && it != entries.end(); ++it) {
+    std::string entryHeader;
+    entryHeader.push_back((char) it->first.size());
+    entryHeader.append(it->first);
+    putU32(entryHeader, it->second.length);
+    ok = fwrite(entryHeader.data(), 1, entryHeader.size(), file) == entryHeader.size() &&
+      fwrite(it->second.data, 1, it->second.length, file) == it->second.length;
+  }
+
+  ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+  fclose(file);
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) < 0) {
+    if (debug) printf("GattCache: can't write %s: %s\n", path.c_str(), strerror(errno));
+    unlink(tmpPath.c_str());
+    return;
+  }
+
+  // Switch over to the new file
+  unmap();
+  load();
+}
+
+//
+// Layout encoding:
+//  u16 service count, u16 characteristic count, u16 descriptor count
+//  services:        u16 handle, u16 end handle, u16 characteristic count, uuid
+//  characteristics: u16 handle, u16 value handle, u16 end handle, u8 properties,
+//                   u16 descriptor count, uuid
+//  descriptors:     u16 handle, uuid
+//
+void
+GattCache::encode(const GattDiscovery& discovery, std::string& out)
+{
+  putU16(out, discovery.services.size());
+  putU16(out, discovery.characteristics.size());
+  putU16(out, discovery.descriptors.size());
+
+  for (size_t i = 0; i < discovery.services.size(); i++) {
+    const GattDiscovery::Service& service = discovery.services[i];
+    putU16(out, service.handle);
+    putU16(out, service.endHandle);
+    putU16(out, service.characteristicCount);
+    putUUID(out, service.uuid);
+  }
+
+  for (size_t i = 0; i < discovery.characteristics.size(); i++) {
+    const GattDiscovery::Characteristic& characteristic = discovery.characteristics[i];
+    putU16(out, characteristic.handle);
+    putU16(out, characteristic.valueHandle);
+    putU16(out, characteristic.endHandle);
+    out.push_back((char) characteristic.properties);
+    putU16(out, characteristic.descriptorCount);
+    putUUID(out, characteristic.uuid);
+  }
+
+  for (size_t i = 0; i < discovery.descriptors.size(); i++) {
+    const GattDiscovery::Descriptor& descriptor = discovery.descriptors[i];
+    putU16(out, descriptor.handle);
+    putUUID(out, descriptor.type);
+  }
+}
+
+bool
+GattCache::decode(const uint8_t* buf, size_t len, GattDiscovery& discovery)
+{
+  Reader reader(buf, len);
+  uint16_t serviceCount = reader.u16();
+  uint16_t characteristicCount = reader.u16();
+  uint16_t descriptorCount = reader.u16();
+  if (!reader.ok) return false;
+
+  // Decode into our own vectors, so a bad entry leaves the discovery as it was
+  std::vector<GattDiscovery::Service> services(serviceCount);
+  std::vector<GattDiscovery::Characteristic> characteristics(characteristicCount);
+  std::vector<GattDiscovery::Descriptor> descriptors(descriptorCount);
+
+  size_t next = 0;
+  for (size_t i = 0; i < serviceCount; i++) {
+    GattDiscovery::Service& service = services[i];
+    service.handle = reader.u16();
+    service.endHandle = reader.u16();
+    service.characteristicCount = reader.u16();
+    service.uuid = reader.uuid();
+    service.firstCharacteristic = next;
+    next += service.characteristicCount;
+  }
+  if (next != characteristicCount) return false;
+
+  next = 0;
+  for (size_t i = 0; i < characteristicCount; i++) {
+    GattDiscovery::Characteristic& characteristic = characteristics[i];
+    characteristic.handle = reader.u16();
+    characteristic.valueHandle = reader.u16();
+    characteristic.endHandle = reader.u16();
+    characteristic.properties = reader.u8();
+    characteristic.descriptorCount = reader.u16();
+    characteristic.uuid = reader.uuid();
+    characteristic.firstDescriptor = next;
+    next += characteristic.descriptorCount;
+  }
+  if (next != descriptorCount) return false;
+
+  for (size_t i = 0; i < descriptorCount; i++) {
+    GattDiscovery::Descriptor& descriptor = descriptors[i];
+    descriptor.handle = reader.u16();
+    descriptor.type = reader.uuid();
+  }
+
+  if (!reader.ok || reader.ptr != reader.end) return false;
+
+  discovery.services.swap(services);
+  discovery.characteristics.swap(characteristics);
+  discovery.descriptors.swap(descriptors);
+  return true;
+}
+
+//
+// setGattCache(path) turns on caching of discovered GATT databases in the given
+// file; setGattCache(null) turns it off again
+//
+Handle<Value>
+SetGattCache(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !(args[0]->IsString() || args[0]->IsNull())) {
+    ThrowException(Exception::TypeError(String::New("setGattCache takes a file path, or null")));
+    return scope.Close(Undefined());
+  }
+
+  // I/O threads may still be using the old cache, so it's only deleted once
+  // they've given it back
+  pthread_mutex_lock(&GattCache::instanceLock);
+  GattCache* old = GattCache::instance;
+  GattCache::instance = NULL;
+  pthread_mutex_unlock(&GattCache::instanceLock);
+  if (old != NULL) old->retire();
+
+  if (args[0]->IsString()) {
+    GattCache* cache = new GattCache(getStringValue(args[0]->ToString()));
+    pthread_mutex_lock(&GattCache::instanceLock);
+    GattCache::instance = cache;
+    pthread_mutex_unlock(&GattCache::instanceLock);
+  }
+
+  return scope.Close(Undefined());
+}
+
+void
+initGattCache(Handle<Object> exports)
+{
+  exports->Set(String::NewSymbol("setGattCache"),
+      FunctionTemplate::New(SetGattCache)->GetFunction());
+}
@@ -0,0 +1,101 @@
+#ifndef GATT_CACHE_H
+#define GATT_CACHE_H
+
+#include <map>
+#include <string>
+#include <pthread.h>
+#include <node.h>
+#include <bluetooth/bluetooth.h>
+
+#include "gattDiscovery.h"
+
+/*
+ * On-disk cache of discovered GATT databases, so we don't have to run
+ * discovery every time a device reconnects. The cache file is memory-mapped
+ * when it's opened, and entries are only decoded when they're looked up.
+ * Changes are written back a second after the last one, to a temporary file
+ * which is then renamed over the old one, so a crash never leaves a partly
+ * written cache.
+ *
+ * Lookups and changes can come from I/O threads as well as the JS thread, so
+ * they're done under a lock. The write back always happens on the JS thread.
+ * Users hold a reference to the cache while they use it, so setGattCache()
+ * can replace it while an I/O thread is part way through a discovery; the
+ * old one is deleted, on the JS thread, once the last reference goes.
+ *
+ * File format (all integers little-endian):
+ *  magic "BTGC", u32 version, u32 entry count, then for each entry
+ *  u8 key length, key, u32 layout length, layout
+ */
+class GattCache {
+public:
+  GattCache(const char* path);
+  virtual ~GattCache();
+
+  // Get a reference to the cache in use, or NULL if caching is off. Every
+  // non-NULL result must be given back with release().
+  static GattCache* acquire();
+  void release();
+
+  // Key for the layout of a specific device
+  static std::string addressKey(const bdaddr_t& address);
+
+  // Fill in the discovery results from the cache. Returns false if there's
+  // no (valid) entry for the key, in which case the discovery is unchanged
+  bool lookup(const std::string& key, GattDiscovery& discovery);
+
+  // Add or replace the entry for the key
+  void store(const std::string& key, const GattDiscovery& discovery);
+
+  // Remove the entry for the key
+  void invalidate(const std::string& key);
+
+  // Write out any changes now
+  void flush();
+
+private:
+  // An entry's layout, either in the mapped file or held in memory
+  struct Entry {
+    Entry() : data(NULL), length(0) {}
+    const uint8_t* data;
+    size_t length;
+    std::string owned;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  static const uint32_t VERSION = 1;
+  static const uint64_t FLUSH_DELAY = 1000; // ms
+
+  static GattCache* instance;
+  static pthread_mutex_t instanceLock;  // Guards instance, and every cache's refs and retired
+  friend v8::Handle<v8::Value> SetGattCache(const v8::Arguments& args);
+
+  void retire();
+  void load();
+  void unmap();
+  void scheduleFlush();
+  static void onFlushTimer(uv_timer_t* handle, int status);
+  static void onFlushTimerClose(uv_handle_t* handle);
+  static void onFlushAsync(uv_async_t* handle, int status);
+  static void onFlushAsyncClose(uv_handle_t* handle);
+  void writeFile();
+
+  static void encode(const GattDiscovery& discovery, std::string& out);
+  static bool decode(const uint8_t* buf, size_t len, GattDiscovery& discovery);
+
+  std::string path;
+  uint8_t* map;      // Mapped cache file
+  size_t mapLength;
+  EntryMap entries;
+  uv_timer_t* flushTimer;
+  uv_async_t* flushAsync;  // Starts the flush timer from any thread
+  pthread_mutex_t lock;
+  bool dirty;
+  int refs;       // References from acquire()
+  bool retired;   // Replaced by setGattCache(), so delete once refs reaches zero
+};
+
+void initGattCache(v8::Handle<v8::Object> exports);
+
+#endif
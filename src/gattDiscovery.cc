@@ -0,0 +1,462 @@
+#include <string.h>
+
+#include "gattDiscovery.h"
+#include "gattCache.h"
+#include "btio.h"
+
+// Constructor
+GattDiscovery::GattDiscovery(Att* att, DiscoveryCallback callback, void* data, const std::string& cacheKey)
+  : fromCache(false), fromTemplate(false), att(att), callback(callback), data(data), nextCharacteristic(0),
+    cacheKey(cacheKey), fingerprintStep(DATABASE_HASH), spotChecksDone(0), spotCheckFailed(false)
+{
+}
+
+// Number of characteristic declarations read back to check a template
+static const size_t SPOT_CHECK_CHARACTERISTICS = 3;
+
+// 64 bit FNV-1a hash
+static uint64_t
+fnv1a(const std::string& value, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+  for (size_t i = 0; i < value.size(); i++) {
+    hash ^= (uint8_t) value[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// The value of an attribute declaration, as the device should return it
+static void
+putUUID(std::string& out, const bt_uuid_t& uuid)
+{
+  uint8_t buf[sizeof(uint128_t)];
+  att_put_uuid(uuid, buf);
+  out.append((const char*) buf, uuid.type == bt_uuid_t::BT_UUID16 ? sizeof(uint16_t) : sizeof(uint128_t));
+}
+
+//
+// Start with the primary services. The requests after that are all sent from
+// the response handlers.
+//
+void
+GattDiscovery::start()
+{
+  GattCache* cache = GattCache::acquire();
+  bool caching = cache != NULL;
+  bool found = caching && !cacheKey.empty() && cache->lookup(cacheKey, *this);
+  if (caching) cache->release();
+
+  if (found) {
+    // Still call back asynchronously, as we would after discovery
+    fromCache = true;
+    uv_timer_t* timer = new uv_timer_t;
+    timer->data = this;
+    uv_timer_init(att->getLoop(), timer);
+    uv_timer_start(timer, onCacheHit, 0, 0);
+    return;
+  }
+
+  if (caching) {
+    readFingerprint(DATABASE_HASH, DATABASE_HASH_UUID);
+  } else {
+    discoverServices();
+  }
+}
+
+//
+// Fingerprinting. Each of these is a single Read By Type over the whole
+// handle range, so we don't need to know where the characteristics are.
+//
+void
+GattDiscovery::readFingerprint(FingerprintStep step, uint16_t uuid)
+{
+  bt_uuid_t type;
+  bt_uuid16_create(&type, uuid);
+  fingerprintStep = step;
+  att->readByType(0x0001, 0xFFFF, type, onFingerprint, this);
+}
+
+void
+GattDiscovery::onFingerprint(uint8_t status, void* data, void* list, const char* error)
+{
+  GattDiscovery* discovery = static_cast<GattDiscovery*>(data);
+  Att::AttributeDataList* dataList = (Att::AttributeDataList*) list;
+  discovery->handleFingerprint(status, dataList, error);
+  delete dataList;
+}
+
+void
+GattDiscovery::handleFingerprint(uint8_t status, Att::AttributeDataList* list, const char* error)
+{
+  // Any error just means the device doesn't have this one
+  std::string value;
+  if (status == 0 && error == NULL && list != NULL && !list->empty()) {
+    value.assign((const char*) list->begin()->data, list->begin()->length);
+  }
+
+  switch (fingerprintStep) {
+    case DATABASE_HASH:
+      if (!value.empty()) {
+        useTemplate("H" + value);
+      } else {
+        readFingerprint(MODEL_NUMBER, MODEL_NUMBER_UUID);
+      }
+      break;
+
+    case MODEL_NUMBER:
+      modelNumber = value;
+      readFingerprint(FIRMWARE_REVISION, FIRMWARE_REVISION_UUID);
+      break;
+
+    case FIRMWARE_REVISION:
+      if (modelNumber.empty() && value.empty()) {
+        // Nothing to go on
+        discoverServices();
+      } else {
+        uint64_t hash = fnv1a(value, fnv1a(std::string(1, '\0'), fnv1a(modelNumber)));
+        useTemplate("M" + std::string((const char*) &hash, sizeof(hash)));
+      }
+      break;
+  }
+}
+
+void
+GattDiscovery::useTemplate(const std::string& key)
+{
+  templateKey = key;
+  GattCache* cache = GattCache::acquire();
+  bool found = cache != NULL && cache->lookup(templateKey, *this);
+  if (cache != NULL) cache->release();
+
+  if (found) {
+    spotCheck();
+  } else {
+    // A failed lookup leaves nothing behind, so this starts from empty
+    discoverServices();
+  }
+}
+
+//
+// Read back the first and last service declarations and a few characteristic
+// declarations from the template, and check the device has the same. All the
+// reads are queued at once, so they go out back to back.
+//
+void
+GattDiscovery::spotCheck()
+{
+  if (services.empty()) {
+    // Can't tell an empty template from a mismatch, so don't trust it
+    services.clear();
+    discoverServices();
+    return;
+  }
+
+  std::string expected;
+  putUUID(expected, services.front().uuid);
+  addSpotCheck(services.front().handle, expected);
+  if (services.size() > 1) {
+    expected.clear();
+    putUUID(expected, services.back().uuid);
+    addSpotCheck(services.back().handle, expected);
+  }
+
+  size_t count = characteristics.size() < SPOT_CHECK_CHARACTERISTICS ?
+    characteristics.size() : SPOT_CHECK_CHARACTERISTICS;
+  for (size_t i = 0; i < count; i++) {
+    // Spread the checks out through the database
+    size_t index = count == 1 ? 0 : i * (characteristics.size() - 1) / (count - 1);
+    const Characteristic& characteristic = characteristics[index];
+    uint8_t buf[3];
+    buf[0] = characteristic.properties;
+    att_put_u16(characteristic.valueHandle, &buf[1]);
+    expected.assign((const char*) buf, sizeof(buf));
+    putUUID(expected, characteristic.uuid);
+    addSpotCheck(characteristic.handle, expected);
+  }
+}
+
+void
+GattDiscovery::addSpotCheck(handle_t handle, const std::string& expected)
+{
+  spotChecks.push_back(expected);
+  att->readAttribute(handle, onSpotCheck, this);
+}
+
+void
+GattDiscovery::onSpotCheck(uint8_t status, void* data, uint8_t* buf, int len, const char* error)
+{
+  GattDiscovery* discovery = static_cast<GattDiscovery*>(data);
+  discovery->handleSpotCheck(status, buf, len, error);
+}
+
+void
+GattDiscovery::handleSpotCheck(uint8_t status, uint8_t* buf, int len, const char* error)
+{
+  // Reads come back in the order they were sent
+  const std::string& expected = spotChecks[spotChecksDone++];
+  if (status != 0 || error != NULL || (size_t) len != expected.size() ||
+      memcmp(buf, expected.data(), len) != 0) {
+    spotCheckFailed = true;
+  }
+
+  if (spotChecksDone < spotChecks.size()) return;
+
+  if (spotCheckFailed) {
+    // Not the same layout after all - do it the long way, and replace the template
+    services.clear();
+    characteristics.clear();
+    descriptors.clear();
+    discoverServices();
+  } else {
+    fromTemplate = true;
+    finish(0, NULL);
+  }
+}
+
+void
+GattDiscovery::discoverServices()
+{
+  bt_uuid_t type;
+  bt_uuid16_create(&type, PRIMARY_SERVICE_UUID);
+  att->readByGroupType(0x0001, 0xFFFF, type, onServices, this);
+}
+
+void
+GattDiscovery::onServices(uint8_t status, void* data, void* list, const char* error)
+{
+  GattDiscovery* discovery = static_cast<GattDiscovery*>(data);
+  Att::GroupAttributeDataList* dataList = (Att::GroupAttributeDataList*) list;
+  discovery->handleServices(status, dataList, error);
+  delete dataList;
+}
+
+void
+GattDiscovery::handleServices(uint8_t status, Att::GroupAttributeDataList* list, const char* error)
+{
+  if (status != 0 || error != NULL) {
+    finish(status, error);
+    return;
+  }
+
+  if (list != NULL) {
+    services.reserve(list->size());
+    for (Att::GroupAttributeDataList::iterator it = list->begin(); it != list->end(); ++it) {
+      Service service;
+      service.handle = it->handle;
+      service.endHandle = it->groupEndHandle;
+      service.firstCharacteristic = 0;
+      service.characteristicCount = 0;
+      if (getUUID(it->data, it->length, service.uuid)) {
+        services.push_back(service);
+      }
+    }
+  }
+
+  if (services.empty()) {
+    finish(0, NULL);
+  } else {
+    discoverCharacteristics(services.front().handle);
+  }
+}
+
+// Read the characteristic declarations from startHandle to the end of the last service
+void
+GattDiscovery::discoverCharacteristics(handle_t startHandle)
+{
+  bt_uuid_t type;
+  bt_uuid16_create(&type, CHARACTERISTIC_UUID);
+  att->readByType(startHandle, services.back().endHandle, type, onCharacteristics, this);
+}
+
+void
+GattDiscovery::onCharacteristics(uint8_t status, void* data, void* list, const char* error)
+{
+  GattDiscovery* discovery = static_cast<GattDiscovery*>(data);
+  Att::AttributeDataList* dataList = (Att::AttributeDataList*) list;
+  discovery->handleCharacteristics(status, dataList, error);
+  delete dataList;
+}
+
+void
+GattDiscovery::handleCharacteristics(uint8_t status, Att::AttributeDataList* list, const char* error)
+{
+  if (status == ATT_ECODE_ATTR_NOT_FOUND) {
+    // This means we've got them all
+    assignCharacteristics();
+    discoverDescriptors();
+    return;
+  } else if (status != 0 || error != NULL) {
+    finish(status, error);
+    return;
+  }
+
+  // Declaration value is properties (1 byte), value handle (2 bytes) and UUID
+  for (Att::AttributeDataList::iterator it = list->begin(); it != list->end(); ++it) {
+    if (it->length < 5) continue;
+
+    Characteristic characteristic;
+    characteristic.handle = it->handle;
+    characteristic.properties = it->data[0];
+    characteristic.valueHandle = att_get_u16(&it->data[1]);
+    characteristic.endHandle = characteristic.valueHandle;
+    characteristic.firstDescriptor = 0;
+    characteristic.descriptorCount = 0;
+    if (getUUID(&it->data[3], it->length - 3, characteristic.uuid)) {
+      characteristics.push_back(characteristic);
+    }
+  }
+
+  if (!list->empty() && list->back().handle < services.back().endHandle) {
+    discoverCharacteristics(list->back().handle + 1);
+  } else {
+    assignCharacteristics();
+    discoverDescriptors();
+  }
+}
+
+//
+// Characteristics come back in handle order, as do the services, so each
+// service's characteristics are a contiguous range. A characteristic ends just
+// before the next one starts, or at the end of its service.
+//
+void
+GattDiscovery::assignCharacteristics()
+{
+  std::vector<Characteristic>::iterator it = characteristics.begin();
+  for (std::vector<Service>::iterator service = services.begin(); service != services.end(); ++service) {
+    // Skip anything declared outside a service
+    while (it != characteristics.end() && it->handle < service->handle) {
+      it = characteristics.erase(it);
+    }
+
+    service->firstCharacteristic = it - characteristics.begin();
+    while (it != characteristics.end() && it->handle <= service->endHandle) {
+      std::vector<Characteristic>::iterator next = it + 1;
+      if (next != characteristics.end() && next->handle <= service->endHandle) {
+        it->endHandle = next->handle - 1;
+      } else {
+        it->endHandle = service->endHandle;
+      }
+      ++it;
+    }
+    service->characteristicCount = (it - characteristics.begin()) - service->firstCharacteristic;
+  }
+  characteristics.erase(it, characteristics.end());
+}
+
+//
+// Find the descriptors for the next characteristic which has room for any
+//
+void
+GattDiscovery::discoverDescriptors()
+{
+  while (nextCharacteristic < characteristics.size()) {
+    Characteristic& characteristic = characteristics[nextCharacteristic];
+    characteristic.firstDescriptor = descriptors.size();
+    if (characteristic.valueHandle < characteristic.endHandle) {
+      att->findInformation(characteristic.valueHandle + 1, characteristic.endHandle, onDescriptors, this);
+      return;
+    }
+    ++nextCharacteristic;
+  }
+
+  finish(0, NULL);
+}
+
+void
+GattDiscovery::onDescriptors(uint8_t status, void* data, void* list, const char* error)
+{
+  GattDiscovery* discovery = static_cast<GattDiscovery*>(data);
+  Att::AttributeInfoList* infoList = (Att::AttributeInfoList*) list;
+  discovery->handleDescriptors(status, infoList, error);
+  delete infoList;
+}
+
+void
+GattDiscovery::handleDescriptors(uint8_t status, Att::AttributeInfoList* list, const char* error)
+{
+  if (status != 0 || error != NULL) {
+    finish(status, error);
+    return;
+  }
+
+  Characteristic& characteristic = characteristics[nextCharacteristic];
+  if (list != NULL) {
+    for (Att::AttributeInfoList::iterator it = list->begin(); it != list->end(); ++it) {
+      Descriptor descriptor;
+      descriptor.handle = it->handle;
+      descriptor.type = it->type;
+      descriptors.push_back(descriptor);
+    }
+  }
+  characteristic.descriptorCount = descriptors.size() - characteristic.firstDescriptor;
+
+  ++nextCharacteristic;
+  discoverDescriptors();
+}
+
+void
+GattDiscovery::onCacheHit(uv_timer_t* handle, int status)
+{
+  GattDiscovery* discovery = static_cast<GattDiscovery*>(handle->data);
+  uv_close((uv_handle_t*) handle, onCacheTimerClose);
+  discovery->finish(0, NULL);
+}
+
+void
+GattDiscovery::onCacheTimerClose(uv_handle_t* handle)
+{
+  delete (uv_timer_t*) handle;
+}
+
+void
+GattDiscovery::finish(uint8_t status, const char* error)
+{
+  if (status == 0 && error == NULL && !fromCache) {
+    GattCache* cache = GattCache::acquire();
+    if (cache != NULL) {
+      if (!cacheKey.empty()) cache->store(cacheKey, *this);
+      if (!templateKey.empty() && !fromTemplate) cache->store(templateKey, *this);
+      cache->release();
+    }
+  }
+  callback(status, data, this, error);
+}
+
+const GattDiscovery::Characteristic*
+GattDiscovery::findCharacteristic(uint16_t uuid) const
+{
+  for (size_t i = 0; i < characteristics.size(); i++) {
+    const bt_uuid_t& type = characteristics[i].uuid;
+    if (type.type == bt_uuid_t::BT_UUID16 && type.value.u16 == uuid) {
+      return &characteristics[i];
+    }
+  }
+  return NULL;
+}
+
+const GattDiscovery::Descriptor*
+GattDiscovery::findDescriptor(const Characteristic& characteristic, uint16_t uuid) const
+{
+  for (size_t i = 0; i < characteristic.descriptorCount; i++) {
+    const Descriptor& descriptor = descriptors[characteristic.firstDescriptor + i];
+    if (descriptor.type.type == bt_uuid_t::BT_UUID16 && descriptor.type.value.u16 == uuid) {
+      return &descriptor;
+    }
+  }
+  return NULL;
+}
+
+// Get a 16 or 128 bit UUID from a declaration value
+bool
+GattDiscovery::getUUID(const uint8_t* buf, size_t len, bt_uuid_t& uuid)
+{
+  if (len == sizeof(uint16_t)) {
+    uuid = att_get_uuid16(buf);
+  } else if (len == sizeof(uint128_t)) {
+    uuid = att_get_uuid128(buf);
+  } else {
+    return false;
+  }
+  return true;
+}
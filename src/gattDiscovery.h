@@ -0,0 +1,134 @@
+#ifndef GATT_DISCOVERY_H
+#define GATT_DISCOVERY_H
+
+#include <string>
+#include <vector>
+
+#include "att.h"
+
+/*
+ * Discovers the whole GATT database of a device - the primary services, their
+ * characteristics and the characteristic descriptors. Each request is sent
+ * from the response handler of the one before, so the only delay between
+ * them is the link round trip.
+ *
+ * The result is kept as three flat arrays, with each service and
+ * characteristic referring to a range of the next array down.
+ *
+ * With the GATT cache on, a device we haven't seen before is first
+ * fingerprinted, from its Database Hash or failing that its Device Information
+ * model number and firmware revision. If another device with the same
+ * fingerprint has been discovered, its layout is used as a template, after a
+ * few of the declarations in it have been read back from the device to check
+ * it matches.
+ */
+class GattDiscovery {
+public:
+  // GATT attribute types used in discovery
+  static const uint16_t PRIMARY_SERVICE_UUID = 0x2800;
+  static const uint16_t CHARACTERISTIC_UUID = 0x2803;
+  static const uint16_t SERVICE_CHANGED_UUID = 0x2A05;
+  static const uint16_t CLIENT_CHAR_CONFIG_UUID = 0x2902;
+  static const uint16_t DATABASE_HASH_UUID = 0x2B2A;
+  static const uint16_t MODEL_NUMBER_UUID = 0x2A24;
+  static const uint16_t FIRMWARE_REVISION_UUID = 0x2A26;
+
+  struct Descriptor {
+    handle_t handle;
+    bt_uuid_t type;
+  };
+
+  struct Characteristic {
+    handle_t handle;         // Handle of the declaration
+    handle_t valueHandle;
+    handle_t endHandle;      // Last handle belonging to the characteristic
+    uint8_t properties;
+    bt_uuid_t uuid;
+    size_t firstDescriptor;  // Index into descriptors
+    size_t descriptorCount;
+  };
+
+  struct Service {
+    handle_t handle;
+    handle_t endHandle;
+    bt_uuid_t uuid;
+    size_t firstCharacteristic; // Index into characteristics
+    size_t characteristicCount;
+  };
+
+  typedef void (*DiscoveryCallback)(uint8_t status, void* data, GattDiscovery* discovery, const char* error);
+
+  // If there's a GATT cache, the layout is looked up there under cacheKey,
+  // and stored there once it's been discovered
+  GattDiscovery(Att* att, DiscoveryCallback callback, void* data, const std::string& cacheKey = std::string());
+
+  // Start discovery. The callback is called once it's finished, or fails
+  void start();
+
+  // Find a characteristic by its 16 bit UUID, or NULL if there isn't one
+  const Characteristic* findCharacteristic(uint16_t uuid) const;
+
+  // Find a characteristic's descriptor by its 16 bit UUID, or NULL if there isn't one
+  const Descriptor* findDescriptor(const Characteristic& characteristic, uint16_t uuid) const;
+
+  bool fromCache;    // Whether the layout came from the GATT cache
+  bool fromTemplate; // Whether it came from a template for identical devices
+
+  std::vector<Service> services;
+  std::vector<Characteristic> characteristics;
+  std::vector<Descriptor> descriptors;
+
+private:
+  enum FingerprintStep {
+    DATABASE_HASH,
+    MODEL_NUMBER,
+    FIRMWARE_REVISION
+  };
+
+  void readFingerprint(FingerprintStep step, uint16_t uuid);
+  static void onFingerprint(uint8_t status, void* data, void* list, const char* error);
+  void handleFingerprint(uint8_t status, Att::AttributeDataList* list, const char* error);
+  void useTemplate(const std::string& key);
+
+  void spotCheck();
+  void addSpotCheck(handle_t handle, const std::string& expected);
+  static void onSpotCheck(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
+  void handleSpotCheck(uint8_t status, uint8_t* buf, int len, const char* error);
+
+  void discoverServices();
+  static void onServices(uint8_t status, void* data, void* list, const char* error);
+  void handleServices(uint8_t status, Att::GroupAttributeDataList* list, const char* error);
+
+  void discoverCharacteristics(handle_t startHandle);
+  static void onCharacteristics(uint8_t status, void* data, void* list, const char* error);
+  void handleCharacteristics(uint8_t status, Att::AttributeDataList* list, const char* error);
+
+  void discoverDescriptors();
+  static void onDescriptors(uint8_t status, void* data, void* list, const char* error);
+  void handleDescriptors(uint8_t status, Att::AttributeInfoList* list, const char* error);
+
+  // Work out which service each characteristic belongs to, and where it ends
+  void assignCharacteristics();
+
+  void finish(uint8_t status, const char* error);
+  static void onCacheHit(uv_timer_t* handle, int status);
+  static void onCacheTimerClose(uv_handle_t* handle);
+
+  static bool getUUID(const uint8_t* buf, size_t len, bt_uuid_t& uuid);
+
+  Att* att;
+  DiscoveryCallback callback;
+  void* data;
+  size_t nextCharacteristic; // Next characteristic to find descriptors for
+  std::string cacheKey;
+
+  // Fingerprinting and template checking
+  FingerprintStep fingerprintStep;
+  std::string modelNumber;
+  std::string templateKey;
+  std::vector<std::string> spotChecks; // Expected values, in the order they were read
+  size_t spotChecksDone;
+  bool spotCheckFailed;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Table indexed directly by attribute handle. The 65536 handles are split
+ * into 256 pages of 256 entries, and a page is only allocated once something
+ * is stored in it, so a typical device (which uses a few dozen handles near
+ * the bottom of the range) costs one or two pages. Lookups are two array
+ * indexes, with no locking - it's only ever used from the loop thread.
+ *
+ * T must be default constructible, and the default value means "empty".
+ */
+template <typename T>
+class HandleTable {
+public:
+  static const unsigned int PAGE_BITS = 8;
+  static const unsigned int PAGE_SIZE = 1 << PAGE_BITS;
+  static const unsigned int PAGE_COUNT = 0x10000 / PAGE_SIZE;
+
+  HandleTable() {
+    memset(pages, 0, sizeof(pages));
+  }
+
+  ~HandleTable() {
+    clear();
+  }
+
+  // Get the entry for a handle, or the empty value if there isn't one
+  T get(uint16_t handle) const {
+    const T* page = pages[handle >> PAGE_BITS];
+    if (page == NULL) return T();
+    return page[handle & (PAGE_SIZE - 1)];
+  }
+
+  // Get a reference to the entry for a handle, allocating its page if needed
+  T& operator[](uint16_t handle) {
+    T*& page = pages[handle >> PAGE_BITS];
+    if (page == NULL) {
+      page = new T[PAGE_SIZE]();
+    }
+    return page[handle & (PAGE_SIZE - 1)];
+  }
+
+  // Call fn on every entry in the allocated pages
+  void forEach(void (*fn)(T& entry)) {
+    for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+      if (pages[i] == NULL) continue;
+      for (unsigned int j = 0; j < PAGE_SIZE; j++) {
+        fn(pages[i][j]);
+      }
+    }
+  }
+
+  // Free all the pages
+  void clear() {
+    for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+      delete [] pages[i];
+      pages[i] = NULL;
+    }
+  }
+
+private:
+  // Not copyable
+  HandleTable(const HandleTable&);
+  HandleTable& operator=(const HandleTable&);
+
+  T* pages[PAGE_COUNT];
+};
+
+#endif
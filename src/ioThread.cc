@@ -0,0 +1,133 @@
+#include "ioThread.h"
+
+using namespace v8;
+
+std::vector<IOThread*> IOThread::pool;
+size_t IOThread::poolSize = 0;
+size_t IOThread::nextThread = 0;
+IOThread::TaskQueue* IOThread::mainQueue = NULL;
+size_t IOThread::refs = 0;
+
+IOThread::TaskQueue::TaskQueue(uv_loop_t* loop)
+{
+  pthread_mutex_init(&lock, NULL);
+  async.data = this;
+  uv_async_init(loop, &async, onAsync);
+}
+
+void
+IOThread::TaskQueue::post(Task task, void* data)
+{
+  struct entry e;
+  e.task = task;
+  e.data = data;
+
+  pthread_mutex_lock(&lock);
+  tasks.push_back(e);
+  pthread_mutex_unlock(&lock);
+
+  uv_async_send(&async);
+}
+
+// Run everything that's been posted since we last ran
+void
+IOThread::TaskQueue::onAsync(uv_async_t* handle, int status)
+{
+  TaskQueue* queue = static_cast<TaskQueue*>(handle->data);
+
+  EntryList tasks;
+  pthread_mutex_lock(&queue->lock);
+  tasks.swap(queue->tasks);
+  pthread_mutex_unlock(&queue->lock);
+
+  for (EntryList::iterator it = tasks.begin(); it != tasks.end(); ++it) {
+    it->task(it->data);
+  }
+}
+
+IOThread::IOThread()
+  : loop(uv_loop_new())
+{
+  queue = new TaskQueue(loop);
+  uv_thread_create(&thread, run, this);
+}
+
+// Thread function. The queue's async handle keeps the loop running for good.
+void
+IOThread::run(void* arg)
+{
+  IOThread* thread = static_cast<IOThread*>(arg);
+  uv_run(thread->loop, UV_RUN_DEFAULT);
+}
+
+void
+IOThread::post(Task task, void* data)
+{
+  queue->post(task, data);
+}
+
+void
+IOThread::setPoolSize(size_t size)
+{
+  if (mainQueue == NULL) {
+    mainQueue = new TaskQueue(uv_default_loop());
+    uv_unref((uv_handle_t*) &mainQueue->async);
+  }
+
+  while (pool.size() < size) {
+    pool.push_back(new IOThread());
+  }
+  poolSize = size;
+  nextThread = 0;
+}
+
+IOThread*
+IOThread::next()
+{
+  if (poolSize == 0) return NULL;
+
+  IOThread* thread = pool[nextThread];
+  nextThread = (nextThread + 1) % poolSize;
+  return thread;
+}
+
+void
+IOThread::postToMain(Task task, void* data)
+{
+  mainQueue->post(task, data);
+}
+
+void
+IOThread::ref()
+{
+  if (refs++ == 0) uv_ref((uv_handle_t*) &mainQueue->async);
+}
+
+void
+IOThread::unref()
+{
+  if (--refs == 0) uv_unref((uv_handle_t*) &mainQueue->async);
+}
+
+// Set the number of I/O threads for new connections
+static Handle<Value>
+SetIOThreads(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsUint32()) {
+    ThrowException(Exception::TypeError(String::New("setIOThreads takes a number of threads")));
+    return scope.Close(Undefined());
+  }
+
+  IOThread::setPoolSize(args[0]->Uint32Value());
+
+  return scope.Close(Undefined());
+}
+
+void
+initIOThreads(Handle<Object> exports)
+{
+  exports->Set(String::NewSymbol("setIOThreads"),
+      FunctionTemplate::New(SetIOThreads)->GetFunction());
+}
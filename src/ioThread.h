@@ -0,0 +1,92 @@
+#ifndef IO_THREAD_H
+#define IO_THREAD_H
+
+#include <vector>
+#include <pthread.h>
+#include <node.h>
+#include <uv.h>
+
+/*
+ * Native I/O threads, each running its own libuv loop. Connections can be
+ * spread across a pool of these, so socket I/O and ATT parsing happen off the
+ * JS thread, and only the results are handed back to it.
+ *
+ * Work is passed between threads as tasks - a function and its data - on a
+ * queue which is drained whenever the receiving loop's uv_async fires. Tasks
+ * posted to a thread run in the order they were posted, and uv_async
+ * coalesces wakeups, so a burst of results costs the JS thread a single
+ * wakeup.
+ */
+class IOThread {
+public:
+  typedef void (*Task)(void* data);
+
+  // Set the number of threads new connections are spread across. Zero, the
+  // default, keeps everything on the main loop. Threads are started as
+  // needed, and are never stopped, as connections may still be using them.
+  // Must be called from the JS thread.
+  static void setPoolSize(size_t size);
+
+  // Pick a thread for a new connection, or NULL for the main loop
+  static IOThread* next();
+
+  // Run a task on the JS thread
+  static void postToMain(Task task, void* data);
+
+  // Keep the main loop alive while there are connections on I/O threads.
+  // Must be called from the JS thread.
+  static void ref();
+  static void unref();
+
+  // Run a task on this thread
+  void post(Task task, void* data);
+
+  // The loop to run this thread's connections on
+  uv_loop_t* getLoop() const { return loop; }
+
+private:
+  // Tasks waiting to be run on a loop
+  class TaskQueue {
+  public:
+    TaskQueue(uv_loop_t* loop);
+
+    void post(Task task, void* data);
+
+    uv_async_t async;
+
+  private:
+    struct entry {
+      Task task;
+      void* data;
+    };
+    typedef std::vector<struct entry> EntryList;
+
+    static void onAsync(uv_async_t* handle, int status);
+
+    pthread_mutex_t lock;
+    EntryList tasks;
+  };
+
+  IOThread();
+
+  // Never destroyed, or copied
+  ~IOThread();
+  IOThread(const IOThread&);
+  IOThread& operator=(const IOThread&);
+
+  static void run(void* arg);
+
+  uv_loop_t* loop;
+  TaskQueue* queue;
+  uv_thread_t thread;
+
+  static std::vector<IOThread*> pool;
+  static size_t poolSize;  // Threads in use for new connections
+  static size_t nextThread;
+  static TaskQueue* mainQueue;
+  static size_t refs;
+};
+
+void initIOThreads(v8::Handle<v8::Object> exports);
+
+#endif
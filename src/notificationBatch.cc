@@ -0,0 +1,178 @@
+#include <string.h>
+#include <node_buffer.h>
+
+#include "notificationBatch.h"
+
+using namespace v8;
+using namespace node;
+
+char* NotificationBatch::data = NULL;
+size_t NotificationBatch::dataSize = 0;
+size_t NotificationBatch::dataUsed = 0;
+char* NotificationBatch::index = NULL;
+size_t NotificationBatch::indexSize = 0;
+size_t NotificationBatch::count = 0;
+uv_check_t* NotificationBatch::check = NULL;
+uv_idle_t* NotificationBatch::idle = NULL;
+Persistent<Function> NotificationBatch::callback;
+
+static inline void
+putLE16(uint16_t value, char* ptr)
+{
+  ptr[0] = value & 0xFF;
+  ptr[1] = value >> 8;
+}
+
+static inline void
+putLE32(uint32_t value, char* ptr)
+{
+  putLE16(value & 0xFFFF, ptr);
+  putLE16(value >> 16, ptr + 2);
+}
+
+//
+// Add a notification
+// Arguments:
+//  connection - Id of the connection it came in on
+//  handle     - Attribute handle
+//  value      - The value
+//  length     - Length of the value
+//
+void
+NotificationBatch::add(uint32_t connection, uint16_t handle, const uint8_t* value, size_t length)
+{
+  if (callback.IsEmpty()) return;
+
+  // Notifications added outside the poll phase (like ones a filter held
+  // back, from a timer) would wait for the next poll to return, which may be
+  // never. An active idle handle makes the poll not block.
+  if (count == 0) {
+    if (check == NULL) {
+      check = new uv_check_t;
+      uv_check_init(uv_default_loop(), check);
+      uv_unref((uv_handle_t*) check);
+      idle = new uv_idle_t;
+      uv_idle_init(uv_default_loop(), idle);
+      uv_unref((uv_handle_t*) idle);
+    }
+    uv_check_start(check, onCheck);
+    uv_idle_start(idle, onIdle);
+  }
+
+  reserve(data, dataSize, dataUsed, length, MIN_DATA_SIZE);
+  reserve(index, indexSize, count * ENTRY_SIZE, ENTRY_SIZE, MIN_INDEX_SIZE);
+
+  char* entry = index + count * ENTRY_SIZE;
+  putLE32(dataUsed, entry);
+  putLE16(length, entry + 4);
+  putLE16(handle, entry + 6);
+  putLE32(connection, entry + 8);
+  if (length > 0) memcpy(data + dataUsed, value, length);
+  dataUsed += length;
+  count++;
+}
+
+void
+NotificationBatch::reserve(char*& buffer, size_t& capacity, size_t used, size_t needed, size_t minimum)
+{
+  if (buffer != NULL && capacity - used >= needed) return;
+
+  size_t size = capacity < minimum ? minimum : capacity;
+  while (size - used < needed) size *= 2;
+
+  char* bigger = new char[size];
+  if (used > 0) memcpy(bigger, buffer, used);
+  delete [] buffer;
+  buffer = bigger;
+  capacity = size;
+}
+
+void
+NotificationBatch::setCallback(Handle<Function> cb)
+{
+  if (!callback.IsEmpty()) {
+    callback.Dispose();
+    callback.Clear();
+  }
+  if (!cb.IsEmpty()) {
+    callback = Persistent<Function>::New(cb);
+  } else {
+    if (check != NULL) {
+      uv_check_stop(check);
+      uv_idle_stop(idle);
+    }
+    dataUsed = count = 0;
+  }
+}
+
+// Called after the loop polls for I/O, by which time this iteration's
+// notifications - including those passed back from I/O threads - are in
+void
+NotificationBatch::onCheck(uv_check_t* handle, int status)
+{
+  uv_check_stop(handle);
+  uv_idle_stop(idle);
+  flush();
+}
+
+// Nothing to do - the idle handle's only there to keep the poll from blocking
+void
+NotificationBatch::onIdle(uv_idle_t* handle, int status)
+{
+}
+
+//
+// Hand the batch over to JS. The buffers go with it, and we start the next
+// batch with new ones the same size, as the next is likely to be similar.
+//
+void
+NotificationBatch::flush()
+{
+  if (count == 0 || callback.IsEmpty()) return;
+
+  HandleScope scope;
+
+  Buffer* values = Buffer::New(data, dataUsed, onFree, NULL);
+  Buffer* entries = Buffer::New(index, count * ENTRY_SIZE, onFree, NULL);
+  size_t entryCount = count;
+
+  data = index = NULL;
+  dataUsed = count = 0;
+
+  const int argc = 3;
+  Handle<Value> argv[argc] = { values->handle_, entries->handle_, Integer::NewFromUnsigned(entryCount) };
+  MakeCallback(Context::GetCurrent()->Global(), callback, argc, argv);
+}
+
+void
+NotificationBatch::onFree(char* data, void* hint)
+{
+  delete [] data;
+}
+
+// Set the batch callback, or turn batching off with null
+static Handle<Value>
+SetNotificationBatchCallback(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !(args[0]->IsFunction() || args[0]->IsNull())) {
+    ThrowException(Exception::TypeError(String::New("setNotificationBatchCallback takes a callback, or null")));
+    return scope.Close(Undefined());
+  }
+
+  if (args[0]->IsFunction()) {
+    NotificationBatch::setCallback(Local<Function>::Cast(args[0]));
+  } else {
+    NotificationBatch::setCallback(Handle<Function>());
+  }
+
+  return scope.Close(Undefined());
+}
+
+void
+initNotificationBatch(Handle<Object> exports)
+{
+  exports->Set(String::NewSymbol("setNotificationBatchCallback"),
+      FunctionTemplate::New(SetNotificationBatchCallback)->GetFunction());
+}
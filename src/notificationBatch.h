@@ -0,0 +1,62 @@
+#ifndef NOTIFICATION_BATCH_H
+#define NOTIFICATION_BATCH_H
+
+#include <node.h>
+#include <uv.h>
+
+/*
+ * Notifications from every connection, collected over a loop iteration and
+ * handed to JS in one callback, so the cost of calling into JS goes with the
+ * number of iterations rather than the number of notifications.
+ *
+ * The callback gets two buffers and a count. The first buffer holds the
+ * values back to back. The second is an index, with an ENTRY_SIZE entry per
+ * notification, in the order they arrived:
+ *
+ *   offset     uint32 LE  where the value starts in the first buffer
+ *   length     uint16 LE  length of the value
+ *   handle     uint16 LE  attribute handle
+ *   connection uint32 LE  id of the connection it came in on
+ *
+ * Both buffers belong to the callback.
+ *
+ * Only for use on the JS thread.
+ */
+class NotificationBatch {
+public:
+  static const size_t ENTRY_SIZE = 12;
+
+  // Add a notification to the batch. Does nothing if there's no callback.
+  static void add(uint32_t connection, uint16_t handle, const uint8_t* data, size_t length);
+
+  // Set the callback. An empty handle turns batching off, dropping anything
+  // not yet delivered.
+  static void setCallback(v8::Handle<v8::Function> callback);
+
+private:
+  // Initial buffer sizes
+  static const size_t MIN_DATA_SIZE = 4 * 1024;
+  static const size_t MIN_INDEX_SIZE = 64 * ENTRY_SIZE;
+
+  static void onCheck(uv_check_t* handle, int status);
+  static void onIdle(uv_idle_t* handle, int status);
+  static void flush();
+  static void onFree(char* data, void* hint);
+
+  // Make room for more bytes in a buffer
+  static void reserve(char*& buffer, size_t& capacity, size_t used, size_t needed, size_t minimum);
+
+  static char* data;         // Values
+  static size_t dataSize;
+  static size_t dataUsed;
+  static char* index;        // Index entries
+  static size_t indexSize;
+  static size_t count;
+  static uv_check_t* check;  // Delivers the batch, once the loop's done its I/O
+  static uv_idle_t* idle;    // Stops the loop blocking in poll while there's a batch
+  static v8::Persistent<v8::Function> callback;
+};
+
+void initNotificationBatch(v8::Handle<v8::Object> exports);
+
+#endif
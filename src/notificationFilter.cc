@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "notificationFilter.h"
+
+NotificationFilter::NotificationFilter(uv_loop_t* loop, const Options& options, DeliverCallback callback, void* data)
+  : loop(loop), options(options), callback(callback), data(data), haveLast(false), count(0),
+    interval(0), lastSent(0), sentAny(false), havePending(false), timer(NULL)
+{
+  if (options.maxRate > 0) {
+    interval = 1000 / options.maxRate;
+    if (interval == 0) interval = 1;
+  }
+}
+
+NotificationFilter::~NotificationFilter()
+{
+}
+
+void
+NotificationFilter::destroy()
+{
+  if (timer != NULL) {
+    uv_close((uv_handle_t*) timer, onTimerClose);
+  }
+  delete this;
+}
+
+void
+NotificationFilter::onTimerClose(uv_handle_t* handle)
+{
+  delete (uv_timer_t*) handle;
+}
+
+bool
+NotificationFilter::matches(const uint8_t* value, size_t length) const
+{
+  if (length < options.mask.size()) return false;
+  for (size_t i = 0; i < options.mask.size(); i++) {
+    if ((value[i] & options.mask[i]) != options.match[i]) return false;
+  }
+  return true;
+}
+
+//
+// Filter a notification
+// Arguments:
+//  value  - The value
+//  length - Its length
+//
+void
+NotificationFilter::filter(uint8_t* value, size_t length)
+{
+  if (!matches(value, length)) return;
+
+  if (options.changedOnly) {
+    if (haveLast && last.size() == length && (length == 0 || memcmp(&last[0], value, length) == 0)) {
+      return;
+    }
+    last.assign(value, value + length);
+    haveLast = true;
+  }
+
+  if (options.every > 1 && count++ % options.every != 0) return;
+
+  if (interval > 0) {
+    uint64_t now = uv_now(loop);
+    if (sentAny && now - lastSent < interval) {
+      // Too soon - hold on to it, in place of anything already waiting
+      pending.assign(value, value + length);
+      havePending = true;
+      if (timer == NULL) {
+        timer = new uv_timer_t;
+        timer->data = this;
+        uv_timer_init(loop, timer);
+        uv_unref((uv_handle_t*) timer);
+      }
+      if (!uv_is_active((uv_handle_t*) timer)) {
+        uv_timer_start(timer, onTimer, lastSent + interval - now, 0);
+      }
+      return;
+    }
+    lastSent = now;
+    sentAny = true;
+    // Anything held back is older than this, so it's had its chance
+    havePending = false;
+    if (timer != NULL) uv_timer_stop(timer);
+  }
+
+  deliver(value, length);
+}
+
+void
+NotificationFilter::onTimer(uv_timer_t* handle, int status)
+{
+  NotificationFilter* filter = (NotificationFilter*) handle->data;
+  if (!filter->havePending) return;
+
+  filter->havePending = false;
+  filter->lastSent = uv_now(filter->loop);
+  std::vector<uint8_t> value;
+  value.swap(filter->pending);
+  filter->deliver(value.empty() ? NULL : &value[0], value.size());
+}
+
+void
+NotificationFilter::deliver(uint8_t* value, size_t length)
+{
+  callback(data, value, length);
+}
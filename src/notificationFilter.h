@@ -0,0 +1,81 @@
+#ifndef NOTIFICATION_FILTER_H
+#define NOTIFICATION_FILTER_H
+
+#include <vector>
+#include <uv.h>
+
+/*
+ * Filter on a notification listener, run on the Att's loop so notifications
+ * nobody wants are dropped before they go anywhere near JS. Filters apply in
+ * this order:
+ *
+ *  - mask/match: only values where (value & mask) == match, byte by byte,
+ *    get through. Values shorter than the mask don't.
+ *  - changedOnly: values the same as the last one to get this far are dropped
+ *  - every: only every Nth value gets through, starting with the first
+ *  - maxRate: at most this many values a second. If they come faster, the
+ *    latest one is held back, and passed on when the time comes, replacing
+ *    any that were held back before it.
+ */
+class NotificationFilter {
+public:
+  typedef void (*DeliverCallback)(void* data, uint8_t* value, size_t length);
+
+  struct Options {
+    Options() : changedOnly(false), maxRate(0), every(0) {}
+
+    // Whether there's nothing to filter
+    bool empty() const { return mask.empty() && !changedOnly && maxRate == 0 && every <= 1; }
+
+    std::vector<uint8_t> mask;
+    std::vector<uint8_t> match;   // Same length as mask
+    bool changedOnly;
+    uint32_t maxRate;             // Per second, 0 for no limit
+    uint32_t every;               // 0 or 1 pass everything
+  };
+
+  // Values which get through are passed to the callback, which is always
+  // called on the loop
+  NotificationFilter(uv_loop_t* loop, const Options& options, DeliverCallback callback, void* data);
+
+  // Delete the filter, dropping any value held back
+  void destroy();
+
+  // Filter a value
+  void filter(uint8_t* value, size_t length);
+
+private:
+  ~NotificationFilter();
+
+  // Not copyable
+  NotificationFilter(const NotificationFilter&);
+  NotificationFilter& operator=(const NotificationFilter&);
+
+  bool matches(const uint8_t* value, size_t length) const;
+  void deliver(uint8_t* value, size_t length);
+
+  static void onTimer(uv_timer_t* handle, int status);
+  static void onTimerClose(uv_handle_t* handle);
+
+  uv_loop_t* loop;
+  Options options;
+  DeliverCallback callback;
+  void* data;
+
+  // changedOnly
+  std::vector<uint8_t> last;
+  bool haveLast;
+
+  // every
+  uint32_t count;
+
+  // maxRate
+  uint64_t interval;         // Milliseconds between values
+  uint64_t lastSent;
+  bool sentAny;
+  std::vector<uint8_t> pending; // Value held back
+  bool havePending;
+  uv_timer_t* timer;         // Sends the held back value
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include <string.h>
+#include <sys/time.h>
+
+#include "notificationRing.h"
+
+static inline uint32_t
+getLE32(const char* ptr)
+{
+  const uint8_t* p = (const uint8_t*) ptr;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void
+putLE16(uint16_t value, char* ptr)
+{
+  ptr[0] = value & 0xFF;
+  ptr[1] = value >> 8;
+}
+
+static inline void
+putLE32(uint32_t value, char* ptr)
+{
+  putLE16(value & 0xFFFF, ptr);
+  putLE16(value >> 16, ptr + 2);
+}
+
+static inline void
+putDoubleLE(double value, char* ptr)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  putLE32(bits & 0xFFFFFFFF, ptr);
+  putLE32(bits >> 32, ptr + 4);
+}
+
+bool
+NotificationRing::isValid(const char* ring, size_t length)
+{
+  if (length < HEADER_SIZE) return false;
+  uint32_t capacity = getLE32(ring + 12);
+  return capacity >= RECORD_HEADER_SIZE && (capacity & (capacity - 1)) == 0 &&
+    length - HEADER_SIZE >= capacity;
+}
+
+//
+// Write a notification into the ring
+// Arguments:
+//  ring       - The ring's buffer, checked with isValid()
+//  connection - Id of the connection it came in on
+//  handle     - Attribute handle
+//  value      - The value
+//  length     - Length of the value
+//
+bool
+NotificationRing::write(char* ring, uint32_t connection, uint16_t handle, const uint8_t* value, size_t length)
+{
+  uint32_t writeIndex = getLE32(ring);
+  uint32_t readIndex = getLE32(ring + 4);
+  uint32_t capacity = getLE32(ring + 12);
+  char* records = ring + HEADER_SIZE;
+
+  uint32_t size = (RECORD_HEADER_SIZE + length + 3) & ~3;
+  uint32_t offset = writeIndex & (capacity - 1);
+  uint32_t padding = offset + size > capacity ? capacity - offset : 0;
+
+  if (length >= WRAP || padding + size > capacity - (writeIndex - readIndex)) {
+    putLE32(getLE32(ring + 8) + 1, ring + 8);
+    return false;
+  }
+
+  if (padding > 0) {
+    putLE16(WRAP, records + offset);
+    writeIndex += padding;
+    offset = 0;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  char* record = records + offset;
+  putLE16(length, record);
+  putLE16(handle, record + 2);
+  putLE32(connection, record + 4);
+  putDoubleLE(now.tv_sec * 1000.0 + now.tv_usec / 1000.0, record + 8);
+  if (length > 0) memcpy(record + RECORD_HEADER_SIZE, value, length);
+
+  // Publish the record only once it's all there
+  putLE32(writeIndex + size, ring);
+  return true;
+}
@@ -0,0 +1,49 @@
+#ifndef NOTIFICATION_RING_H
+#define NOTIFICATION_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Ring buffer of notifications, in memory shared with JS (a Buffer), which
+ * JS drains at its own pace without us ever calling into it. We only ever
+ * move the write index, and JS only ever moves the read index, so neither
+ * side needs a lock. If the ring's full, the notification is dropped and
+ * counted.
+ *
+ * The buffer starts with a HEADER_SIZE header of little endian uint32s:
+ *
+ *   0  write index  bytes ever written, including padding
+ *   4  read index   bytes ever consumed
+ *   8  drops        notifications dropped because the ring was full
+ *   12 capacity     size of the record area, a power of two
+ *
+ * followed by the record area. The indexes wrap at 2^32, and the position
+ * of an index in the record area is index % capacity. Each record is
+ *
+ *   0  length       uint16 LE, length of the value
+ *   2  handle       uint16 LE
+ *   4  connection   uint32 LE, id of the connection it came in on
+ *   8  timestamp    double LE, milliseconds since the epoch
+ *   16 value
+ *
+ * padded to a multiple of 4 bytes. Records don't wrap round the end of the
+ * record area - if one doesn't fit, the rest of the area is skipped, marked
+ * by a length of WRAP.
+ *
+ * Only written from the JS thread.
+ */
+class NotificationRing {
+public:
+  static const size_t HEADER_SIZE = 16;
+  static const size_t RECORD_HEADER_SIZE = 16;
+  static const uint16_t WRAP = 0xFFFF;
+
+  // Whether the buffer holds a ring we can write to
+  static bool isValid(const char* ring, size_t length);
+
+  // Add a notification. Returns false if it was dropped.
+  static bool write(char* ring, uint32_t connection, uint16_t handle, const uint8_t* value, size_t length);
+};
+
+#endif
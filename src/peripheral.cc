@@ -4,10 +4,15 @@
 #include "peripheral.h"
 #include "btio.h"
 #include "btleException.h"
+#include "bufferSlab.h"
 #include "central.h"
 #include "hci.h"
 #include "util.h"
 #include "debug.h"
+#include "gattCache.h"
+#include "notificationBatch.h"
+#include "notificationRing.h"
+#include "sigDecoder.h"
 
 using namespace v8;
 using namespace node;
@@ -18,22 +23,34 @@ Peripheral::constructor;
 
 // Callback data structure
 struct callbackData {
-  callbackData() : peripheral(NULL), data(NULL), startHandle(0), endHandle(0) {}
+  callbackData() : peripheral(NULL), data(NULL), startHandle(0), endHandle(0), id(0), decoder(NULL), packed(false) {}
+  ~callbackData() {
+    if (id != 0) peripheral->requests.erase(id);
+  }
   Peripheral* peripheral;
   void* data;
   uint16_t startHandle;
   uint16_t endHandle;
+  uint32_t id;      // Request id handed back to JS, for cancel()
+  const SigDecoder::Decoder* decoder; // Decoder for notification values, if any
+  bool packed;      // Whether decoded values go to JS as a Float64Array
 };
 
+// Connection ids, for batched notifications
+uint32_t
+Peripheral::lastConnectionId = 0;
+
 // Constructor
-Peripheral::Peripheral() : att(NULL)
+Peripheral::Peripheral() : att(NULL), connectMTU(0), serviceChangedHandle(0), lastRequestId(0),
+  connectionId(++lastConnectionId)
 {
+  memset(&address, 0, sizeof(address));
 }
 
 // Destructor
 Peripheral::~Peripheral()
 {
-  delete att;
+  if (att) att->destroy();
 }
 
 // Node.js initialization
@@ -50,8 +67,19 @@ Peripheral::Init(Handle<Object> exports)
   NODE_SET_PROTOTYPE_METHOD(t, "readByGroupType", Peripheral::ReadByGroupType);
   NODE_SET_PROTOTYPE_METHOD(t, "close", Peripheral::Close);
   NODE_SET_PROTOTYPE_METHOD(t, "readHandle", Peripheral::ReadHandle);
+  NODE_SET_PROTOTYPE_METHOD(t, "readLongHandle", Peripheral::ReadLongHandle);
   NODE_SET_PROTOTYPE_METHOD(t, "addNotificationListener", Peripheral::AddNotificationListener);
   NODE_SET_PROTOTYPE_METHOD(t, "writeCommand", Peripheral::WriteCommand);
+  NODE_SET_PROTOTYPE_METHOD(t, "writeRequest", Peripheral::WriteRequest);
+  NODE_SET_PROTOTYPE_METHOD(t, "writeLongHandle", Peripheral::WriteLongHandle);
+  NODE_SET_PROTOTYPE_METHOD(t, "reliableWrite", Peripheral::ReliableWrite);
+  NODE_SET_PROTOTYPE_METHOD(t, "exchangeMTU", Peripheral::ExchangeMTU);
+  NODE_SET_PROTOTYPE_METHOD(t, "getMTU", Peripheral::GetMTU);
+  NODE_SET_PROTOTYPE_METHOD(t, "getWriteQueueSize", Peripheral::GetWriteQueueSize);
+  NODE_SET_PROTOTYPE_METHOD(t, "getCachedValue", Peripheral::GetCachedValue);
+  NODE_SET_PROTOTYPE_METHOD(t, "discoverAll", Peripheral::DiscoverAll);
+  NODE_SET_PROTOTYPE_METHOD(t, "cancel", Peripheral::Cancel);
+  NODE_SET_PROTOTYPE_METHOD(t, "getConnectionId", Peripheral::GetConnectionId);
 
   exports->Set(String::NewSymbol("PeripheralInterface"), t->GetFunction());
 }
@@ -90,6 +118,9 @@ Peripheral::Connect(const Arguments& args)
 
   Local<String> destination = Local<String>::Cast(args[0]);
 
+  // getStringValue() reuses its buffer, so copy this before reading options
+  std::string destinationString = getStringValue(destination);
+
   Local<Object> options;
   Persistent<Function> callback;
 
@@ -118,13 +149,57 @@ Peripheral::Connect(const Arguments& args)
 
   Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
 
+  // Optionally exchange MTU as soon as we're connected
+  peripheral->connectMTU = 0;
+  Handle<String> key = getKey("exchangeMTU");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (value->IsBoolean()) {
+      if (value->BooleanValue()) peripheral->connectMTU = Att::MAX_MTU;
+    } else if (value->IsUint32()) {
+      peripheral->connectMTU = value->Uint32Value();
+    } else {
+      ThrowException(Exception::TypeError(String::New("ExchangeMTU option must be true, false or an MTU value")));
+      return scope.Close(Undefined());
+    }
+  }
+
+  // Write queue limits
+  size_t highWaterMark = Connection::DEFAULT_HIGH_WATER_MARK;
+  size_t lowWaterMark = Connection::DEFAULT_LOW_WATER_MARK;
+  if (!getWaterMarks(options, highWaterMark, lowWaterMark)) {
+    return scope.Close(Undefined());
+  }
+
+  // How long the device has to respond to each request
+  uint64_t requestTimeout = Att::DEFAULT_TIMEOUT;
+  key = getKey("requestTimeout");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsUint32()) {
+      ThrowException(Exception::TypeError(String::New("RequestTimeout option must be a number of milliseconds")));
+      return scope.Close(Undefined());
+    }
+    requestTimeout = value->Uint32Value();
+  }
+
+  Transport* transport = getTransport(opts, options, destinationString);
+  if (transport == NULL) {
+    return scope.Close(Undefined());
+  }
+
   //callback.MakeWeak(*callback, weak_cb);
   peripheral->connectionCallback = callback;
 
-  peripheral->att = new Att();
+  bacpy(&peripheral->address, &opts.dst);
+  peripheral->serviceChangedHandle = 0;
+  peripheral->att = new AttProxy(IOThread::next());
   peripheral->att->onError(onError, peripheral);
+  peripheral->att->setWaterMarks(highWaterMark, lowWaterMark);
+  peripheral->att->onDrain(onDrain, peripheral);
+  peripheral->att->setRequestTimeout(requestTimeout);
   try {
-    peripheral->att->connect(opts, onConnect, (void*) peripheral);
+    peripheral->att->connect(transport, onConnect, (void*) peripheral);
   } catch (BTLEException& e) {
     peripheral->emit_error();
   }
@@ -173,8 +248,9 @@ Peripheral::FindInformation(const Arguments& args)
   cd->startHandle = startHandle;
   cd->endHandle = endHandle;
 
+  uint32_t id = peripheral->trackRequest(cd);
   peripheral->att->findInformation(startHandle, endHandle, onFindInformation, cd);
-  return scope.Close(Undefined());
+  return scope.Close(Integer::NewFromUnsigned(id));
 }
 
 // Send a Find By Type Value request
@@ -231,9 +307,10 @@ Peripheral::FindByTypeValue(const Arguments& args)
   cd->startHandle = startHandle;
   cd->endHandle = endHandle;
 
+  uint32_t id = peripheral->trackRequest(cd);
   peripheral->att->findByTypeValue(startHandle, endHandle, uuid,
       (const uint8_t*) Buffer::Data(args[3]), Buffer::Length(args[3]), onFindByType, cd);
-  return scope.Close(Undefined());
+  return scope.Close(Integer::NewFromUnsigned(id));
 }
 
 // Send a Read By Type request
@@ -285,8 +362,9 @@ Peripheral::ReadByType(const Arguments& args)
   cd->startHandle = startHandle;
   cd->endHandle = endHandle;
 
+  uint32_t id = peripheral->trackRequest(cd);
   peripheral->att->readByType(startHandle, endHandle, uuid, onReadByType, cd);
-  return scope.Close(Undefined());
+  return scope.Close(Integer::NewFromUnsigned(id));
 }
 
 // Send a Read By Group Type request
@@ -339,8 +417,9 @@ Peripheral::ReadByGroupType(const Arguments& args)
   cd->endHandle = endHandle;
 
   // Note: Can re-use onReadByType
+  uint32_t id = peripheral->trackRequest(cd);
   peripheral->att->readByGroupType(startHandle, endHandle, uuid, onReadByGroupType, cd);
-  return scope.Close(Undefined());
+  return scope.Close(Integer::NewFromUnsigned(id));
 }
 
 // Read an attribute
@@ -359,14 +438,54 @@ Peripheral::ReadHandle(const Arguments& args)
     return scope.Close(Undefined());
   }
 
-  if (!args[1]->IsFunction()) {
-    ThrowException(Exception::TypeError(String::New("Second argument must be a callback")));
+  // Options are optional
+  int length = 0;
+  uint64_t maxAge = 0;
+  uint64_t timeout = 0;
+  int cbIndex = 1;
+  if (args.Length() > 2) {
+    if (!args[1]->IsObject()) {
+      ThrowException(Exception::TypeError(String::New("Second argument must be an options object")));
+      return scope.Close(Undefined());
+    }
+    Local<Object> options = args[1]->ToObject();
+
+    // A fixed value length lets the read be combined with others
+    Handle<String> key = getKey("length");
+    if (options->Has(key)) {
+      Local<Value> value = options->Get(key);
+      if (!value->IsUint32()) {
+        ThrowException(Exception::TypeError(String::New("Length option must be a positive integer")));
+        return scope.Close(Undefined());
+      }
+      getIntValue(value->ToNumber(), length);
+    }
+
+    // A value this recent, in milliseconds, can come from the mirror
+    key = getKey("maxAge");
+    if (options->Has(key)) {
+      Local<Value> value = options->Get(key);
+      if (!value->IsUint32()) {
+        ThrowException(Exception::TypeError(String::New("maxAge option must be a positive integer")));
+        return scope.Close(Undefined());
+      }
+      maxAge = value->Uint32Value();
+    }
+
+    if (!getRequestTimeout(options, timeout)) {
+      return scope.Close(Undefined());
+    }
+    cbIndex = 2;
+  }
+
+  if (!args[cbIndex]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be a callback")));
     return scope.Close(Undefined());
   }
 
   Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
 
-  Persistent<Function> callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+  Persistent<Function> callback = Persistent<Function>::New(Local<Function>::Cast(args[cbIndex]));
   //callback.MakeWeak(*callback, weak_cb);
   
   struct callbackData* cd = new struct callbackData();
@@ -375,8 +494,72 @@ Peripheral::ReadHandle(const Arguments& args)
 
   int handle;
   getIntValue(args[0]->ToNumber(), handle);
-  peripheral->att->readAttribute(handle, onReadAttribute, cd);
-  return scope.Close(Undefined());
+  uint32_t id = peripheral->trackRequest(cd);
+  peripheral->att->readAttribute(handle, onReadAttribute, cd, length, maxAge, timeout);
+  return scope.Close(Integer::NewFromUnsigned(id));
+}
+
+// Read a long attribute
+Handle<Value>
+Peripheral::ReadLongHandle(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 2) {
+    ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
+    return scope.Close(Undefined());
+  }
+
+  if (!args[0]->IsUint32()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a handle number")));
+    return scope.Close(Undefined());
+  }
+
+  // Options are optional
+  bool stream = false;
+  uint64_t timeout = 0;
+  int cbIndex = 1;
+  if (args.Length() > 2) {
+    if (!args[1]->IsObject()) {
+      ThrowException(Exception::TypeError(String::New("Second argument must be an options object")));
+      return scope.Close(Undefined());
+    }
+    Local<Object> options = args[1]->ToObject();
+    Handle<String> key = getKey("stream");
+    if (options->Has(key)) {
+      Local<Value> value = options->Get(key);
+      if (!value->IsBoolean()) {
+        ThrowException(Exception::TypeError(String::New("Stream option must be true or false")));
+        return scope.Close(Undefined());
+      }
+      stream = value->BooleanValue();
+    }
+
+    if (!getRequestTimeout(options, timeout)) {
+      return scope.Close(Undefined());
+    }
+    cbIndex = 2;
+  }
+
+  if (!args[cbIndex]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be a callback")));
+    return scope.Close(Undefined());
+  }
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  Persistent<Function> callback = Persistent<Function>::New(Local<Function>::Cast(args[cbIndex]));
+  //callback.MakeWeak(*callback, weak_cb);
+
+  struct callbackData* cd = new struct callbackData();
+  cd->data = *callback;
+  cd->peripheral = peripheral;
+
+  int handle;
+  getIntValue(args[0]->ToNumber(), handle);
+  uint32_t id = peripheral->trackRequest(cd);
+  peripheral->att->readLongAttribute(handle, onReadLongAttribute, cd, stream, timeout);
+  return scope.Close(Integer::NewFromUnsigned(id));
 }
 
 // Write an attribute without a response
@@ -422,10 +605,10 @@ Peripheral::WriteCommand(const v8::Arguments& args)
     cd->data = *callback;
   }
 
-  peripheral->att->writeCommand(handle, (const uint8_t*) Buffer::Data(args[1]), Buffer::Length(args[1]),
+  bool ok = peripheral->att->writeCommand(handle, (const uint8_t*) Buffer::Data(args[1]), Buffer::Length(args[1]),
       onWrite, cd);
 
-  return scope.Close(Undefined());
+  return scope.Close(Boolean::New(ok));
 }
 
 // Write an attribute with a response
@@ -449,14 +632,186 @@ Peripheral::WriteRequest(const v8::Arguments& args)
     return scope.Close(Undefined());
   }
 
+  // Options are optional
+  uint64_t timeout = 0;
+  int cbIndex = 2;
+  if (args.Length() > 2 && args[2]->IsObject() && !args[2]->IsFunction()) {
+    if (!getRequestTimeout(args[2]->ToObject(), timeout)) {
+      return scope.Close(Undefined());
+    }
+    cbIndex = 3;
+  }
+
+  Persistent<Function> callback;
+  if (args.Length() > cbIndex) {
+    if (!args[cbIndex]->IsFunction()) {
+      ThrowException(Exception::TypeError(String::New("Last argument must be a callback")));
+      return scope.Close(Undefined());
+    }
+
+    callback = Persistent<Function>::New(Local<Function>::Cast(args[cbIndex]));
+    //callback.MakeWeak(*callback, weak_cb);
+  }
+
   Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
 
   int handle;
   getIntValue(args[0]->ToNumber(), handle);
 
-  peripheral->att->writeRequest(handle, (const uint8_t*) Buffer::Data(args[1]), Buffer::Length(args[1]));
+  struct callbackData* cd = new struct callbackData();
+  cd->peripheral = peripheral;
+  if (args.Length() > cbIndex) {
+    cd->data = *callback;
+  }
+
+  uint32_t id = peripheral->trackRequest(cd);
+  peripheral->att->writeRequest(handle, (const uint8_t*) Buffer::Data(args[1]), Buffer::Length(args[1]),
+      onWrite, cd, timeout);
 
-  return scope.Close(Undefined());
+  return scope.Close(Integer::NewFromUnsigned(id));
+}
+
+// Write a long attribute value
+Handle<Value>
+Peripheral::WriteLongHandle(const v8::Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 2) {
+    ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
+    return scope.Close(Undefined());
+  }
+
+  if (!args[0]->IsUint32()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a handle number")));
+    return scope.Close(Undefined());
+  }
+
+  if (!Buffer::HasInstance(args[1])) {
+    ThrowException(Exception::TypeError(String::New("Second argument must be a buffer")));
+    return scope.Close(Undefined());
+  }
+
+  // Options are optional
+  uint64_t timeout = 0;
+  int cbIndex = 2;
+  if (args.Length() > 2 && args[2]->IsObject() && !args[2]->IsFunction()) {
+    if (!getRequestTimeout(args[2]->ToObject(), timeout)) {
+      return scope.Close(Undefined());
+    }
+    cbIndex = 3;
+  }
+
+  Persistent<Function> callback;
+  if (args.Length() > cbIndex) {
+    if (!args[cbIndex]->IsFunction()) {
+      ThrowException(Exception::TypeError(String::New("Last argument must be a callback")));
+      return scope.Close(Undefined());
+    }
+
+    callback = Persistent<Function>::New(Local<Function>::Cast(args[cbIndex]));
+    //callback.MakeWeak(*callback, weak_cb);
+  }
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  int handle;
+  getIntValue(args[0]->ToNumber(), handle);
+
+  struct callbackData* cd = new struct callbackData();
+  cd->peripheral = peripheral;
+  if (args.Length() > cbIndex) {
+    cd->data = *callback;
+  }
+
+  uint32_t id = peripheral->trackRequest(cd);
+  peripheral->att->writeLongAttribute(handle, (const uint8_t*) Buffer::Data(args[1]), Buffer::Length(args[1]),
+      onWrite, cd, timeout);
+
+  return scope.Close(Integer::NewFromUnsigned(id));
+}
+
+// Write several attribute values in one atomic operation. Takes an array
+// of { handle: <handle>, value: <Buffer> } objects
+Handle<Value>
+Peripheral::ReliableWrite(const v8::Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1) {
+    ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
+    return scope.Close(Undefined());
+  }
+
+  if (!args[0]->IsArray()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be an array of handles and values")));
+    return scope.Close(Undefined());
+  }
+
+  Local<Array> array = Local<Array>::Cast(args[0]);
+  if (array->Length() == 0) {
+    ThrowException(Exception::TypeError(String::New("First argument must not be empty")));
+    return scope.Close(Undefined());
+  }
+  Att::WriteList values;
+  Handle<String> handleKey = getKey("handle");
+  Handle<String> valueKey = getKey("value");
+  for (uint32_t i = 0; i < array->Length(); ++i) {
+    Local<Value> element = array->Get(i);
+    if (!element->IsObject()) {
+      ThrowException(Exception::TypeError(String::New("Array elements must be objects")));
+      return scope.Close(Undefined());
+    }
+    Local<Object> object = element->ToObject();
+    Local<Value> handle = object->Get(handleKey);
+    Local<Value> value = object->Get(valueKey);
+    if (!handle->IsUint32()) {
+      ThrowException(Exception::TypeError(String::New("Handle must be a handle number")));
+      return scope.Close(Undefined());
+    }
+    if (!Buffer::HasInstance(value)) {
+      ThrowException(Exception::TypeError(String::New("Value must be a buffer")));
+      return scope.Close(Undefined());
+    }
+    Att::WriteValue writeValue = { (handle_t) handle->Uint32Value(),
+      (const uint8_t*) Buffer::Data(value), Buffer::Length(value) };
+    values.push_back(writeValue);
+  }
+
+  // Options are optional
+  uint64_t timeout = 0;
+  int cbIndex = 1;
+  if (args.Length() > 1 && args[1]->IsObject() && !args[1]->IsFunction()) {
+    if (!getRequestTimeout(args[1]->ToObject(), timeout)) {
+      return scope.Close(Undefined());
+    }
+    cbIndex = 2;
+  }
+
+  Persistent<Function> callback;
+  if (args.Length() > cbIndex) {
+    if (!args[cbIndex]->IsFunction()) {
+      ThrowException(Exception::TypeError(String::New("Last argument must be a callback")));
+      return scope.Close(Undefined());
+    }
+
+    callback = Persistent<Function>::New(Local<Function>::Cast(args[cbIndex]));
+    //callback.MakeWeak(*callback, weak_cb);
+  }
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  struct callbackData* cd = new struct callbackData();
+  cd->peripheral = peripheral;
+  if (args.Length() > cbIndex) {
+    cd->data = *callback;
+  }
+
+  // Note: The values are copied, so it's fine that the buffers may go away
+  uint32_t id = peripheral->trackRequest(cd);
+  peripheral->att->reliableWrite(values, onWrite, cd, timeout);
+
+  return scope.Close(Integer::NewFromUnsigned(id));
 }
 
 // Add a listener for notifications
@@ -467,7 +822,7 @@ Peripheral::AddNotificationListener(const Arguments& args)
 
   Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
 
-  if (args.Length() < 2) {
+  if (args.Length() < 1) {
     ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
     return scope.Close(Undefined());
   }
@@ -477,25 +832,267 @@ Peripheral::AddNotificationListener(const Arguments& args)
     return scope.Close(Undefined());
   }
 
-  if (!args[1]->IsFunction()) {
-    ThrowException(Exception::TypeError(String::New("Second argument must be a callback")));
+  int handle;
+  getIntValue(args[0]->ToNumber(), handle);
+
+  // Filter and decoding options are optional
+  NotificationFilter::Options filter;
+  const SigDecoder::Decoder* decoder = NULL;
+  bool packed = false;
+  int cbIndex = 1;
+  if (args.Length() > 1 && args[1]->IsObject() && !args[1]->IsFunction() &&
+      !Buffer::HasInstance(getRingBuffer(args[1]))) {
+    if (!getNotificationFilter(args[1]->ToObject(), filter) ||
+        !getSigDecoder(args[1]->ToObject(), decoder, packed)) {
+      return scope.Close(Undefined());
+    }
+    cbIndex = 2;
+  }
+  // A NotificationRing object is given by its buffer
+  Local<Value> target = args.Length() > cbIndex ? getRingBuffer(args[cbIndex]) : Local<Value>::New(Undefined());
+
+  // Decoded values need a callback to go to
+  if (decoder != NULL && !target->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Decode option needs a callback")));
     return scope.Close(Undefined());
   }
 
-  Persistent<Function> callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+  // Without a callback, the notifications go in the batch
+  if (target->IsUndefined()) {
+    struct callbackData* cd = new struct callbackData();
+    cd->peripheral = peripheral;
+    cd->startHandle = handle;
+    peripheral->att->listenForNotifications(handle, onBatchedNotification, cd, &filter);
+    return scope.Close(Undefined());
+  }
+
+  // With a ring buffer, they go in that, for JS to pick up when it's ready
+  if (Buffer::HasInstance(target)) {
+    if (!NotificationRing::isValid(Buffer::Data(target), Buffer::Length(target))) {
+      ThrowException(Exception::TypeError(String::New("Last argument isn't a notification ring")));
+      return scope.Close(Undefined());
+    }
+    Persistent<Object> ring = Persistent<Object>::New(target->ToObject());
+    struct callbackData* cd = new struct callbackData();
+    cd->data = *ring;
+    cd->peripheral = peripheral;
+    cd->startHandle = handle;
+    peripheral->att->listenForNotifications(handle, onRingNotification, cd, &filter);
+    return scope.Close(Undefined());
+  }
+
+  if (!target->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be a callback or a notification ring")));
+    return scope.Close(Undefined());
+  }
+
+  Persistent<Function> callback = Persistent<Function>::New(Local<Function>::Cast(target));
   //callback.MakeWeak(*callback, weak_cb);
 
   struct callbackData* cd = new struct callbackData();
   cd->data = *callback;
   cd->peripheral = peripheral;
+  cd->decoder = decoder;
+  cd->packed = packed;
 
-  int handle;
-  getIntValue(args[0]->ToNumber(), handle);
-  peripheral->att->listenForNotifications(handle, onReadNotification, cd);
+  peripheral->att->listenForNotifications(handle, onReadNotification, cd, &filter);
 
   return scope.Close(Undefined());
 }
 
+// Exchange MTU with the device
+Handle<Value>
+Peripheral::ExchangeMTU(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1) {
+    ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
+    return scope.Close(Undefined());
+  }
+
+  // MTU is optional, and defaults to the largest we can handle
+  int mtu = Att::MAX_MTU;
+  int cbIndex = 0;
+  if (args.Length() > 1 && !args[0]->IsObject()) {
+    if (!args[0]->IsUint32()) {
+      ThrowException(Exception::TypeError(String::New("First argument must be an MTU value")));
+      return scope.Close(Undefined());
+    }
+    getIntValue(args[0]->ToNumber(), mtu);
+    cbIndex = 1;
+  }
+
+  // So are options
+  uint64_t timeout = 0;
+  if (args.Length() > cbIndex + 1) {
+    if (!args[cbIndex]->IsObject()) {
+      ThrowException(Exception::TypeError(String::New("Options must be an object")));
+      return scope.Close(Undefined());
+    }
+    if (!getRequestTimeout(args[cbIndex]->ToObject(), timeout)) {
+      return scope.Close(Undefined());
+    }
+    cbIndex++;
+  }
+
+  if (!args[cbIndex]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be a callback")));
+    return scope.Close(Undefined());
+  }
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  Persistent<Function> callback = Persistent<Function>::New(Local<Function>::Cast(args[cbIndex]));
+  //callback.MakeWeak(*callback, weak_cb);
+
+  struct callbackData* cd = new struct callbackData();
+  cd->data = *callback;
+  cd->peripheral = peripheral;
+
+  uint32_t id = peripheral->trackRequest(cd);
+  peripheral->att->exchangeMTU(mtu, onExchangeMTU, cd, timeout);
+  return scope.Close(Integer::NewFromUnsigned(id));
+}
+
+// Get the current MTU
+Handle<Value>
+Peripheral::GetMTU(const Arguments& args)
+{
+  HandleScope scope;
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+  int mtu = peripheral->att ? peripheral->att->getMTU() : ATT_DEFAULT_LE_MTU;
+
+  return scope.Close(Integer::New(mtu));
+}
+
+// Get the number of bytes waiting to be written
+Handle<Value>
+Peripheral::GetWriteQueueSize(const Arguments& args)
+{
+  HandleScope scope;
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+  size_t size = peripheral->att ? peripheral->att->getWriteQueueSize() : 0;
+
+  return scope.Close(Integer::NewFromUnsigned(size));
+}
+
+// Get the last known value of an attribute, without asking the device.
+// Returns an object with the value and its age in milliseconds, or undefined
+// if there's no value, or it's older than the optional maximum age.
+Handle<Value>
+Peripheral::GetCachedValue(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1) {
+    ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
+    return scope.Close(Undefined());
+  }
+
+  if (!args[0]->IsUint32()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a handle number")));
+    return scope.Close(Undefined());
+  }
+
+  uint64_t maxAge = 0;
+  if (args.Length() > 1 && !args[1]->IsUndefined()) {
+    if (!args[1]->IsUint32()) {
+      ThrowException(Exception::TypeError(String::New("Second argument must be a number of milliseconds")));
+      return scope.Close(Undefined());
+    }
+    maxAge = args[1]->Uint32Value();
+  }
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  std::vector<uint8_t> value;
+  uint64_t age;
+  if (peripheral->att == NULL ||
+      !peripheral->att->getCachedValue(args[0]->Uint32Value(), maxAge, value, age)) {
+    return scope.Close(Undefined());
+  }
+
+  Local<Object> ret = Object::New();
+  Buffer* buffer = Buffer::New(value.size());
+  if (!value.empty()) memcpy(Buffer::Data(buffer), &value[0], value.size());
+  ret->Set(String::New("value"), buffer->handle_);
+  ret->Set(String::New("age"), Number::New(age));
+
+  return scope.Close(ret);
+}
+
+// Discover all the services, characteristics and descriptors on the device
+Handle<Value>
+Peripheral::DiscoverAll(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1) {
+    ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
+    return scope.Close(Undefined());
+  }
+
+  if (!args[0]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Argument must be a callback")));
+    return scope.Close(Undefined());
+  }
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  Persistent<Function> callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+  //callback.MakeWeak(*callback, weak_cb);
+
+  struct callbackData* cd = new struct callbackData();
+  cd->data = *callback;
+  cd->peripheral = peripheral;
+
+  peripheral->att->discoverAll(onDiscoverAll, cd, GattCache::addressKey(peripheral->address));
+
+  return scope.Close(Undefined());
+}
+
+// Get the id batched notifications from this connection are tagged with
+Handle<Value>
+Peripheral::GetConnectionId(const Arguments& args)
+{
+  HandleScope scope;
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  return scope.Close(Integer::NewFromUnsigned(peripheral->connectionId));
+}
+
+// Cancel a request, by the id the request method returned
+Handle<Value>
+Peripheral::Cancel(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1) {
+    ThrowException(Exception::TypeError(String::New("Wrong number of arguments")));
+    return scope.Close(Undefined());
+  }
+
+  if (!args[0]->IsUint32()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a request id")));
+    return scope.Close(Undefined());
+  }
+
+  Peripheral* peripheral = ObjectWrap::Unwrap<Peripheral>(args.This());
+
+  RequestMap::iterator it = peripheral->requests.find(args[0]->Uint32Value());
+  if (it == peripheral->requests.end() || peripheral->att == NULL) {
+    return scope.Close(False());
+  }
+
+  // The callback is made with an error, which frees the callback data
+  peripheral->att->cancel(it->second);
+  return scope.Close(True());
+}
+
 // Close the connection
 Handle<Value>
 Peripheral::Close(const Arguments& args)
@@ -523,52 +1120,107 @@ Peripheral::Close(const Arguments& args)
 }
 
 Local<Object>
-Peripheral::getAttributeInfo(Att::AttributeInfo* attribute)
+Peripheral::getAttributeInfo(const Att::AttributeInfo& attribute)
 {
   Local<Object> ret = Object::New();
-  ret->Set(String::New("handle"), Integer::New(attribute->handle));
+  ret->Set(String::New("handle"), Integer::New(attribute.handle));
   char buffer[128];
-  bt_uuid_to_string(&attribute->type, buffer, sizeof(buffer));
+  bt_uuid_to_string(&attribute.type, buffer, sizeof(buffer));
   ret->Set(String::New("type"), String::New(buffer));
 
   return ret;
 }
 
 Local<Object>
-Peripheral::getHandlesInfo(Att::HandlesInfo* attribute)
+Peripheral::getHandlesInfo(const Att::HandlesInfo& attribute)
 {
   Local<Object> ret = Object::New();
-  ret->Set(String::New("handle"), Integer::New(attribute->handle));
-  ret->Set(String::New("groupEndHandle"), Integer::New(attribute->groupEndHandle));
+  ret->Set(String::New("handle"), Integer::New(attribute.handle));
+  ret->Set(String::New("groupEndHandle"), Integer::New(attribute.groupEndHandle));
 
   return ret;
 }
 
 Local<Object>
-Peripheral::getAttributeData(Att::AttributeData* attribute)
+Peripheral::getAttributeData(const Att::AttributeData& attribute)
 {
   Local<Object> ret = Object::New();
-  ret->Set(String::New("handle"), Integer::New(attribute->handle));
-  Buffer* buffer = Buffer::New(attribute->length);
-  memcpy(Buffer::Data(buffer), attribute->data, attribute->length);
+  ret->Set(String::New("handle"), Integer::New(attribute.handle));
+  Buffer* buffer = Buffer::New(attribute.length);
+  memcpy(Buffer::Data(buffer), attribute.data, attribute.length);
   ret->Set(String::New("value"), buffer->handle_);
 
   return ret;
 }
 
 Local<Object>
-Peripheral::getGroupAttributeData(Att::GroupAttributeData* attribute)
+Peripheral::getGroupAttributeData(const Att::GroupAttributeData& attribute)
 {
   Local<Object> ret = Object::New();
-  ret->Set(String::New("handle"), Integer::New(attribute->handle));
-  ret->Set(String::New("groupEndHandle"), Integer::New(attribute->groupEndHandle));
-  Buffer* buffer = Buffer::New(attribute->length);
-  memcpy(Buffer::Data(buffer), attribute->data, attribute->length);
+  ret->Set(String::New("handle"), Integer::New(attribute.handle));
+  ret->Set(String::New("groupEndHandle"), Integer::New(attribute.groupEndHandle));
+  Buffer* buffer = Buffer::New(attribute.length);
+  memcpy(Buffer::Data(buffer), attribute.data, attribute.length);
   ret->Set(String::New("value"), buffer->handle_);
 
   return ret;
 }
 
+Local<String>
+Peripheral::getUUIDString(const bt_uuid_t& uuid)
+{
+  char buffer[128];
+  bt_uuid_to_string(&uuid, buffer, sizeof(buffer));
+  return String::New(buffer);
+}
+
+//
+// Service tree returned by discoverAll(), of the form:
+//  [{handle, endHandle, uuid, characteristics: [
+//    {handle, valueHandle, endHandle, properties, uuid, descriptors: [{handle, type}]}
+//  ]}]
+//
+Local<Array>
+Peripheral::getServiceTree(const GattDiscovery& discovery)
+{
+  Local<Array> services = Array::New(discovery.services.size());
+  for (size_t i = 0; i < discovery.services.size(); i++) {
+    const GattDiscovery::Service& service = discovery.services[i];
+    Local<Object> serviceObj = Object::New();
+    serviceObj->Set(String::New("handle"), Integer::New(service.handle));
+    serviceObj->Set(String::New("endHandle"), Integer::New(service.endHandle));
+    serviceObj->Set(String::New("uuid"), getUUIDString(service.uuid));
+
+    Local<Array> characteristics = Array::New(service.characteristicCount);
+    for (size_t j = 0; j < service.characteristicCount; j++) {
+      const GattDiscovery::Characteristic& characteristic =
+        discovery.characteristics[service.firstCharacteristic + j];
+      Local<Object> charObj = Object::New();
+      charObj->Set(String::New("handle"), Integer::New(characteristic.handle));
+      charObj->Set(String::New("valueHandle"), Integer::New(characteristic.valueHandle));
+      charObj->Set(String::New("endHandle"), Integer::New(characteristic.endHandle));
+      charObj->Set(String::New("properties"), Integer::New(characteristic.properties));
+      charObj->Set(String::New("uuid"), getUUIDString(characteristic.uuid));
+
+      Local<Array> descriptors = Array::New(characteristic.descriptorCount);
+      for (size_t k = 0; k < characteristic.descriptorCount; k++) {
+        const GattDiscovery::Descriptor& descriptor =
+          discovery.descriptors[characteristic.firstDescriptor + k];
+        Local<Object> descObj = Object::New();
+        descObj->Set(String::New("handle"), Integer::New(descriptor.handle));
+        descObj->Set(String::New("type"), getUUIDString(descriptor.type));
+        descriptors->Set(k, descObj);
+      }
+      charObj->Set(String::New("descriptors"), descriptors);
+      characteristics->Set(j, charObj);
+    }
+    serviceObj->Set(String::New("characteristics"), characteristics);
+    services->Set(i, serviceObj);
+  }
+
+  return services;
+}
+
 // Emit an 'error' event
 void
 Peripheral::emit_error()
@@ -605,6 +1257,11 @@ void
 Peripheral::handleConnect(int status, int events)
 {
   if (status == 0) {
+    // Anything issued from the connect callback queues up behind this
+    if (connectMTU != 0) {
+      att->exchangeMTU(connectMTU, onConnectMTU, this);
+    }
+
     if (connectionCallback.IsEmpty()) {
       // Emit a 'connect' event, with this as sole arg
       const int argc = 2;
@@ -632,6 +1289,17 @@ Peripheral::handleConnect(int status, int events)
   }
 }
 
+// Give a request an id, so it can be cancelled
+uint32_t
+Peripheral::trackRequest(struct callbackData* cd)
+{
+  // Zero means untracked
+  if (++lastRequestId == 0) ++lastRequestId;
+  cd->id = lastRequestId;
+  requests[cd->id] = cd;
+  return cd->id;
+}
+
 const char*
 Peripheral::createErrorMessage(uint8_t err)
 {
@@ -649,13 +1317,19 @@ Peripheral::sendError(struct callbackData* cd, uint8_t err, const char* error)
 {
     Persistent<Function> callback = static_cast<Function*>(cd->data);
     const int argc = 2;
+    Local<Value> argv[argc] = { createError(err, error), Local<Value>::New(Null()) };
+    callback->Call(self, argc, argv);
+    delete cd;
+}
+
+Local<Object>
+Peripheral::createError(uint8_t err, const char* error)
+{
     const char* msg = error == NULL ? createErrorMessage(err) : error;
     Local<Object> ret = Object::New();
     ret->Set(String::New("errorCode"), Integer::New(err));
     ret->Set(String::New("errorMessage"), String::New(msg));
-    Local<Value> argv[argc] = { ret, Local<Value>::New(Null()) };
-    callback->Call(self, argc, argv);
-    delete cd;
+    return ret;
 }
 
 // Find Information callback
@@ -681,7 +1355,6 @@ Peripheral::handleFindInformation(uint8_t status, Att::AttributeInfoList& list,
     size_t index = 0;
     while (iter != list.end()) {
       response->Set(index++, getAttributeInfo(*iter));
-      delete *iter;
       ++iter;
     }
     Persistent<Function> callback = static_cast<Function*>(cd->data);
@@ -718,7 +1391,6 @@ Peripheral::handleFindByType(uint8_t status, Att::HandlesInfoList& list, struct
     Att::HandlesInfoList::iterator iter = list.begin();
     while (iter != list.end()) {
       response->Set(index++, getHandlesInfo(*iter));
-      delete *iter;
       ++iter;
     }
     Persistent<Function> callback = static_cast<Function*>(cd->data);
@@ -755,7 +1427,6 @@ Peripheral::handleReadByType(uint8_t status, Att::AttributeDataList& list, struc
     Att::AttributeDataList::iterator iter = list.begin();
     while (iter != list.end()) {
       response->Set(index++, getAttributeData(*iter));
-      delete *iter;
       ++iter;
     }
     Persistent<Function> callback = static_cast<Function*>(cd->data);
@@ -792,7 +1463,6 @@ Peripheral::handleReadByGroupType(uint8_t status, Att::GroupAttributeDataList& l
     Att::GroupAttributeDataList::iterator iter = list.begin();
     while (iter != list.end()) {
       response->Set(index++, getGroupAttributeData(*iter));
-      delete *iter;
       ++iter;
     }
     Persistent<Function> callback = static_cast<Function*>(cd->data);
@@ -812,18 +1482,38 @@ Peripheral::onReadAttribute(uint8_t status, void* data, uint8_t* buf, int len, c
   struct callbackData* cd = static_cast<struct callbackData*>(data);
   Persistent<Function> callback = static_cast<Function*>(cd->data);
   if (status == 0 && error == NULL) {
-    Buffer* buffer = Buffer::New(len);
-    memcpy(Buffer::Data(buffer), buf, len);
     const int argc = 2;
-    Local<Value> argv[argc] = { Local<Value>::New(Null()), Local<Value>::New(buffer->handle_) };
+    Local<Value> argv[argc] = { Local<Value>::New(Null()), BufferSlab::slice(buf, len) };
     callback->Call(cd->peripheral->self, argc, argv);
     delete cd;
+  } else {
+    const int argc = 2;
+    const char* msg = error == NULL ? cd->peripheral->createErrorMessage(status) : error;
+    Local<Value> argv[argc] = { String::New(msg), Local<Value>::New(Null()) };
+    callback->Call(cd->peripheral->self, argc, argv);
+    delete cd;
+  }
+}
+
+// Read long attribute callback. When streaming, this gets called with
+// each chunk, and the offset of the chunk in the value
+void
+Peripheral::onReadLongAttribute(uint8_t status, void* data, uint8_t* buf, int len, size_t offset, bool complete, const char* error)
+{
+  struct callbackData* cd = static_cast<struct callbackData*>(data);
+  Persistent<Function> callback = static_cast<Function*>(cd->data);
+  if (status == 0 && error == NULL) {
+    const int argc = 4;
+    Local<Value> argv[argc] = { Local<Value>::New(Null()), BufferSlab::slice(buf, len),
+                                Integer::New(offset), Local<Value>::New(Boolean::New(complete)) };
+    callback->Call(cd->peripheral->self, argc, argv);
   } else {
     const int argc = 2;
     const char* msg = error == NULL ? cd->peripheral->createErrorMessage(status) : error;
     Local<Value> argv[argc] = { String::New(msg), Local<Value>::New(Null()) };
     callback->Call(cd->peripheral->self, argc, argv);
   }
+  if (complete) delete cd;
 }
 
 // Read notification callback
@@ -832,11 +1522,21 @@ Peripheral::onReadNotification(uint8_t status, void* data, uint8_t* buf, int len
 {
   struct callbackData* cd = static_cast<struct callbackData*>(data);
   Persistent<Function> callback = static_cast<Function*>(cd->data);
-  if (status == 0 && error == NULL) {
-    Buffer* buffer = Buffer::New(len);
-    memcpy(Buffer::Data(buffer), buf, len);
+  if (status == 0 && error == NULL && cd->decoder != NULL) {
+    HandleScope scope;
+    const int argc = 2;
+    Local<Value> value = SigDecoder::decode(*cd->decoder, buf, len, cd->packed);
+    if (value.IsEmpty()) {
+      std::string msg = std::string("Malformed ") + cd->decoder->name + " value";
+      Local<Value> argv[argc] = { cd->peripheral->createError(0, msg.c_str()), Local<Value>::New(Null()) };
+      callback->Call(cd->peripheral->self, argc, argv);
+    } else {
+      Local<Value> argv[argc] = { Local<Value>::New(Null()), value };
+      callback->Call(cd->peripheral->self, argc, argv);
+    }
+  } else if (status == 0 && error == NULL) {
     const int argc = 2;
-    Local<Value> argv[argc] = { Local<Value>::New(Null()), Local<Value>::New(buffer->handle_) };
+    Local<Value> argv[argc] = { Local<Value>::New(Null()), BufferSlab::slice(buf, len) };
     callback->Call(cd->peripheral->self,  argc, argv);
     // NOTE: We don't delete cd here because we reuse it for the notifications
   } else {
@@ -847,6 +1547,119 @@ Peripheral::onReadNotification(uint8_t status, void* data, uint8_t* buf, int len
   }
 }
 
+// Notification for a batched listener - just add it to the batch
+void
+Peripheral::onBatchedNotification(uint8_t status, void* data, uint8_t* buf, int len, const char* error)
+{
+  struct callbackData* cd = static_cast<struct callbackData*>(data);
+  if (status == 0 && error == NULL) {
+    NotificationBatch::add(cd->peripheral->connectionId, cd->startHandle, buf, len);
+  }
+}
+
+// Notification for a ring buffer listener - no call into JS
+void
+Peripheral::onRingNotification(uint8_t status, void* data, uint8_t* buf, int len, const char* error)
+{
+  struct callbackData* cd = static_cast<struct callbackData*>(data);
+  if (status == 0 && error == NULL) {
+    Persistent<Object> ring = static_cast<Object*>(cd->data);
+    NotificationRing::write(Buffer::Data(ring), cd->peripheral->connectionId, cd->startHandle, buf, len);
+  }
+}
+
+// Exchange MTU callback
+void
+Peripheral::onExchangeMTU(uint8_t status, void* data, uint16_t mtu, const char* error)
+{
+  struct callbackData* cd = static_cast<struct callbackData*>(data);
+  if (status == 0 && error == NULL) {
+    Persistent<Function> callback = static_cast<Function*>(cd->data);
+    const int argc = 2;
+    Local<Value> argv[argc] = { Local<Value>::New(Null()), Integer::New(mtu) };
+    callback->Call(cd->peripheral->self, argc, argv);
+    delete cd;
+  } else {
+    cd->peripheral->sendError(cd, status, error);
+  }
+}
+
+// Exchange MTU callback for the exchange done on connect. The device not
+// supporting it isn't an error, we just stay at the default MTU.
+void
+Peripheral::onConnectMTU(uint8_t status, void* data, uint16_t mtu, const char* error)
+{
+  Peripheral* peripheral = (Peripheral*) data;
+  if (debug) printf("Peripheral::onConnectMTU, status = %d, mtu = %d\n", status, mtu);
+  if (status == 0 && error != NULL) {
+    peripheral->emit_error(error);
+  }
+}
+
+// Discover all callback
+void
+Peripheral::onDiscoverAll(uint8_t status, void* data, GattDiscovery* discovery, const char* error)
+{
+  struct callbackData* cd = static_cast<struct callbackData*>(data);
+  if (status == 0 && error == NULL) {
+    cd->peripheral->watchServiceChanged(*discovery);
+    Persistent<Function> callback = static_cast<Function*>(cd->data);
+    const int argc = 2;
+    Local<Value> argv[argc] = { Local<Value>::New(Null()), getServiceTree(*discovery) };
+    callback->Call(cd->peripheral->self, argc, argv);
+    delete cd;
+  } else {
+    cd->peripheral->sendError(cd, status, error);
+  }
+  delete discovery;
+}
+
+//
+// Listen for Service Changed indications, so we know when the layout we've
+// got (possibly from the cache) is out of date
+//
+void
+Peripheral::watchServiceChanged(const GattDiscovery& discovery)
+{
+  if (serviceChangedHandle != 0) return;
+
+  const GattDiscovery::Characteristic* characteristic =
+    discovery.findCharacteristic(GattDiscovery::SERVICE_CHANGED_UUID);
+  if (characteristic == NULL) return;
+
+  serviceChangedHandle = characteristic->valueHandle;
+  att->listenForNotifications(serviceChangedHandle, onServiceChanged, this);
+
+  // Turn on the indications
+  const GattDiscovery::Descriptor* config =
+    discovery.findDescriptor(*characteristic, GattDiscovery::CLIENT_CHAR_CONFIG_UUID);
+  if (config != NULL) {
+    static const uint8_t enableIndications[] = { 0x02, 0x00 };
+    att->writeRequest(config->handle, enableIndications, sizeof(enableIndications));
+  }
+}
+
+// Service Changed indication - drop the cached layout, and emit a
+// 'serviceChanged' event with the affected handle range
+void
+Peripheral::onServiceChanged(uint8_t status, void* data, uint8_t* buf, int len, const char* error)
+{
+  Peripheral* peripheral = (Peripheral*) data;
+  if (status != 0 || error != NULL || len < 4) return;
+
+  GattCache* cache = GattCache::acquire();
+  if (cache != NULL) {
+    cache->invalidate(GattCache::addressKey(peripheral->address));
+    cache->release();
+  }
+
+  const int argc = 3;
+  Local<Value> argv[argc] = { String::New("serviceChanged"),
+                              Integer::New(att_get_u16(&buf[0])),
+                              Integer::New(att_get_u16(&buf[2])) };
+  MakeCallback(peripheral->self, "emit", argc, argv);
+}
+
 // Write callback
 void
 Peripheral::onWrite(void* data, const char* error)
@@ -906,6 +1719,17 @@ Peripheral::onClose(void* data)
   }
 }
 
+// The write queue has drained below the low water mark
+void
+Peripheral::onDrain(void* data)
+{
+  Peripheral* peripheral = (Peripheral*) data;
+
+  const int argc = 1;
+  Local<Value> argv[argc] = { String::New("drain") };
+  MakeCallback(peripheral->self, "emit", argc, argv);
+}
+
 void
 Peripheral::onError(void* data, const char* error)
 {
@@ -921,6 +1745,9 @@ extern "C" void init(Handle<Object> exports)
   Central::Init(exports);
   HCI::Init(exports);
   initDebug(exports);
+  initGattCache(exports);
+  initIOThreads(exports);
+  initNotificationBatch(exports);
 }
 
 NODE_MODULE(btle, init)
@@ -1,9 +1,12 @@
 #ifndef PERIPHERAL_H
 #define PERIPHERAL_H
 
+#include <map>
 #include <node.h>
 
 #include "att.h"
+#include "attProxy.h"
+#include "gattDiscovery.h"
 
 /**
  * Node.js interface class, does all the node.js object wrapping stuff,
@@ -25,18 +28,32 @@ public:
   static v8::Handle<v8::Value> FindByTypeValue(const v8::Arguments& args);
   static v8::Handle<v8::Value> ReadByType(const v8::Arguments& args);
   static v8::Handle<v8::Value> ReadHandle(const v8::Arguments& args);
+  static v8::Handle<v8::Value> ReadLongHandle(const v8::Arguments& args);
   static v8::Handle<v8::Value> ReadByGroupType(const v8::Arguments& args);
   static v8::Handle<v8::Value> AddNotificationListener(const v8::Arguments& args);
   static v8::Handle<v8::Value> WriteCommand(const v8::Arguments& args);
   static v8::Handle<v8::Value> WriteRequest(const v8::Arguments& args);
+  static v8::Handle<v8::Value> WriteLongHandle(const v8::Arguments& args);
+  static v8::Handle<v8::Value> ReliableWrite(const v8::Arguments& args);
+  static v8::Handle<v8::Value> ExchangeMTU(const v8::Arguments& args);
+  static v8::Handle<v8::Value> GetMTU(const v8::Arguments& args);
+  static v8::Handle<v8::Value> GetWriteQueueSize(const v8::Arguments& args);
+  static v8::Handle<v8::Value> GetCachedValue(const v8::Arguments& args);
+  static v8::Handle<v8::Value> DiscoverAll(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Cancel(const v8::Arguments& args);
+  static v8::Handle<v8::Value> GetConnectionId(const v8::Arguments& args);
   static v8::Handle<v8::Value> Close(const v8::Arguments& args);
 
 protected:
   // Convert an attribute object to a Javascript object
-  static v8::Local<v8::Object> getAttributeInfo(Att::AttributeInfo* attribute);
-  static v8::Local<v8::Object> getHandlesInfo(Att::HandlesInfo* attribute);
-  static v8::Local<v8::Object> getAttributeData(Att::AttributeData* attribute);
-  static v8::Local<v8::Object> getGroupAttributeData(Att::GroupAttributeData* attribute);
+  static v8::Local<v8::Object> getAttributeInfo(const Att::AttributeInfo& attribute);
+  static v8::Local<v8::Object> getHandlesInfo(const Att::HandlesInfo& attribute);
+  static v8::Local<v8::Object> getAttributeData(const Att::AttributeData& attribute);
+  static v8::Local<v8::Object> getGroupAttributeData(const Att::GroupAttributeData& attribute);
+
+  // Convert the result of discoverAll() to a Javascript service tree
+  static v8::Local<v8::Array> getServiceTree(const GattDiscovery& discovery);
+  static v8::Local<v8::String> getUUIDString(const bt_uuid_t& uuid);
 
   // Emits an error based on the last error
   void emit_error();
@@ -47,15 +64,24 @@ protected:
   static void onConnect(void* data, int status, int events);
   static void onClose(void* data);
   static void onReadAttribute(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
+  static void onReadLongAttribute(uint8_t status, void* data, uint8_t* buf, int len, size_t offset, bool complete, const char* error);
   static void onReadNotification(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
+  static void onBatchedNotification(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
+  static void onRingNotification(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
   static void onWrite(void* data, const char* error);
   static void onFindInformation(uint8_t status, void* data, void* list, const char* error);
   static void onFindByType(uint8_t status, void* data, void* list, const char* error);
   static void onReadByType(uint8_t status, void* data, void* list, const char* error);
   static void onReadByGroupType(uint8_t status, void* data, void* list, const char* error);
+  static void onExchangeMTU(uint8_t status, void* data, uint16_t mtu, const char* error);
+  static void onConnectMTU(uint8_t status, void* data, uint16_t mtu, const char* error);
+  static void onDiscoverAll(uint8_t status, void* data, GattDiscovery* discovery, const char* error);
+  static void onServiceChanged(uint8_t status, void* data, uint8_t* buf, int len, const char* error);
+  static void onDrain(void* data);
   static void onError(void* data, const char* error);
 
   void handleConnect(int status, int events);
+  void watchServiceChanged(const GattDiscovery& discovery);
   void handleFindInformation(uint8_t status, Att::AttributeInfoList& list, struct callbackData* cd, const char* error);
   void handleFindByType(uint8_t status, Att::HandlesInfoList& list, struct callbackData* cd, const char* error);
   void handleReadByType(uint8_t status, Att::AttributeDataList& list, struct callbackData* cd, const char* error);
@@ -64,18 +90,38 @@ protected:
   // Callback called when we tell v8 to make a reference weak
   static void weak_cb(v8::Persistent<v8::Value> object, void* parameter);
 
+  // Give a request an id, so it can be cancelled
+  uint32_t trackRequest(struct callbackData* cd);
+
   // Translate the error code and return an error
   void sendError(struct callbackData* cd, uint8_t err, const char* error);
 
+  // Create the error object passed to callbacks
+  v8::Local<v8::Object> createError(uint8_t err, const char* error);
+
   const char* createErrorMessage(uint8_t err);
 
 private:
+  friend struct callbackData;
+
   static v8::Persistent<v8::Function> constructor;
 
   v8::Handle<v8::Object> self;
-  Att* att;
+  AttProxy* att;         // Our Att, which may be on an I/O thread
+  uint16_t connectMTU; // MTU to ask for on connect, if any
+  bdaddr_t address;    // Address of the device
+  handle_t serviceChangedHandle; // Service Changed characteristic, once we're listening to it
   v8::Persistent<v8::Function> connectionCallback;
   v8::Persistent<v8::Function> closeCallback;
+
+  // Requests which can still be cancelled, by id
+  typedef std::map<uint32_t, struct callbackData*> RequestMap;
+  RequestMap requests;
+  uint32_t lastRequestId;
+
+  // Identifies the connection in batched notifications
+  uint32_t connectionId;
+  static uint32_t lastConnectionId;
 };
 
 #endif
@@ -0,0 +1,140 @@
+#ifndef RESULT_LIST_H
+#define RESULT_LIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Append-only list of results, stored back to back in pages of memory which
+ * belong to the list. Each entry can carry a variable length value, stored
+ * straight after it in the same page, so a list of 2-byte values costs a
+ * couple of words per entry rather than an allocation each. Everything is
+ * freed along with the list.
+ *
+ * T must be a POD type; entries are returned zeroed.
+ */
+template <typename T>
+class ResultList {
+private:
+  struct Page {
+    Page* next;
+    size_t used;
+    size_t capacity;
+
+    uint8_t* start() { return reinterpret_cast<uint8_t*>(this) + headerSize(); }
+  };
+
+  struct Record {
+    size_t size; // Size of the record, including the value and padding
+    T entry;
+  };
+
+  static const size_t PAGE_SIZE = 4096;
+  static const size_t ALIGNMENT = sizeof(double) > sizeof(void*) ? sizeof(double) : sizeof(void*);
+
+  static size_t align(size_t size) { return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+  static size_t headerSize() { return align(sizeof(Page)); }
+
+public:
+  class iterator {
+  public:
+    iterator() : page(NULL), offset(0) {}
+
+    T& operator*() const { return record()->entry; }
+    T* operator->() const { return &record()->entry; }
+
+    iterator& operator++() {
+      offset += record()->size;
+      if (offset >= page->used) {
+        page = page->next;
+        offset = 0;
+      }
+      return *this;
+    }
+
+    bool operator==(const iterator& other) const { return page == other.page && offset == other.offset; }
+    bool operator!=(const iterator& other) const { return !(*this == other); }
+
+  private:
+    friend class ResultList;
+    iterator(Page* p, size_t o) : page(p), offset(o) {}
+
+    Record* record() const { return reinterpret_cast<Record*>(page->start() + offset); }
+
+    Page* page;
+    size_t offset;
+  };
+
+  ResultList() : first(NULL), last(NULL), lastRecord(NULL), count(0) {}
+
+  ~ResultList() {
+    while (first != NULL) {
+      Page* next = first->next;
+      delete [] reinterpret_cast<uint8_t*>(first);
+      first = next;
+    }
+  }
+
+  //
+  // Add an entry to the end of the list
+  // Arguments:
+  //  valueLength - Space to reserve for the entry's value
+  //  value       - Set to point to the reserved space
+  //
+  T& append(size_t valueLength, uint8_t*& value) {
+    size_t size = align(sizeof(Record)) + align(valueLength);
+    if (last == NULL || last->capacity - last->used < size) {
+      addPage(size);
+    }
+
+    uint8_t* ptr = last->start() + last->used;
+    for (size_t i = 0; i < size; i++) ptr[i] = 0;
+    last->used += size;
+    ++count;
+
+    lastRecord = reinterpret_cast<Record*>(ptr);
+    lastRecord->size = size;
+    value = ptr + align(sizeof(Record));
+    return lastRecord->entry;
+  }
+
+  // Add an entry with no value
+  T& append() {
+    uint8_t* value;
+    return append(0, value);
+  }
+
+  iterator begin() const { return iterator(first, 0); }
+  iterator end() const { return iterator(); }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  T& back() const { return lastRecord->entry; }
+
+private:
+  // Not copyable
+  ResultList(const ResultList&);
+  ResultList& operator=(const ResultList&);
+
+  void addPage(size_t size) {
+    size_t capacity = size > PAGE_SIZE - headerSize() ? size : PAGE_SIZE - headerSize();
+    Page* page = reinterpret_cast<Page*>(new uint8_t[headerSize() + capacity]);
+    page->next = NULL;
+    page->used = 0;
+    page->capacity = capacity;
+    if (last == NULL) {
+      first = page;
+    } else {
+      last->next = page;
+    }
+    last = page;
+  }
+
+  Page* first;
+  Page* last;
+  Record* lastRecord;
+  size_t count;
+};
+
+#endif
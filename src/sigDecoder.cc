@@ -0,0 +1,345 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "sigDecoder.h"
+
+using namespace v8;
+
+v8::Persistent<v8::Function> SigDecoder::float64ArrayConstructor;
+
+static inline uint16_t
+getLE16(const uint8_t* ptr)
+{
+  return ptr[0] | (ptr[1] << 8);
+}
+
+static inline uint32_t
+getLE32(const uint8_t* ptr)
+{
+  return getLE16(ptr) | ((uint32_t) getLE16(ptr + 2) << 16);
+}
+
+//
+// SFLOAT - a 4 bit exponent and 12 bit mantissa, both signed, in 16 bits
+//
+double
+SigDecoder::sfloat(uint16_t raw)
+{
+  int mantissa = raw & 0x0FFF;
+  int exponent = raw >> 12;
+
+  // Special values: NaN, NRes, +INFINITY, reserved, -INFINITY
+  switch (mantissa) {
+    case 0x07FF:
+    case 0x0800:
+    case 0x0801:
+      return NAN;
+    case 0x07FE:
+      return INFINITY;
+    case 0x0802:
+      return -INFINITY;
+  }
+
+  if (mantissa >= 0x0800) mantissa -= 0x1000;
+  if (exponent >= 0x08) exponent -= 0x10;
+  return mantissa * pow(10.0, exponent);
+}
+
+//
+// FLOAT - an 8 bit exponent and 24 bit mantissa, both signed, in 32 bits
+//
+double
+SigDecoder::float32(uint32_t raw)
+{
+  int32_t mantissa = raw & 0x00FFFFFF;
+  int exponent = raw >> 24;
+
+  switch (mantissa) {
+    case 0x007FFFFF:
+    case 0x00800000:
+    case 0x00800001:
+      return NAN;
+    case 0x007FFFFE:
+      return INFINITY;
+    case 0x00800002:
+      return -INFINITY;
+  }
+
+  if (mantissa >= 0x00800000) mantissa -= 0x01000000;
+  if (exponent >= 0x80) exponent -= 0x100;
+  return mantissa * pow(10.0, exponent);
+}
+
+// Date Time characteristic format (year, month, day, hours, minutes,
+// seconds), as milliseconds since the epoch. The device doesn't say which
+// time zone, so we take it as UTC.
+static double
+getDateTime(const uint8_t* ptr)
+{
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = getLE16(ptr) - 1900;
+  tm.tm_mon = ptr[2] - 1;
+  tm.tm_mday = ptr[3];
+  tm.tm_hour = ptr[4];
+  tm.tm_min = ptr[5];
+  tm.tm_sec = ptr[6];
+  if (getLE16(ptr) == 0 || ptr[2] == 0 || ptr[3] == 0) return NAN;  // Not known
+  return timegm(&tm) * 1000.0;
+}
+
+static const size_t DATE_TIME_SIZE = 7;
+
+// Heart Rate Measurement (0x2A37)
+static const char* const heartRateFields[] = { "heartRate", "sensorContact", "energyExpended", NULL };
+
+static bool
+decodeHeartRate(const uint8_t* value, size_t length, std::vector<double>& fields)
+{
+  if (length < 2) return false;
+  uint8_t flags = value[0];
+  size_t pos = 1;
+
+  if (flags & 0x01) {
+    if (length < pos + 2) return false;
+    fields.push_back(getLE16(&value[pos]));
+    pos += 2;
+  } else {
+    fields.push_back(value[pos++]);
+  }
+
+  // Contact status only means anything if it's supported
+  fields.push_back((flags & 0x04) ? ((flags & 0x02) ? 1 : 0) : NAN);
+
+  if (flags & 0x08) {
+    if (length < pos + 2) return false;
+    fields.push_back(getLE16(&value[pos]));
+    pos += 2;
+  } else {
+    fields.push_back(NAN);
+  }
+
+  // RR intervals, in seconds, as many as there are
+  if (flags & 0x10) {
+    for (; pos + 2 <= length; pos += 2) {
+      fields.push_back(getLE16(&value[pos]) / 1024.0);
+    }
+  }
+
+  return true;
+}
+
+// Temperature Measurement (0x2A1C) and Intermediate Temperature (0x2A1E)
+static const char* const temperatureFields[] = { "temperature", "fahrenheit", "timestamp", "temperatureType", NULL };
+
+static bool
+decodeTemperature(const uint8_t* value, size_t length, std::vector<double>& fields)
+{
+  if (length < 5) return false;
+  uint8_t flags = value[0];
+  size_t pos = 5;
+
+  fields.push_back(SigDecoder::float32(getLE32(&value[1])));
+  fields.push_back((flags & 0x01) ? 1 : 0);
+
+  if (flags & 0x02) {
+    if (length < pos + DATE_TIME_SIZE) return false;
+    fields.push_back(getDateTime(&value[pos]));
+    pos += DATE_TIME_SIZE;
+  } else {
+    fields.push_back(NAN);
+  }
+
+  if (flags & 0x04) {
+    if (length < pos + 1) return false;
+    fields.push_back(value[pos]);
+  } else {
+    fields.push_back(NAN);
+  }
+
+  return true;
+}
+
+// Blood Pressure Measurement (0x2A35)
+static const char* const bloodPressureFields[] = { "systolic", "diastolic", "meanArterialPressure", "kPa",
+  "timestamp", "pulseRate", "userId", "measurementStatus", NULL };
+
+static bool
+decodeBloodPressure(const uint8_t* value, size_t length, std::vector<double>& fields)
+{
+  if (length < 7) return false;
+  uint8_t flags = value[0];
+  size_t pos = 7;
+
+  fields.push_back(SigDecoder::sfloat(getLE16(&value[1])));
+  fields.push_back(SigDecoder::sfloat(getLE16(&value[3])));
+  fields.push_back(SigDecoder::sfloat(getLE16(&value[5])));
+  fields.push_back((flags & 0x01) ? 1 : 0);
+
+  if (flags & 0x02) {
+    if (length < pos + DATE_TIME_SIZE) return false;
+    fields.push_back(getDateTime(&value[pos]));
+    pos += DATE_TIME_SIZE;
+  } else {
+    fields.push_back(NAN);
+  }
+
+  if (flags & 0x04) {
+    if (length < pos + 2) return false;
+    fields.push_back(SigDecoder::sfloat(getLE16(&value[pos])));
+    pos += 2;
+  } else {
+    fields.push_back(NAN);
+  }
+
+  if (flags & 0x08) {
+    if (length < pos + 1) return false;
+    fields.push_back(value[pos++]);
+  } else {
+    fields.push_back(NAN);
+  }
+
+  if (flags & 0x10) {
+    if (length < pos + 2) return false;
+    fields.push_back(getLE16(&value[pos]));
+  } else {
+    fields.push_back(NAN);
+  }
+
+  return true;
+}
+
+// CSC Measurement (0x2A5B). Event times are in seconds, wrapping at 64.
+static const char* const cscFields[] = { "wheelRevolutions", "lastWheelEventTime",
+  "crankRevolutions", "lastCrankEventTime", NULL };
+
+static bool
+decodeCSC(const uint8_t* value, size_t length, std::vector<double>& fields)
+{
+  if (length < 1) return false;
+  uint8_t flags = value[0];
+  size_t pos = 1;
+
+  if (flags & 0x01) {
+    if (length < pos + 6) return false;
+    fields.push_back(getLE32(&value[pos]));
+    fields.push_back(getLE16(&value[pos + 4]) / 1024.0);
+    pos += 6;
+  } else {
+    fields.push_back(NAN);
+    fields.push_back(NAN);
+  }
+
+  if (flags & 0x02) {
+    if (length < pos + 4) return false;
+    fields.push_back(getLE16(&value[pos]));
+    fields.push_back(getLE16(&value[pos + 2]) / 1024.0);
+  } else {
+    fields.push_back(NAN);
+    fields.push_back(NAN);
+  }
+
+  return true;
+}
+
+// Battery Level (0x2A19)
+static const char* const batteryFields[] = { "batteryLevel", NULL };
+
+static bool
+decodeBattery(const uint8_t* value, size_t length, std::vector<double>& fields)
+{
+  if (length < 1) return false;
+  fields.push_back(value[0]);
+  return true;
+}
+
+const SigDecoder::Decoder SigDecoder::decoders[] = {
+  { 0x2A19, "Battery Level", decodeBattery, batteryFields, NULL },
+  { 0x2A1C, "Temperature Measurement", decodeTemperature, temperatureFields, NULL },
+  { 0x2A1E, "Intermediate Temperature", decodeTemperature, temperatureFields, NULL },
+  { 0x2A35, "Blood Pressure Measurement", decodeBloodPressure, bloodPressureFields, NULL },
+  { 0x2A37, "Heart Rate Measurement", decodeHeartRate, heartRateFields, "rrIntervals" },
+  { 0x2A5B, "CSC Measurement", decodeCSC, cscFields, NULL },
+  { 0, NULL, NULL, NULL, NULL }
+};
+
+const SigDecoder::Decoder*
+SigDecoder::find(const bt_uuid_t& uuid)
+{
+  for (const Decoder* decoder = decoders; decoder->decode != NULL; decoder++) {
+    bt_uuid_t u;
+    bt_uuid16_create(&u, decoder->uuid);
+    if (bt_uuid_cmp(&u, &uuid) == 0) return decoder;
+  }
+  return NULL;
+}
+
+//
+// Decode a value
+// Arguments:
+//  decoder - The decoder for the characteristic
+//  value   - The value
+//  length  - Its length
+//  packed  - Whether to return a Float64Array rather than an object
+//
+Local<Value>
+SigDecoder::decode(const Decoder& decoder, const uint8_t* value, size_t length, bool packed)
+{
+  HandleScope scope;
+
+  std::vector<double> fields;
+  if (value == NULL || !decoder.decode(value, length, fields)) {
+    return Local<Value>();
+  }
+
+  if (packed) {
+    return scope.Close(toFloat64Array(fields));
+  }
+  return scope.Close(toObject(decoder, fields));
+}
+
+Local<Object>
+SigDecoder::toObject(const Decoder& decoder, const std::vector<double>& fields)
+{
+  HandleScope scope;
+  Local<Object> obj = Object::New();
+
+  size_t i = 0;
+  for (; decoder.fields[i] != NULL; i++) {
+    if (!isnan(fields[i])) {
+      obj->Set(String::NewSymbol(decoder.fields[i]), Number::New(fields[i]));
+    }
+  }
+
+  if (decoder.list != NULL) {
+    Local<Array> list = Array::New(fields.size() - i);
+    for (size_t j = 0; i < fields.size(); i++, j++) {
+      list->Set(j, Number::New(fields[i]));
+    }
+    obj->Set(String::NewSymbol(decoder.list), list);
+  }
+
+  return scope.Close(obj);
+}
+
+// Float64Arrays are backed by external memory, which we fill in directly
+Local<Object>
+SigDecoder::toFloat64Array(const std::vector<double>& fields)
+{
+  HandleScope scope;
+
+  if (float64ArrayConstructor.IsEmpty()) {
+    Local<Value> constructor = Context::GetCurrent()->Global()->Get(String::NewSymbol("Float64Array"));
+    float64ArrayConstructor = Persistent<Function>::New(Local<Function>::Cast(constructor));
+  }
+
+  const int argc = 1;
+  Handle<Value> argv[argc] = { Integer::NewFromUnsigned(fields.size()) };
+  Local<Object> array = float64ArrayConstructor->NewInstance(argc, argv);
+  if (!fields.empty()) {
+    memcpy(array->GetIndexedPropertiesExternalArrayData(), &fields[0], fields.size() * sizeof(double));
+  }
+
+  return scope.Close(array);
+}
@@ -0,0 +1,51 @@
+#ifndef SIG_DECODER_H
+#define SIG_DECODER_H
+
+#include <vector>
+#include <node.h>
+
+#include "uuid.h"
+
+/*
+ * Decoders for the values of standard Bluetooth SIG characteristics, so
+ * notifications from the common profiles arrive in JS already parsed. Each
+ * decoder turns a value into a list of numbers: a fixed set of named fields,
+ * NaN where a field isn't in the value, and for some characteristics a
+ * variable length list after them (like heart rate RR intervals).
+ *
+ * In JS that's either an object, with the fields which are present and the
+ * list as an array, or a Float64Array of all of them.
+ */
+class SigDecoder {
+public:
+  // Decode a value into fields. Returns false if it's malformed.
+  typedef bool (*DecodeFunction)(const uint8_t* value, size_t length, std::vector<double>& fields);
+
+  struct Decoder {
+    uint16_t uuid;
+    const char* name;
+    DecodeFunction decode;
+    const char* const* fields; // Names of the fixed fields, NULL terminated
+    const char* list;          // Name of the list after them, if there is one
+  };
+
+  // Find the decoder for a characteristic. Returns NULL if there isn't one.
+  static const Decoder* find(const bt_uuid_t& uuid);
+
+  // Decode a value, returning an object or a Float64Array, or an empty
+  // handle if it's malformed
+  static v8::Local<v8::Value> decode(const Decoder& decoder, const uint8_t* value, size_t length, bool packed);
+
+  // IEEE-11073 numbers, as used by the health profiles
+  static double sfloat(uint16_t raw);
+  static double float32(uint32_t raw);
+
+private:
+  static v8::Local<v8::Object> toObject(const Decoder& decoder, const std::vector<double>& fields);
+  static v8::Local<v8::Object> toFloat64Array(const std::vector<double>& fields);
+
+  static const Decoder decoders[];
+  static v8::Persistent<v8::Function> float64ArrayConstructor;
+};
+
+#endif
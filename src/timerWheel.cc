@@ -0,0 +1,161 @@
+#include <map>
+#include <pthread.h>
+
+#include "timerWheel.h"
+
+// Wheels by loop, as for BufferPool
+typedef std::map<uv_loop_t*, TimerWheel*> WheelMap;
+static WheelMap wheels;
+static pthread_mutex_t wheelsLock = PTHREAD_MUTEX_INITIALIZER;
+
+TimerWheel*
+TimerWheel::get(uv_loop_t* loop)
+{
+  pthread_mutex_lock(&wheelsLock);
+  TimerWheel*& wheel = wheels[loop];
+  if (wheel == NULL) {
+    wheel = new TimerWheel(loop);
+  }
+  pthread_mutex_unlock(&wheelsLock);
+  return wheel;
+}
+
+TimerWheel::TimerWheel(uv_loop_t* loop)
+  : loop(loop), epoch(uv_now(loop)), currentTick(0), count(0)
+{
+  for (int level = 0; level < LEVELS; level++) {
+    for (uint64_t slot = 0; slot < SLOTS; slot++) {
+      slots[level][slot].next = slots[level][slot].prev = &slots[level][slot];
+    }
+  }
+
+  // The timer only ticks while something's waiting on it, and even then it
+  // doesn't keep the loop alive - whatever the timeout is for should do that
+  timer = new uv_timer_t;
+  timer->data = this;
+  uv_timer_init(loop, timer);
+  uv_unref((uv_handle_t*) timer);
+}
+
+uint64_t
+TimerWheel::now() const
+{
+  return (uv_now(loop) - epoch) / TICK;
+}
+
+//
+// Start a timer
+// Arguments:
+//  timer    - The timer
+//  timeout  - Milliseconds until it fires
+//  callback - Called when it fires
+//  data     - Callback data
+//
+void
+TimerWheel::start(Timer& t, uint64_t timeout, Callback callback, void* data)
+{
+  stop(t);
+
+  if (count == 0) {
+    // Nothing's been ticking, so catch up
+    currentTick = now();
+    uv_timer_start(timer, onTick, TICK, TICK);
+  }
+
+  // Round up, so we never fire early. The wheel may be running behind the
+  // loop's clock, so count from whichever is later.
+  uint64_t tick = now();
+  if (tick < currentTick) tick = currentTick;
+  t.expiry = tick + (timeout + TICK - 1) / TICK;
+  t.callback = callback;
+  t.data = data;
+  add(t);
+  count++;
+}
+
+void
+TimerWheel::stop(Timer& t)
+{
+  if (!t.active()) return;
+
+  unlink(t);
+  if (--count == 0) {
+    uv_timer_stop(timer);
+  }
+}
+
+void
+TimerWheel::add(Timer& t)
+{
+  // Pick the lowest level whose span covers the time left. Anything beyond
+  // the top level goes in its furthest slot, and gets cascaded back round.
+  uint64_t delta = t.expiry > currentTick ? t.expiry - currentTick : 0;
+  int level = 0;
+  while (level < LEVELS - 1 && delta >= ((uint64_t) 1 << (SLOT_BITS * (level + 1)))) {
+    level++;
+  }
+
+  uint64_t slot;
+  if (delta >> (SLOT_BITS * LEVELS) != 0) {
+    slot = ((currentTick >> (SLOT_BITS * level)) - 1) & SLOT_MASK;
+  } else {
+    slot = (t.expiry >> (SLOT_BITS * level)) & SLOT_MASK;
+  }
+
+  Timer& head = slots[level][slot];
+  t.prev = head.prev;
+  t.next = &head;
+  head.prev->next = &t;
+  head.prev = &t;
+}
+
+void
+TimerWheel::unlink(Timer& t)
+{
+  t.prev->next = t.next;
+  t.next->prev = t.prev;
+  t.next = t.prev = NULL;
+}
+
+void
+TimerWheel::cascade(int level, uint64_t slot)
+{
+  Timer& head = slots[level][slot];
+  while (head.next != &head) {
+    Timer* t = head.next;
+    unlink(*t);
+    add(*t);
+  }
+}
+
+void
+TimerWheel::onTick(uv_timer_t* handle, int status)
+{
+  TimerWheel* wheel = (TimerWheel*) handle->data;
+  wheel->advance(wheel->now());
+}
+
+void
+TimerWheel::advance(uint64_t tick)
+{
+  while (currentTick < tick && count > 0) {
+    currentTick++;
+
+    // When a level wraps, the next slot up comes down to it
+    for (int level = 1; level < LEVELS; level++) {
+      uint64_t span = (uint64_t) 1 << (SLOT_BITS * level);
+      if ((currentTick & (span - 1)) != 0) break;
+      cascade(level, (currentTick >> (SLOT_BITS * level)) & SLOT_MASK);
+    }
+
+    // Callbacks can start and stop timers, so take them off one at a time
+    Timer& head = slots[0][currentTick & SLOT_MASK];
+    while (head.next != &head) {
+      Timer* t = head.next;
+      stop(*t);
+      t->callback(t->data);
+    }
+  }
+
+  // If we stopped early because the wheel's empty, the next start() catches up
+}
@@ -0,0 +1,83 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <uv.h>
+
+/*
+ * Hierarchical timer wheel, shared by all the connections on a loop, for
+ * timeouts which almost never fire - like ATT transaction timeouts. Starting
+ * and stopping a timer is constant time, and however many are running, the
+ * loop only has the one uv_timer, which only runs while there are timers in
+ * the wheel.
+ *
+ * Timers have a resolution of one tick, and may fire up to a tick late.
+ *
+ * A wheel must only be used from the thread running its loop.
+ */
+class TimerWheel {
+public:
+  typedef void (*Callback)(void* data);
+
+  // Resolution, in milliseconds
+  static const uint64_t TICK = 100;
+
+  // A timer. These belong to the user, and are linked into the wheel while
+  // they're running, so they must be stopped before they're freed.
+  struct Timer {
+    Timer() : next(NULL), prev(NULL), expiry(0), callback(NULL), data(NULL) {}
+
+    bool active() const { return next != NULL; }
+
+    Timer* next;
+    Timer* prev;
+    uint64_t expiry;   // Tick it fires on
+    Callback callback;
+    void* data;
+  };
+
+  // Get the wheel for a loop, creating it if needed
+  static TimerWheel* get(uv_loop_t* loop);
+
+  // Start a timer, restarting it if it's already running
+  void start(Timer& timer, uint64_t timeout, Callback callback, void* data);
+
+  // Stop a timer. Does nothing if it isn't running
+  void stop(Timer& timer);
+
+private:
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 6;
+  static const uint64_t SLOTS = 1 << SLOT_BITS;
+  static const uint64_t SLOT_MASK = SLOTS - 1;
+
+  TimerWheel(uv_loop_t* loop);
+
+  // Never destroyed, or copied
+  ~TimerWheel();
+  TimerWheel(const TimerWheel&);
+  TimerWheel& operator=(const TimerWheel&);
+
+  static void onTick(uv_timer_t* handle, int status);
+
+  // Current tick, from the loop's idea of the time
+  uint64_t now() const;
+  // Link a timer into the slot for its expiry
+  void add(Timer& timer);
+  static void unlink(Timer& timer);
+  // Move the timers in a slot down to the levels below
+  void cascade(int level, uint64_t slot);
+  // Fire everything due up to the given tick
+  void advance(uint64_t tick);
+
+  uv_loop_t* loop;
+  uv_timer_t* timer;
+  uint64_t epoch;          // Loop time of tick zero
+  uint64_t currentTick;    // Last tick we've fired the timers for
+  size_t count;            // Running timers
+
+  // Each slot is a circular list, with a dummy timer as its head. Level n
+  // slots each cover SLOTS^n ticks.
+  Timer slots[LEVELS][SLOTS];
+};
+
+#endif
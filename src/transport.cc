@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "transport.h"
+
+//
+// L2CAP transport - the bluetooth socket, set up by btio
+//
+int
+L2CAPTransport::connect()
+{
+  return bt_io_connect(&opts);
+}
+
+int
+L2CAPTransport::listen()
+{
+  return bt_io_listen(&opts);
+}
+
+void
+L2CAPTransport::getInfo(int sock, Info& info)
+{
+  memset(&info, 0, sizeof(info));
+  bt_io_get(sock,
+    BT_IO_OPT_SOURCE_BDADDR, &info.src,
+    BT_IO_OPT_DEST, info.dst,
+    BT_IO_OPT_CID, &info.cid,
+    BT_IO_OPT_IMTU, &info.imtu,
+    BT_IO_OPT_INVALID);
+}
+
+//
+// Unix domain socket transport
+//
+int
+UnixTransport::createSocket()
+{
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sock < 0) return -1;
+
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+    int err = errno;
+    ::close(sock);
+    errno = err;
+    return -1;
+  }
+
+  return sock;
+}
+
+int
+UnixTransport::connect()
+{
+  int sock = createSocket();
+  if (sock < 0) return -1;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  if (::connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+    int err = errno;
+    ::close(sock);
+    errno = err;
+    return -1;
+  }
+
+  return sock;
+}
+
+int
+UnixTransport::listen()
+{
+  int sock = createSocket();
+  if (sock < 0) return -1;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  // Clear out any socket left over from last time
+  unlink(path.c_str());
+
+  if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 || ::listen(sock, 5) < 0) {
+    int err = errno;
+    ::close(sock);
+    errno = err;
+    return -1;
+  }
+
+  return sock;
+}
+
+void
+UnixTransport::getInfo(int sock, Info& info)
+{
+  memset(&info, 0, sizeof(info));
+  strncpy(info.dst, path.c_str(), sizeof(info.dst) - 1);
+  info.cid = ATT_CID;
+  info.imtu = MTU;
+}
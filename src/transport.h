@@ -0,0 +1,69 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <string>
+#include <bluetooth/bluetooth.h>
+
+#include "btio.h"
+
+/*
+ * The socket underneath a connection. Connection and Central only need a
+ * connected SOCK_SEQPACKET socket carrying ATT PDUs, so the transport just
+ * has to create one, and tell them about it.
+ *
+ * L2CAPTransport is the real thing. UnixTransport uses an AF_UNIX
+ * SOCK_SEQPACKET socket instead, so the client and server sides can be run
+ * against each other locally, with no Bluetooth hardware.
+ */
+class Transport {
+public:
+  // Connection parameters
+  struct Info {
+    bdaddr_t src;
+    char dst[256];
+    uint16_t cid;
+    uint16_t imtu;
+  };
+
+  virtual ~Transport() {}
+
+  // Start connecting, returning the socket, or -1 with errno set
+  virtual int connect() = 0;
+
+  // Create a listening socket, returning it, or -1 with errno set
+  virtual int listen() = 0;
+
+  // Get the parameters for a connected socket
+  virtual void getInfo(int sock, Info& info) = 0;
+};
+
+class L2CAPTransport : public Transport {
+public:
+  L2CAPTransport(const struct set_opts& opts) : opts(opts) {}
+
+  virtual int connect();
+  virtual int listen();
+  virtual void getInfo(int sock, Info& info);
+
+private:
+  struct set_opts opts;
+};
+
+class UnixTransport : public Transport {
+public:
+  // MTU we claim for a local socket - enough for any attribute value
+  static const uint16_t MTU = ATT_MAX_VALUE_LEN + 5;
+
+  UnixTransport(const char* path) : path(path) {}
+
+  virtual int connect();
+  virtual int listen();
+  virtual void getInfo(int sock, Info& info);
+
+private:
+  int createSocket();
+
+  std::string path;
+};
+
+#endif
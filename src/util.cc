@@ -4,11 +4,15 @@
 #include <bluetooth/l2cap.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
+#include <node_buffer.h>
 
 #include "util.h"
 #include "btio.h"
+#include "transport.h"
+#include "notificationRing.h"
 
 using namespace v8;
+using node::Buffer;
 
 static char stringBuffer[1024];
 const char* getStringValue(Local<String> string)
@@ -313,3 +317,217 @@ void printBuffer(const char* data, size_t len) {
     printf("%02X", data[i]);
   }
 }
+
+Transport* getTransport(const struct set_opts& opts, Local<Object> options, const std::string& destination)
+{
+  Handle<String> key = getKey("transport");
+  if (!options->Has(key)) {
+    return new L2CAPTransport(opts);
+  }
+
+  Local<Value> value = options->Get(key);
+  if (!value->IsString()) {
+    ThrowException(Exception::TypeError(String::New("Transport option must be 'l2cap' or 'unix'")));
+    return NULL;
+  }
+
+  std::string transport = getStringValue(value->ToString());
+  if (transport == "l2cap") {
+    return new L2CAPTransport(opts);
+  } else if (transport == "unix") {
+    std::string path = destination;
+    key = getKey("path");
+    if (options->Has(key)) {
+      value = options->Get(key);
+      if (!value->IsString()) {
+        ThrowException(Exception::TypeError(String::New("Path option must be a string")));
+        return NULL;
+      }
+      path = getStringValue(value->ToString());
+    }
+    if (path.empty()) {
+      ThrowException(Exception::TypeError(String::New("Unix transport needs a socket path")));
+      return NULL;
+    }
+    return new UnixTransport(path.c_str());
+  }
+
+  ThrowException(Exception::TypeError(String::New("Transport option must be 'l2cap' or 'unix'")));
+  return NULL;
+}
+
+bool getRequestTimeout(Local<Object> options, uint64_t& timeout)
+{
+  Handle<String> key = getKey("timeout");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsUint32() || value->Uint32Value() == 0) {
+      ThrowException(Exception::TypeError(String::New("Timeout option must be a positive number of milliseconds")));
+      return false;
+    }
+    timeout = value->Uint32Value();
+  }
+  return true;
+}
+
+bool getWaterMarks(Local<Object> options, size_t& highWaterMark, size_t& lowWaterMark)
+{
+  Handle<String> key = getKey("highWaterMark");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsUint32() || value->Uint32Value() == 0) {
+      ThrowException(Exception::TypeError(String::New("HighWaterMark option must be a positive integer")));
+      return false;
+    }
+    highWaterMark = value->Uint32Value();
+  }
+
+  key = getKey("lowWaterMark");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsUint32()) {
+      ThrowException(Exception::TypeError(String::New("LowWaterMark option must be a non-negative integer")));
+      return false;
+    }
+    lowWaterMark = value->Uint32Value();
+  }
+
+  if (lowWaterMark > highWaterMark) {
+    ThrowException(Exception::TypeError(String::New("LowWaterMark option must not be more than highWaterMark")));
+    return false;
+  }
+
+  return true;
+}
+
+//
+// Read the notification filter options
+// Arguments:
+//  options - The options object
+//  filter  - Where to put the filter
+//
+bool getNotificationFilter(Local<Object> options, NotificationFilter::Options& filter)
+{
+  Handle<String> key = getKey("mask");
+  Handle<String> matchKey = getKey("match");
+  if (options->Has(matchKey)) {
+    Local<Value> match = options->Get(matchKey);
+    if (!Buffer::HasInstance(match)) {
+      ThrowException(Exception::TypeError(String::New("Match option must be a buffer")));
+      return false;
+    }
+    const uint8_t* data = (const uint8_t*) Buffer::Data(match);
+    filter.match.assign(data, data + Buffer::Length(match));
+
+    if (options->Has(key)) {
+      Local<Value> mask = options->Get(key);
+      if (!Buffer::HasInstance(mask) || Buffer::Length(mask) != filter.match.size()) {
+        ThrowException(Exception::TypeError(String::New("Mask option must be a buffer the same length as match")));
+        return false;
+      }
+      data = (const uint8_t*) Buffer::Data(mask);
+      filter.mask.assign(data, data + Buffer::Length(mask));
+    } else {
+      filter.mask.assign(filter.match.size(), 0xFF);
+    }
+
+    // Bits outside the mask can't be matched
+    for (size_t i = 0; i < filter.mask.size(); i++) {
+      filter.match[i] &= filter.mask[i];
+    }
+  } else if (options->Has(key)) {
+    ThrowException(Exception::TypeError(String::New("Mask option needs a match option")));
+    return false;
+  }
+
+  key = getKey("changedOnly");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsBoolean()) {
+      ThrowException(Exception::TypeError(String::New("ChangedOnly option must be true or false")));
+      return false;
+    }
+    filter.changedOnly = value->BooleanValue();
+  }
+
+  key = getKey("every");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsUint32() || value->Uint32Value() == 0) {
+      ThrowException(Exception::TypeError(String::New("Every option must be a positive integer")));
+      return false;
+    }
+    filter.every = value->Uint32Value();
+  }
+
+  key = getKey("maxRate");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsUint32() || value->Uint32Value() == 0) {
+      ThrowException(Exception::TypeError(String::New("MaxRate option must be a positive number of notifications per second")));
+      return false;
+    }
+    filter.maxRate = value->Uint32Value();
+  }
+
+  return true;
+}
+
+//
+// Read the options for decoding notifications
+// Arguments:
+//  options - The options object
+//  decoder - Where to put the decoder
+//  packed  - Where to put whether to decode into a Float64Array
+//
+bool getSigDecoder(Local<Object> options, const SigDecoder::Decoder*& decoder, bool& packed)
+{
+  decoder = NULL;
+  packed = false;
+
+  Handle<String> key = getKey("decode");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    bt_uuid_t uuid;
+    if (value->IsUint32() && value->Uint32Value() <= 0xFFFF) {
+      bt_uuid16_create(&uuid, value->Uint32Value());
+    } else if (!value->IsString() || bt_string_to_uuid(&uuid, getStringValue(value->ToString())) < 0) {
+      ThrowException(Exception::TypeError(String::New("Decode option must be a characteristic UUID")));
+      return false;
+    }
+    decoder = SigDecoder::find(uuid);
+    if (decoder == NULL) {
+      ThrowException(Exception::TypeError(String::New("No decoder for the characteristic in the decode option")));
+      return false;
+    }
+  }
+
+  key = getKey("packed");
+  if (options->Has(key)) {
+    Local<Value> value = options->Get(key);
+    if (!value->IsBoolean()) {
+      ThrowException(Exception::TypeError(String::New("Packed option must be true or false")));
+      return false;
+    }
+    packed = value->BooleanValue();
+  }
+
+  return true;
+}
+
+//
+// Get the buffer of a NotificationRing object, which is what the native side
+// writes into
+// Arguments:
+//  value - The value, which is returned as it is if it isn't a ring object
+//
+Local<Value> getRingBuffer(Local<Value> value)
+{
+  if (!value->IsObject() || value->IsFunction() || Buffer::HasInstance(value)) return value;
+
+  Local<Value> buffer = value->ToObject()->Get(getKey("buffer"));
+  if (!Buffer::HasInstance(buffer) || !NotificationRing::isValid(Buffer::Data(buffer), Buffer::Length(buffer))) {
+    return value;
+  }
+  return buffer;
+}
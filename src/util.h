@@ -1,14 +1,43 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <string>
 #include <unistd.h>
 #include <node.h>
 
+#include "notificationFilter.h"
+#include "sigDecoder.h"
+
 void printBuffer(const char* data, size_t len);
 
 bool setOpts(struct set_opts& opts, v8::Local<v8::String> destination, v8::Local<v8::Object> options);
 bool setOpts(struct set_opts& opts, v8::Local<v8::Object> options);
 
+// Create the transport given by the "transport" option. Destination is used as
+// the path for a unix transport if there's no "path" option.
+class Transport;
+Transport* getTransport(const struct set_opts& opts, v8::Local<v8::Object> options,
+  const std::string& destination = std::string());
+
+// Read the "highWaterMark" and "lowWaterMark" write queue options, leaving
+// the values as they are if the options aren't given
+bool getWaterMarks(v8::Local<v8::Object> options, size_t& highWaterMark, size_t& lowWaterMark);
+
+// Read a request's "timeout" option, in milliseconds, leaving the value as it
+// is if the option isn't given
+bool getRequestTimeout(v8::Local<v8::Object> options, uint64_t& timeout);
+
+// Read the notification filter options ("mask", "match", "changedOnly",
+// "every" and "maxRate")
+bool getNotificationFilter(v8::Local<v8::Object> options, NotificationFilter::Options& filter);
+
+// Read the "decode" and "packed" options, leaving decoder NULL if there's no
+// "decode" option
+bool getSigDecoder(v8::Local<v8::Object> options, const SigDecoder::Decoder*& decoder, bool& packed);
+
+// The buffer of a NotificationRing object, or the value itself if it isn't one
+v8::Local<v8::Value> getRingBuffer(v8::Local<v8::Value> value);
+
 v8::Handle<v8::String> getKey(const char* value);
 
 bool getSourceAddr(v8::Handle<v8::String> key, v8::Local<v8::Object> options, struct set_opts& opts);
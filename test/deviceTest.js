@@ -0,0 +1,93 @@
+// Helpers for the tests which run a Peripheral against a fake device, over
+// the unix socket transport
+var assert = require('assert');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var btle = require('../lib/btle');
+var FakeDevice = require('./fakeDevice');
+
+var tmpCount = 0;
+var tmpPath = module.exports.tmpPath = function(name) {
+  return path.join(os.tmpdir(), 'btle-test-' + process.pid + '-' + (tmpCount++) + '-' + name);
+}
+
+var unlink = module.exports.unlink = function(file) {
+  try {
+    fs.unlinkSync(file);
+  } catch (e) {
+  }
+}
+
+// Errors come back as strings, error objects or exceptions, depending on the call
+module.exports.errorText = function(err) {
+  if (typeof err == 'string') return err;
+  return err.errorMessage || err.message;
+}
+
+// Every test uses the same path, so the device's address - which is what
+// the GATT cache goes by - is the same each time
+var socketPath = tmpPath('sock');
+
+//
+// Start a fake device, connect to it, and call back with both once they're
+// connected. Requests time out after 2 seconds unless the options say
+// otherwise, so a response which never comes fails the test.
+//
+module.exports.connect = function(options, callback) {
+  var fake = null;
+  var device = null;
+
+  function ready() {
+    if (fake && device) {
+      unlink(socketPath);
+      callback(fake, device);
+    }
+  }
+
+  new FakeDevice(socketPath, function(err, result) {
+    assert.ifError(err);
+    fake = result;
+    ready();
+  });
+
+  options.transport = btle.Transports.UNIX;
+  if (options.requestTimeout === undefined) options.requestTimeout = 2000;
+  btle.connect(socketPath, options, function(err, result) {
+    assert.ifError(err);
+    device = result;
+    ready();
+  });
+}
+
+module.exports.finish = function(fake, device, done) {
+  device.close();
+  fake.close();
+  setTimeout(done, 10);
+}
+
+// Run the tests one after the other, each of which takes a done callback
+module.exports.run = function(tests) {
+  var testCount = tests.length;
+  var passed = 0;
+
+  function next() {
+    var test = tests.shift();
+    if (test == null) {
+      console.log('Success!');
+      // The native side keeps some handles open, which would keep us running
+      process.exit(0);
+    }
+    test(function() {
+      passed++;
+      next();
+    });
+  }
+
+  // Catch a test which never calls back
+  setTimeout(function() {
+    assert.fail(passed, testCount, 'Timed out after ' + passed + ' of ' + testCount + ' tests', '<');
+  }, 30000);
+
+  next();
+}
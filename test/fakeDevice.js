@@ -0,0 +1,323 @@
+// A fake device for the tests: a Central, listening on a unix socket, with a
+// small GATT database behind it which it serves ATT requests from.
+var btle = require('../lib/btle');
+
+var Opcodes = {
+  ERROR            : 0x01,
+  MTU_REQ          : 0x02,
+  MTU_RESP         : 0x03,
+  FIND_INFO_REQ    : 0x04,
+  FIND_INFO_RESP   : 0x05,
+  READ_BY_TYPE_REQ : 0x08,
+  READ_BY_TYPE_RESP: 0x09,
+  READ_REQ         : 0x0A,
+  READ_RESP        : 0x0B,
+  READ_BLOB_REQ    : 0x0C,
+  READ_BLOB_RESP   : 0x0D,
+  READ_MULTI_REQ   : 0x0E,
+  READ_MULTI_RESP  : 0x0F,
+  READ_BY_GROUP_REQ: 0x10,
+  READ_BY_GROUP_RESP: 0x11,
+  WRITE_REQ        : 0x12,
+  WRITE_RESP       : 0x13,
+  PREP_WRITE_REQ   : 0x16,
+  PREP_WRITE_RESP  : 0x17,
+  EXEC_WRITE_REQ   : 0x18,
+  EXEC_WRITE_RESP  : 0x19,
+  NOTIFICATION     : 0x1B,
+  INDICATION       : 0x1D,
+  CONFIRMATION     : 0x1E,
+  WRITE_CMD        : 0x52
+};
+
+var ErrorCodes = {
+  INVALID_HANDLE  : 0x01,
+  REQ_NOT_SUPP    : 0x06,
+  INVALID_OFFSET  : 0x07,
+  ATTR_NOT_FOUND  : 0x0A
+};
+
+var PRIMARY_SERVICE = 0x2800;
+var CHARACTERISTIC = 0x2803;
+
+// Attribute values, indexed by handle, and their types
+function createDatabase() {
+  var longValue = new Buffer(100);
+  for (var i = 0; i < longValue.length; i++) longValue[i] = i;
+
+  var db = [];
+  function add(handle, type, value) {
+    db[handle] = { type: type, value: new Buffer(value) };
+  }
+
+  // GAP, with the device name
+  add(0x0001, PRIMARY_SERVICE, [0x00, 0x18]);
+  add(0x0002, CHARACTERISTIC, [0x02, 0x03, 0x00, 0x00, 0x2A]);
+  add(0x0003, 0x2A00, 'fake');
+
+  // Battery
+  add(0x0004, PRIMARY_SERVICE, [0x0F, 0x18]);
+  add(0x0005, CHARACTERISTIC, [0x12, 0x06, 0x00, 0x19, 0x2A]);
+  add(0x0006, 0x2A19, [90]);
+  add(0x0007, 0x2902, [0x00, 0x00]);
+
+  // Heart rate, plus a long value and a writable one
+  add(0x0008, PRIMARY_SERVICE, [0x0D, 0x18]);
+  add(0x0009, CHARACTERISTIC, [0x10, 0x0A, 0x00, 0x37, 0x2A]);
+  add(0x000A, 0x2A37, [0x00, 60]);
+  add(0x000B, 0x2902, [0x00, 0x00]);
+  add(0x000C, CHARACTERISTIC, [0x02, 0x0D, 0x00, 0xF1, 0xFF]);
+  add(0x000D, 0xFFF1, longValue);
+  add(0x000E, CHARACTERISTIC, [0x0A, 0x0F, 0x00, 0xF2, 0xFF]);
+  add(0x000F, 0xFFF2, [0x01, 0x02, 0x03, 0x04]);
+
+  return db;
+}
+
+// End handle of the service starting at the given handle
+function serviceEnd(db, handle) {
+  for (var h = handle + 1; h < db.length; h++) {
+    if (db[h] && db[h].type == PRIMARY_SERVICE) return h - 1;
+  }
+  return db.length - 1;
+}
+
+//
+// Listen on the given path, and call back once the Peripheral has connected.
+// Every request received is kept in requests, as a Buffer. With hold set,
+// responses are kept back until release() is called.
+//
+var FakeDevice = module.exports = function(path, callback) {
+  var self = this;
+  this.db = createDatabase();
+  this.mtu = 23;
+  this.serverMTU = 100;
+  this.requests = [];
+  this.prepared = [];
+  this.hold = false;
+  this.held = [];
+
+  btle.listen({transport: btle.Transports.UNIX, path: path}, function(err, central) {
+    if (err) return callback(err);
+    self.central = central;
+    central.on('data', function(data) {
+      // The data's a slice of a shared buffer, so copy it
+      self.onRequest(new Buffer(data));
+    });
+    central.on('error', function(err) {
+      self.error = err;
+    });
+    callback(null, self);
+  });
+}
+
+FakeDevice.Opcodes = Opcodes;
+FakeDevice.ErrorCodes = ErrorCodes;
+
+// Opcodes of the requests received so far
+FakeDevice.prototype.opcodes = function() {
+  return this.requests.map(function(pdu) { return pdu[0]; });
+}
+
+FakeDevice.prototype.close = function() {
+  this.central.close();
+}
+
+// Send any responses which were held back
+FakeDevice.prototype.release = function() {
+  var held = this.held;
+  this.held = [];
+  this.hold = false;
+  for (var i = 0; i < held.length; i++) {
+    this.central.write(held[i]);
+  }
+}
+
+FakeDevice.prototype.notify = function(handle, value) {
+  this.send(Opcodes.NOTIFICATION, handle, value);
+}
+
+FakeDevice.prototype.indicate = function(handle, value) {
+  this.send(Opcodes.INDICATION, handle, value);
+}
+
+// Send a PDU made of an opcode, a handle and a value straight away
+FakeDevice.prototype.send = function(opcode, handle, value) {
+  var pdu = new Buffer(3 + value.length);
+  pdu[0] = opcode;
+  pdu.writeUInt16LE(handle, 1);
+  new Buffer(value).copy(pdu, 3);
+  this.central.write(pdu);
+}
+
+FakeDevice.prototype.respond = function(pdu) {
+  if (this.hold) {
+    this.held.push(pdu);
+  } else {
+    this.central.write(pdu);
+  }
+}
+
+FakeDevice.prototype.respondError = function(request, handle, code) {
+  var pdu = new Buffer(5);
+  pdu[0] = Opcodes.ERROR;
+  pdu[1] = request;
+  pdu.writeUInt16LE(handle, 2);
+  pdu[4] = code;
+  this.respond(pdu);
+}
+
+FakeDevice.prototype.onRequest = function(pdu) {
+  var opcode = pdu[0];
+  if (opcode != Opcodes.CONFIRMATION) {
+    this.requests.push(pdu);
+  }
+
+  switch (opcode) {
+    case Opcodes.MTU_REQ:
+      var clientMTU = pdu.readUInt16LE(1);
+      this.mtu = Math.min(clientMTU, this.serverMTU);
+      var resp = new Buffer(3);
+      resp[0] = Opcodes.MTU_RESP;
+      resp.writeUInt16LE(this.serverMTU, 1);
+      return this.respond(resp);
+
+    case Opcodes.FIND_INFO_REQ:
+      return this.findInformation(pdu.readUInt16LE(1), pdu.readUInt16LE(3));
+
+    case Opcodes.READ_BY_TYPE_REQ:
+      return this.readByType(pdu.readUInt16LE(1), pdu.readUInt16LE(3), pdu.slice(5));
+
+    case Opcodes.READ_BY_GROUP_REQ:
+      return this.readByGroupType(pdu.readUInt16LE(1), pdu.readUInt16LE(3), pdu.slice(5));
+
+    case Opcodes.READ_REQ:
+      return this.read(opcode, pdu.readUInt16LE(1), 0);
+
+    case Opcodes.READ_BLOB_REQ:
+      return this.read(opcode, pdu.readUInt16LE(1), pdu.readUInt16LE(3));
+
+    case Opcodes.READ_MULTI_REQ:
+      return this.readMultiple(pdu);
+
+    case Opcodes.WRITE_REQ:
+    case Opcodes.WRITE_CMD:
+      var handle = pdu.readUInt16LE(1);
+      if (!this.db[handle]) {
+        if (opcode == Opcodes.WRITE_REQ) this.respondError(opcode, handle, ErrorCodes.INVALID_HANDLE);
+        return;
+      }
+      this.db[handle].value = pdu.slice(3);
+      if (opcode == Opcodes.WRITE_REQ) this.respond(new Buffer([Opcodes.WRITE_RESP]));
+      return;
+
+    case Opcodes.PREP_WRITE_REQ:
+      this.prepared.push({ handle: pdu.readUInt16LE(1), offset: pdu.readUInt16LE(3), value: pdu.slice(5) });
+      var echo = new Buffer(pdu);
+      echo[0] = Opcodes.PREP_WRITE_RESP;
+      return this.respond(echo);
+
+    case Opcodes.EXEC_WRITE_REQ:
+      if (pdu[1] == 0x01) {
+        for (var i = 0; i < this.prepared.length; i++) {
+          var write = this.prepared[i];
+          var attribute = this.db[write.handle];
+          attribute.value = Buffer.concat([attribute.value.slice(0, write.offset), write.value]);
+        }
+      }
+      this.prepared = [];
+      return this.respond(new Buffer([Opcodes.EXEC_WRITE_RESP]));
+
+    case Opcodes.CONFIRMATION:
+      this.confirmations = (this.confirmations || 0) + 1;
+      return;
+
+    default:
+      return this.respondError(opcode, 0, ErrorCodes.REQ_NOT_SUPP);
+  }
+}
+
+FakeDevice.prototype.findInformation = function(start, end) {
+  var entries = [];
+  for (var h = start; h <= end && h < this.db.length && 1 + (entries.length + 1) * 4 <= this.mtu; h++) {
+    if (!this.db[h]) continue;
+    var entry = new Buffer(4);
+    entry.writeUInt16LE(h, 0);
+    entry.writeUInt16LE(this.db[h].type, 2);
+    entries.push(entry);
+  }
+  if (entries.length == 0) {
+    return this.respondError(Opcodes.FIND_INFO_REQ, start, ErrorCodes.ATTR_NOT_FOUND);
+  }
+  this.respond(Buffer.concat([new Buffer([Opcodes.FIND_INFO_RESP, 0x01])].concat(entries)));
+}
+
+// All the values in a response have to be the same length, so stop at the
+// first which isn't
+FakeDevice.prototype.readByType = function(start, end, type) {
+  var uuid = type.length == 2 ? type.readUInt16LE(0) : -1;
+  var entries = [];
+  var length = -1;
+  var size = 2;
+  for (var h = start; h <= end && h < this.db.length; h++) {
+    if (!this.db[h] || this.db[h].type != uuid) continue;
+    var value = this.db[h].value.slice(0, Math.min(this.mtu - 4, 253));
+    if (length >= 0 && value.length != length) break;
+    if (size + 2 + value.length > this.mtu) break;
+    length = value.length;
+    var entry = new Buffer(2 + value.length);
+    entry.writeUInt16LE(h, 0);
+    value.copy(entry, 2);
+    entries.push(entry);
+    size += entry.length;
+  }
+  if (entries.length == 0) {
+    return this.respondError(Opcodes.READ_BY_TYPE_REQ, start, ErrorCodes.ATTR_NOT_FOUND);
+  }
+  this.respond(Buffer.concat([new Buffer([Opcodes.READ_BY_TYPE_RESP, 2 + length])].concat(entries)));
+}
+
+FakeDevice.prototype.readByGroupType = function(start, end, type) {
+  var entries = [];
+  var size = 2;
+  if (type.length == 2 && type.readUInt16LE(0) == PRIMARY_SERVICE) {
+    for (var h = start; h <= end && h < this.db.length && size + 6 <= this.mtu; h++) {
+      if (!this.db[h] || this.db[h].type != PRIMARY_SERVICE) continue;
+      var entry = new Buffer(6);
+      entry.writeUInt16LE(h, 0);
+      entry.writeUInt16LE(serviceEnd(this.db, h), 2);
+      this.db[h].value.copy(entry, 4);
+      entries.push(entry);
+      size += entry.length;
+    }
+  }
+  if (entries.length == 0) {
+    return this.respondError(Opcodes.READ_BY_GROUP_REQ, start, ErrorCodes.ATTR_NOT_FOUND);
+  }
+  this.respond(Buffer.concat([new Buffer([Opcodes.READ_BY_GROUP_RESP, 6])].concat(entries)));
+}
+
+FakeDevice.prototype.read = function(request, handle, offset) {
+  var attribute = this.db[handle];
+  if (!attribute) {
+    return this.respondError(request, handle, ErrorCodes.INVALID_HANDLE);
+  }
+  if (offset > attribute.value.length) {
+    return this.respondError(request, handle, ErrorCodes.INVALID_OFFSET);
+  }
+  var value = attribute.value.slice(offset, offset + this.mtu - 1);
+  var opcode = request == Opcodes.READ_REQ ? Opcodes.READ_RESP : Opcodes.READ_BLOB_RESP;
+  this.respond(Buffer.concat([new Buffer([opcode]), value]));
+}
+
+FakeDevice.prototype.readMultiple = function(pdu) {
+  var values = [new Buffer([Opcodes.READ_MULTI_RESP])];
+  for (var i = 1; i + 1 < pdu.length; i += 2) {
+    var handle = pdu.readUInt16LE(i);
+    if (!this.db[handle]) {
+      return this.respondError(Opcodes.READ_MULTI_REQ, handle, ErrorCodes.INVALID_HANDLE);
+    }
+    values.push(this.db[handle].value);
+  }
+  this.respond(Buffer.concat(values).slice(0, this.mtu));
+}
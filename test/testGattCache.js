@@ -0,0 +1,116 @@
+// Caching discovered GATT databases
+var assert = require('assert');
+var fs = require('fs');
+var btle = require('../lib/btle');
+var deviceTest = require('./deviceTest');
+
+var connect = deviceTest.connect;
+var finish = deviceTest.finish;
+var tmpPath = deviceTest.tmpPath;
+var unlink = deviceTest.unlink;
+
+// The services, characteristics and descriptors in a discoverAll() result
+function describe(services) {
+  return JSON.stringify(services);
+}
+
+// Discovery is cached, so the second connection to the same address doesn't
+// send any requests
+function testCacheHit(done) {
+  var cachePath = tmpPath('cache');
+  btle.setGattCache(cachePath);
+
+  connect({}, function(fake, device) {
+    device.discoverAll(function(err, services) {
+      assert.ifError(err);
+      assert(fake.requests.length > 0);
+      var fresh = describe(services);
+      finish(fake, device, function() {
+        connect({}, function(fake, device) {
+          device.discoverAll(function(err, services) {
+            assert.ifError(err);
+            assert.equal(describe(services), fresh);
+            assert.equal(fake.requests.length, 0);
+
+            // Turning the cache off writes it out
+            btle.setGattCache(null);
+            var key = readCacheKey(cachePath);
+            unlink(cachePath);
+            finish(fake, device, function() {
+              testCorruptCache(key, fresh, done);
+            });
+          });
+        });
+      });
+    });
+  });
+}
+
+// Key of the first entry in a cache file
+function readCacheKey(cachePath) {
+  var file = fs.readFileSync(cachePath);
+  assert.equal(file.toString('ascii', 0, 4), 'BTGC');
+  assert(file.readUInt32LE(8) > 0);
+  return file.slice(13, 13 + file[12]);
+}
+
+// A corrupt cache entry is ignored, and doesn't leave anything in the results
+function testCorruptCache(key, fresh, done) {
+  var cachePath = tmpPath('cache');
+
+  // One service, whose UUID is cut short
+  var layout = new Buffer([1, 0, 0, 0, 0, 0, 0x00, 0x01, 0x00, 0x02, 0, 0, 2, 0x00]);
+
+  var header = new Buffer(12);
+  header.write('BTGC', 0, 'ascii');
+  header.writeUInt32LE(1, 4);
+  header.writeUInt32LE(1, 8);
+  var length = new Buffer(4);
+  length.writeUInt32LE(layout.length, 0);
+  fs.writeFileSync(cachePath, Buffer.concat([header, new Buffer([key.length]), key, length, layout]));
+  btle.setGattCache(cachePath);
+
+  connect({}, function(fake, device) {
+    device.discoverAll(function(err, services) {
+      assert.ifError(err);
+      assert.equal(describe(services), fresh);
+      assert(fake.requests.length > 0);
+
+      btle.setGattCache(null);
+      unlink(cachePath);
+      finish(fake, device, done);
+    });
+  });
+}
+
+// Replacing the cache while an I/O thread is running a discovery is safe,
+// and the result goes in the new cache. The I/O threads stay on for the rest
+// of the script, so this runs last.
+function testCacheReplaced(done) {
+  var firstPath = tmpPath('cache');
+  var secondPath = tmpPath('cache');
+  btle.setGattCache(firstPath);
+  btle.setIOThreads(2);
+
+  connect({}, function(fake, device) {
+    fake.hold = true;
+    device.discoverAll(function(err, services) {
+      assert.ifError(err);
+      btle.setGattCache(null);
+      assert(readCacheKey(secondPath).length > 0);
+      unlink(firstPath);
+      unlink(secondPath);
+      finish(fake, device, done);
+    });
+
+    setTimeout(function() {
+      btle.setGattCache(secondPath);
+      fake.release();
+    }, 50);
+  });
+}
+
+deviceTest.run([
+  testCacheHit,
+  testCacheReplaced
+]);
@@ -0,0 +1,51 @@
+// Long reads, and long and reliable writes
+var assert = require('assert');
+var deviceTest = require('./deviceTest');
+var FakeDevice = require('./fakeDevice');
+
+var connect = deviceTest.connect;
+var finish = deviceTest.finish;
+var Opcodes = FakeDevice.Opcodes;
+
+function testReadLong(done) {
+  connect({}, function(fake, device) {
+    device.readLongHandle(0x000D, function(err, value, offset, complete) {
+      assert.ifError(err);
+      assert(complete);
+      assert.equal(value.length, 100);
+      for (var i = 0; i < value.length; i++) assert.equal(value[i], i);
+
+      // 22 bytes at a time at the default MTU
+      var opcodes = fake.opcodes();
+      assert.equal(opcodes.length, 5);
+      for (var i = 1; i < opcodes.length; i++) assert.equal(opcodes[i], Opcodes.READ_BLOB_REQ);
+      finish(fake, device, done);
+    });
+  });
+}
+
+function testReliableWrite(done) {
+  connect({}, function(fake, device) {
+    assert.throws(function() {
+      device.reliableWrite([], function() {});
+    }, TypeError);
+
+    var values = [
+      { handle: 0x000F, value: new Buffer([9, 9, 9, 9]) },
+      { handle: 0x0003, value: new Buffer('renamed') }
+    ];
+    device.reliableWrite(values, function(err) {
+      assert.ifError(err);
+      assert.equal(fake.db[0x000F].value.toString('hex'), '09090909');
+      assert.equal(fake.db[0x0003].value.toString(), 'renamed');
+      var opcodes = fake.opcodes();
+      assert.equal(opcodes[opcodes.length - 1], Opcodes.EXEC_WRITE_REQ);
+      finish(fake, device, done);
+    });
+  });
+}
+
+deviceTest.run([
+  testReadLong,
+  testReliableWrite
+]);
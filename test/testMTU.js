@@ -0,0 +1,23 @@
+// MTU exchange
+var assert = require('assert');
+var deviceTest = require('./deviceTest');
+
+var connect = deviceTest.connect;
+var finish = deviceTest.finish;
+
+function testExchangeMTU(done) {
+  connect({}, function(fake, device) {
+    assert.equal(device.getMTU(), 23);
+    device.exchangeMTU(200, function(err, mtu) {
+      assert.ifError(err);
+      assert.equal(mtu, fake.serverMTU);
+      assert.equal(device.getMTU(), fake.serverMTU);
+      assert.equal(fake.requests[0].readUInt16LE(1), 200);
+      finish(fake, device, done);
+    });
+  });
+}
+
+deviceTest.run([
+  testExchangeMTU
+]);
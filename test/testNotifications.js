@@ -0,0 +1,161 @@
+// Notification listeners: filters, decoding, batches, rings and the attribute mirror
+var assert = require('assert');
+var btle = require('../lib/btle');
+var deviceTest = require('./deviceTest');
+var FakeDevice = require('./fakeDevice');
+
+var connect = deviceTest.connect;
+var errorText = deviceTest.errorText;
+var finish = deviceTest.finish;
+var Opcodes = FakeDevice.Opcodes;
+
+// Filters, decoding, and the attribute mirror
+function testNotificationFilters(done) {
+  connect({}, function(fake, device) {
+    var values = [];
+    var heartRates = [];
+    var decodeErrors = 0;
+
+    device.addNotificationListener(0x0006, {changedOnly: true}, function(err, value) {
+      assert.ifError(err);
+      values.push(value[0]);
+    });
+    device.addNotificationListener(0x000A, {decode: '2a37'}, function(err, hr) {
+      if (err) {
+        assert(/Malformed/.test(errorText(err)));
+        decodeErrors++;
+      } else {
+        heartRates.push(hr.heartRate);
+      }
+    });
+
+    fake.notify(0x0006, [1]);
+    fake.notify(0x0006, [1]);
+    fake.notify(0x0006, [2]);
+    fake.notify(0x000A, [0x00, 72]);
+    fake.notify(0x000A, [0x01, 72]);  // 16-bit heart rate, but only one byte of it
+    fake.central.write(new Buffer([Opcodes.NOTIFICATION, 0x0A]));  // too short to have a handle
+    fake.indicate(0x0006, [3]);
+
+    setTimeout(function() {
+      assert.deepEqual(values, [1, 2, 3]);
+      assert.deepEqual(heartRates, [72]);
+      assert.equal(decodeErrors, 1);
+      assert.equal(fake.confirmations, 1);
+      assert.equal(device.getCachedValue(0x0006).value[0], 3);
+      assert.equal(fake.requests.length, 0);
+
+      // Writing the value clears it from the mirror
+      device.writeRequest(0x0006, new Buffer([4]), function(err) {
+        assert.ifError(err);
+        finish(fake, device, done);
+      });
+      assert.equal(device.getCachedValue(0x0006), undefined);
+    }, 100);
+  });
+}
+
+// Listeners without a callback go to the batch callback, and maxRate holds
+// back values which come too fast, passing on the latest
+function testNotificationBatch(done) {
+  connect({}, function(fake, device) {
+    var batched = [];
+    btle.setNotificationBatchCallback(function(values, index, count) {
+      for (var i = 0, pos = 0; i < count; i++, pos += 12) {
+        var offset = index.readUInt32LE(pos);
+        var value = values.slice(offset, offset + index.readUInt16LE(pos + 4));
+        assert.equal(index.readUInt16LE(pos + 6), 0x0006);
+        assert.equal(index.readUInt32LE(pos + 8), device.getConnectionId());
+        batched.push(value[0]);
+      }
+    });
+
+    device.addNotificationListener(0x0006, {maxRate: 10});
+    fake.notify(0x0006, [1]);
+    fake.notify(0x0006, [2]);
+    fake.notify(0x0006, [3]);
+
+    setTimeout(function() {
+      assert.deepEqual(batched, [1]);
+    }, 50);
+    setTimeout(function() {
+      assert.deepEqual(batched, [1, 3]);
+      btle.setNotificationBatchCallback(null);
+      finish(fake, device, done);
+    }, 300);
+  });
+}
+
+// A read with maxAge is answered from the mirror, without a request, and can
+// still be cancelled
+function testCachedRead(done) {
+  connect({}, function(fake, device) {
+    fake.notify(0x0006, [5]);
+
+    setTimeout(function() {
+      var cancelled = false;
+      var first = device.readHandle(0x0006, {maxAge: 5000}, function(err, value) {
+        assert.ifError(err);
+        assert.equal(value[0], 5);
+        assert(cancelled);
+        assert.equal(fake.requests.length, 0);
+        finish(fake, device, done);
+      });
+      var second = device.readHandle(0x0006, {maxAge: 5000}, function(err, value) {
+        assert(/cancelled/.test(errorText(err)));
+        cancelled = true;
+      });
+      assert(first > 0);
+      assert.notEqual(first, second);
+      assert(device.cancel(second));
+    }, 100);
+  });
+}
+
+function testNotificationRing(done) {
+  connect({}, function(fake, device) {
+    var ring = new btle.NotificationRing(64);
+    device.addNotificationListener(0x000A, ring);
+
+    // A ring after filter options works too
+    var filtered = new btle.NotificationRing(64);
+    device.addNotificationListener(0x0006, {changedOnly: true}, filtered);
+    fake.notify(0x0006, [1]);
+    fake.notify(0x0006, [1]);
+
+    // Each record takes 20 bytes, so three fit in the ring and the rest drop
+    for (var i = 0; i < 5; i++) {
+      fake.notify(0x000A, [0x00, 60 + i]);
+    }
+
+    setTimeout(function() {
+      var values = [];
+      var count = ring.read(function(connectionId, handle, value, timestamp) {
+        assert.equal(connectionId, device.getConnectionId());
+        assert.equal(handle, 0x000A);
+        values.push(value[1]);
+      });
+      assert.equal(count, 3);
+      assert.deepEqual(values, [60, 61, 62]);
+      assert.equal(ring.getDrops(), 2);
+      assert.equal(filtered.read(function() {}), 1);
+
+      fake.notify(0x000A, [0x00, 70]);
+      setTimeout(function() {
+        values = [];
+        ring.read(function(connectionId, handle, value) {
+          values.push(value[1]);
+        });
+        assert.deepEqual(values, [70]);
+        finish(fake, device, done);
+      }, 50);
+    }, 100);
+  });
+}
+
+deviceTest.run([
+  testNotificationFilters,
+  testNotificationBatch,
+  testCachedRead,
+  testNotificationRing
+]);
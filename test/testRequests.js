@@ -0,0 +1,65 @@
+// Request queueing, ordering, and shared and combined reads
+var assert = require('assert');
+var deviceTest = require('./deviceTest');
+var FakeDevice = require('./fakeDevice');
+
+var connect = deviceTest.connect;
+var finish = deviceTest.finish;
+var Opcodes = FakeDevice.Opcodes;
+
+// Requests go out one at a time, in the order they were made, and reads
+// combined at the end of the tick still go before a write made after them
+function testRequestOrdering(done) {
+  connect({}, function(fake, device) {
+    var results = [];
+    device.readHandle(0x000F, {length: 4}, function(err, value) {
+      assert.ifError(err);
+      results.push('read ' + value.toString('hex'));
+    });
+    device.writeRequest(0x000F, new Buffer([5, 6, 7, 8]), function(err) {
+      assert.ifError(err);
+      results.push('write');
+    });
+    device.readHandle(0x0003, function(err, value) {
+      assert.ifError(err);
+      results.push('read ' + value.toString());
+    });
+    device.readHandle(0x000F, function(err, value) {
+      assert.ifError(err);
+      results.push('read ' + value.toString('hex'));
+
+      assert.deepEqual(results, ['read 01020304', 'write', 'read fake', 'read 05060708']);
+      assert.deepEqual(fake.opcodes(), [Opcodes.READ_REQ, Opcodes.WRITE_REQ, Opcodes.READ_REQ, Opcodes.READ_REQ]);
+      finish(fake, device, done);
+    });
+  });
+}
+
+// Reads of the same handle share a request, and reads with a length hint
+// are combined into a Read Multiple
+function testSharedAndCombinedReads(done) {
+  connect({}, function(fake, device) {
+    var count = 0;
+    function check(expected) {
+      return function(err, value) {
+        assert.ifError(err);
+        assert.equal(value.toString('hex'), expected);
+        if (++count < 4) return;
+
+        assert.deepEqual(fake.opcodes(), [Opcodes.READ_REQ, Opcodes.READ_MULTI_REQ]);
+        finish(fake, device, done);
+      };
+    }
+    device.readHandle(0x000F, check('01020304'));
+    device.readHandle(0x000F, check('01020304'));
+    setTimeout(function() {
+      device.readHandle(0x0006, {length: 1}, check('5a'));
+      device.readHandle(0x000F, {length: 4}, check('01020304'));
+    }, 50);
+  });
+}
+
+deviceTest.run([
+  testRequestOrdering,
+  testSharedAndCombinedReads
+]);
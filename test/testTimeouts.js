@@ -0,0 +1,146 @@
+// Request timeouts and cancellation
+var assert = require('assert');
+var deviceTest = require('./deviceTest');
+var FakeDevice = require('./fakeDevice');
+
+var connect = deviceTest.connect;
+var errorText = deviceTest.errorText;
+var finish = deviceTest.finish;
+var Opcodes = FakeDevice.Opcodes;
+
+// A request timing out fails it and everything after it, and the connection
+// can't be used any more
+function testTimeout(done) {
+  connect({requestTimeout: 200}, function(fake, device) {
+    var errors = [];
+    var start = Date.now();
+    fake.hold = true;
+
+    device.on('error', function(err) {
+      errors.push('error event');
+    });
+    device.readHandle(0x0003, function(err, value) {
+      assert(err);
+      assert(/timed out/.test(errorText(err)));
+      assert(Date.now() - start >= 100);
+      errors.push('first');
+
+      // A retry from the callback fails too, after the queued request
+      device.readHandle(0x0003, function(err, value) {
+        assert(/not sent/.test(errorText(err)));
+        errors.push('retry');
+      });
+    });
+    device.readHandle(0x0006, function(err, value) {
+      assert(err);
+      errors.push('second');
+
+      setTimeout(function() {
+        assert.deepEqual(errors, ['first', 'second', 'error event', 'retry']);
+        device.readHandle(0x0006, function(err, value) {
+          assert(/not sent/.test(errorText(err)));
+          assert.equal(fake.requests.length, 1);
+          finish(fake, device, done);
+        });
+      }, 10);
+    });
+  });
+}
+
+// Cancelling calls back with an error; a request in flight still holds up
+// the queue until its response comes, which is then dropped
+function testCancel(done) {
+  connect({}, function(fake, device) {
+    var results = [];
+    fake.hold = true;
+
+    var first = device.readHandle(0x0003, function(err, value) {
+      assert(/cancelled/.test(errorText(err)));
+      results.push('first');
+    });
+    var second = device.readHandle(0x0006, function(err, value) {
+      assert(/cancelled/.test(errorText(err)));
+      results.push('second');
+    });
+    assert(device.cancel(second));
+    assert(device.cancel(first));
+
+    setTimeout(function() {
+      assert.deepEqual(results, ['second', 'first']);
+      assert.equal(fake.requests.length, 1);
+      assert(!device.cancel(first));
+
+      device.readHandle(0x000F, function(err, value) {
+        assert.ifError(err);
+        assert.equal(value.toString('hex'), '01020304');
+        assert.deepEqual(fake.opcodes(), [Opcodes.READ_REQ, Opcodes.READ_REQ]);
+        finish(fake, device, done);
+      });
+      fake.release();
+    }, 50);
+  });
+}
+
+// A request's own timeout option overrides the connection's
+function testRequestTimeoutOption(done) {
+  connect({requestTimeout: 5000}, function(fake, device) {
+    var start = Date.now();
+    fake.hold = true;
+
+    assert.throws(function() {
+      device.readHandle(0x0003, {timeout: -1}, function() {});
+    }, TypeError);
+
+    // Without a listener, the 'error' event would throw
+    device.on('error', function(err) {
+    });
+    device.writeRequest(0x0006, new Buffer([1]), {timeout: 200}, function(err) {
+      assert(/timed out/.test(errorText(err)));
+      var elapsed = Date.now() - start;
+      assert(elapsed >= 100 && elapsed < 2000);
+      finish(fake, device, done);
+    });
+  });
+}
+
+// The device going away fails the request in flight and the queued ones,
+// and anything asked for after that
+function testConnectionClosed(done) {
+  connect({}, function(fake, device) {
+    var errors = [];
+    fake.hold = true;
+
+    device.readHandle(0x0003, function(err, value) {
+      assert(err);
+      errors.push('first');
+      device.readHandle(0x0003, function(err, value) {
+        assert(/not sent/.test(errorText(err)));
+        errors.push('retry');
+      });
+    });
+    device.writeRequest(0x0006, new Buffer([1]), function(err) {
+      assert(err);
+      errors.push('second');
+    });
+
+    setTimeout(function() {
+      assert.equal(fake.requests.length, 1);
+      fake.close();
+
+      setTimeout(function() {
+        assert.deepEqual(errors, ['first', 'second', 'retry']);
+        device.readHandle(0x0006, {length: 1}, function(err, value) {
+          assert(/not sent/.test(errorText(err)));
+          finish(fake, device, done);
+        });
+      }, 50);
+    }, 50);
+  });
+}
+
+deviceTest.run([
+  testTimeout,
+  testRequestTimeoutOption,
+  testConnectionClosed,
+  testCancel
+]);